@@ -0,0 +1,395 @@
+#include "rpn_async_io.h"
+#include <cerrno>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define RPN_HAS_POSIX_IO
+    #include <sys/uio.h>
+    #include <unistd.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #define RPN_HAS_IO_URING
+        #include <linux/io_uring.h>
+        #include <sys/mman.h>
+        #include <sys/syscall.h>
+    #endif
+#endif
+
+
+namespace RpnCalculator
+{
+#ifdef RPN_HAS_IO_URING
+    // A minimal io_uring: one submission queue and one completion queue, shared with the kernel through mmap.
+    // Only the owner thread submits and reaps (no locking).
+    struct AsyncFileIo::IoUring
+    {
+        int Fd = -1;
+        void* SqRing = MAP_FAILED; size_t SqRingSize = 0;
+        void* CqRing = MAP_FAILED; size_t CqRingSize = 0;
+        io_uring_sqe* Sqes = (io_uring_sqe*)MAP_FAILED; size_t SqesSize = 0;
+        unsigned *SqTail = nullptr, *SqMask = nullptr, *SqArray = nullptr;
+        unsigned *CqHead = nullptr, *CqTail = nullptr, *CqMask = nullptr;
+        io_uring_cqe* Cqes = nullptr;
+        std::vector<iovec> IoVectors;  // one per request
+
+        bool Setup(unsigned nbEntries, size_t nbRequests)
+        {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            Fd = (int)syscall(__NR_io_uring_setup, nbEntries, &params);
+            if (Fd < 0)
+                return false;
+
+            SqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            CqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool isSingleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (isSingleMmap)
+                SqRingSize = CqRingSize = (SqRingSize > CqRingSize) ? SqRingSize : CqRingSize;
+            SqRing = mmap(nullptr, SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQ_RING);
+            if (SqRing == MAP_FAILED)
+                return false;
+            if (isSingleMmap)
+                CqRing = SqRing;
+            else
+            {
+                CqRing = mmap(nullptr, CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_CQ_RING);
+                if (CqRing == MAP_FAILED)
+                    return false;
+            }
+            SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+            Sqes = (io_uring_sqe*)mmap(nullptr, SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQES);
+            if (Sqes == MAP_FAILED)
+                return false;
+
+            char* sq = (char*)SqRing;
+            SqTail = (unsigned*)(sq + params.sq_off.tail);
+            SqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+            SqArray = (unsigned*)(sq + params.sq_off.array);
+            char* cq = (char*)CqRing;
+            CqHead = (unsigned*)(cq + params.cq_off.head);
+            CqTail = (unsigned*)(cq + params.cq_off.tail);
+            CqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+            Cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+            IoVectors.resize(nbRequests);
+            return true;
+        }
+
+        ~IoUring()
+        {
+            if (Sqes != MAP_FAILED)
+                munmap(Sqes, SqesSize);
+            if (CqRing != MAP_FAILED && CqRing != SqRing)
+                munmap(CqRing, CqRingSize);
+            if (SqRing != MAP_FAILED)
+                munmap(SqRing, SqRingSize);
+            if (Fd >= 0)
+                close(Fd);
+        }
+
+        // Returns 0, or -errno
+        int Submit(uint8_t opcode, int fd, Request& request, char* data, size_t size)
+        {
+            iovec& ioVector = IoVectors[request.Index];
+            ioVector.iov_base = data;
+            ioVector.iov_len = size;
+
+            unsigned tail = *SqTail; // we are the only producer
+            unsigned index = tail & *SqMask;
+            io_uring_sqe& sqe = Sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = opcode;
+            sqe.fd = fd;
+            sqe.addr = (uint64_t)(uintptr_t)&ioVector;
+            sqe.len = 1;
+            sqe.off = (uint64_t)request.Offset;
+            sqe.user_data = (uint64_t)(uintptr_t)&request;
+            SqArray[index] = index;
+            __atomic_store_n(SqTail, tail + 1, __ATOMIC_RELEASE);
+
+            while (true)
+            {
+                int result = (int)syscall(__NR_io_uring_enter, Fd, 1, 0, 0, nullptr, 0);
+                if (result >= 0)
+                    return 0;
+                if (errno != EINTR)
+                    return -errno;
+            }
+        }
+
+        // Waits for one completion, and stores its result in its request. Returns 0, or -errno
+        int Reap()
+        {
+            unsigned head = *CqHead; // we are the only consumer
+            while (head == __atomic_load_n(CqTail, __ATOMIC_ACQUIRE))
+            {
+                int result = (int)syscall(__NR_io_uring_enter, Fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (result < 0 && errno != EINTR)
+                    return -errno;
+            }
+            const io_uring_cqe& cqe = Cqes[head & *CqMask];
+            Request* request = (Request*)(uintptr_t)cqe.user_data;
+            request->Result = cqe.res;
+            request->IsDone = true;
+            __atomic_store_n(CqHead, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+    };
+#else
+    struct AsyncFileIo::IoUring {};
+#endif
+
+
+    AsyncFileIo::AsyncFileIo(int inputFd, int outputFd, bool useIoUring)
+        : _inputFd(inputFd), _outputFd(outputFd)
+    {
+#ifdef RPN_HAS_POSIX_IO
+        off_t inputPosition = lseek(inputFd, 0, SEEK_CUR), outputPosition = lseek(outputFd, 0, SEEK_CUR);
+        _isInputSeekable = (inputPosition >= 0);
+        _isOutputSeekable = (outputPosition >= 0);
+        _nextReadOffset = _isInputSeekable ? (int64_t)inputPosition : -1;
+        _nextWriteOffset = _isOutputSeekable ? (int64_t)outputPosition : -1;
+#else
+        (void)useIoUring;
+        ErrorMessage = "file I/O is not supported on this platform";
+        return;
+#endif
+
+#ifdef RPN_HAS_IO_URING
+        if (useIoUring)
+        {
+            _ioUring = std::make_unique<IoUring>();
+            if (_ioUring->Setup(2 * QueueDepth, 2 * QueueDepth))
+                _backend = Backend::IoUring;
+            else
+                _ioUring.reset();
+        }
+#else
+        (void)useIoUring;
+#endif
+        // Pipes must be read and written in order: one request in flight
+        bool isAsync = (_backend == Backend::IoUring);
+        _readDepth = (isAsync && _isInputSeekable) ? QueueDepth : 1;
+        _writeDepth = (isAsync && _isOutputSeekable) ? QueueDepth : 1;
+
+        _reads.resize(_readDepth);
+        _writes.resize(_writeDepth);
+        for (size_t i = 0; i < _readDepth; ++i)
+        {
+            _reads[i].Buffer.resize(BlockSize);
+            _reads[i].Index = i;
+        }
+        for (size_t i = 0; i < _writeDepth; ++i)
+        {
+            _writes[i].Buffer.resize(BlockSize);
+            _writes[i].Index = QueueDepth + i;
+        }
+
+        for (auto& request: _reads)
+            if (!_submitRead(request))
+                break;
+    }
+
+    AsyncFileIo::~AsyncFileIo()
+    {
+        // The kernel may still write to the buffers of the requests in flight
+        for (auto& request: _reads)
+            if (request.IsInFlight)
+                _waitFor(request);
+        for (auto& request: _writes)
+            if (request.IsInFlight)
+                _waitFor(request);
+    }
+
+    bool AsyncFileIo::ReadNext(std::string_view& block)
+    {
+        block = std::string_view();
+        if (!ErrorMessage.empty())
+            return false;
+
+        // The previous block was consumed: reuse its buffer to read further ahead
+        if (_hasReturnedBlock && !_isInputEnd)
+            if (!_submitRead(_reads[(_nextRead - 1) % _readDepth]))
+                return false;
+
+        Request& request = _reads[_nextRead % _readDepth];
+        if (!request.IsInFlight)
+            return true; // end of the input
+        if (!_waitFor(request) || !_completeRead(request))
+            return false;
+        ++_nextRead;
+        _hasReturnedBlock = true;
+        if (request.Size == 0)
+            _isInputEnd = true;
+        block = std::string_view(request.Buffer.data(), request.Size);
+        return true;
+    }
+
+    bool AsyncFileIo::Write(const char* data, size_t size)
+    {
+        if (!ErrorMessage.empty())
+            return false;
+        while (size > 0)
+        {
+            Request& request = _writes[_currentWrite % _writeDepth];
+            if (request.IsInFlight && !(_waitFor(request) && _completeWrite(request)))
+                return false;
+            size_t nbCopied = (size < BlockSize - request.Size) ? size : BlockSize - request.Size;
+            memcpy(request.Buffer.data() + request.Size, data, nbCopied);
+            request.Size += nbCopied;
+            data += nbCopied;
+            size -= nbCopied;
+            if (request.Size == BlockSize)
+            {
+                if (!_submitWrite(request))
+                    return false;
+                ++_currentWrite;
+            }
+        }
+        return true;
+    }
+
+    bool AsyncFileIo::Flush()
+    {
+        if (!ErrorMessage.empty())
+            return false;
+        Request& current = _writes[_currentWrite % _writeDepth];
+        if (!current.IsInFlight && current.Size > 0)
+        {
+            if (!_submitWrite(current))
+                return false;
+            ++_currentWrite;
+        }
+        // In submission order
+        for (size_t i = 0; i < _writeDepth; ++i)
+        {
+            Request& request = _writes[(_currentWrite + i) % _writeDepth];
+            if (request.IsInFlight && !(_waitFor(request) && _completeWrite(request)))
+                return false;
+        }
+        return true;
+    }
+
+    bool AsyncFileIo::_submitRead(Request& request)
+    {
+        request.Size = BlockSize;
+        request.Offset = _nextReadOffset;
+        if (_isInputSeekable)
+            _nextReadOffset += (int64_t)BlockSize;
+        request.IsInFlight = true;
+        request.IsDone = false;
+#ifdef RPN_HAS_IO_URING
+        if (_backend == Backend::IoUring)
+        {
+            int error = _ioUring->Submit(IORING_OP_READV, _inputFd, request, request.Buffer.data(), request.Size);
+            return error == 0 || _setError("io_uring read submission failed", error);
+        }
+#endif
+#ifdef RPN_HAS_POSIX_IO
+        ssize_t result;
+        do
+            result = _isInputSeekable ? pread(_inputFd, request.Buffer.data(), request.Size, (off_t)request.Offset)
+                                      : read(_inputFd, request.Buffer.data(), request.Size);
+        while (result < 0 && errno == EINTR);
+        request.Result = (result < 0) ? -errno : result;
+        request.IsDone = true;
+#endif
+        return true;
+    }
+
+    bool AsyncFileIo::_submitWrite(Request& request)
+    {
+        request.Offset = _nextWriteOffset;
+        if (_isOutputSeekable)
+            _nextWriteOffset += (int64_t)request.Size;
+        request.IsInFlight = true;
+        request.IsDone = false;
+#ifdef RPN_HAS_IO_URING
+        if (_backend == Backend::IoUring)
+        {
+            int error = _ioUring->Submit(IORING_OP_WRITEV, _outputFd, request, request.Buffer.data(), request.Size);
+            return error == 0 || _setError("io_uring write submission failed", error);
+        }
+#endif
+#ifdef RPN_HAS_POSIX_IO
+        ssize_t result;
+        do
+            result = _isOutputSeekable ? pwrite(_outputFd, request.Buffer.data(), request.Size, (off_t)request.Offset)
+                                       : write(_outputFd, request.Buffer.data(), request.Size);
+        while (result < 0 && errno == EINTR);
+        request.Result = (result < 0) ? -errno : result;
+        request.IsDone = true;
+#endif
+        return true;
+    }
+
+    bool AsyncFileIo::_waitFor(Request& request)
+    {
+#ifdef RPN_HAS_IO_URING
+        while (!request.IsDone)
+        {
+            int error = _ioUring->Reap();
+            if (error != 0)
+                return _setError("io_uring wait failed", error);
+        }
+#endif
+        return true;
+    }
+
+    // Short transfers are completed synchronously (they are rare with regular files: e.g. a signal)
+    bool AsyncFileIo::_completeRead(Request& request)
+    {
+        request.IsInFlight = false;
+        if (request.Result < 0)
+            return _setError("read error", request.Result);
+        size_t nbRead = (size_t)request.Result;
+#ifdef RPN_HAS_POSIX_IO
+        while (_isInputSeekable && nbRead > 0 && nbRead < request.Size)
+        {
+            ssize_t result = pread(_inputFd, request.Buffer.data() + nbRead, request.Size - nbRead,
+                                   (off_t)(request.Offset + (int64_t)nbRead));
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result < 0)
+                return _setError("read error", -errno);
+            if (result == 0)
+                break;
+            nbRead += (size_t)result;
+        }
+#endif
+        request.Size = nbRead;
+        return true;
+    }
+
+    bool AsyncFileIo::_completeWrite(Request& request)
+    {
+        request.IsInFlight = false;
+        if (request.Result < 0)
+            return _setError("write error", request.Result);
+        size_t nbWritten = (size_t)request.Result;
+#ifdef RPN_HAS_POSIX_IO
+        while (nbWritten < request.Size)
+        {
+            const char* data = request.Buffer.data() + nbWritten;
+            ssize_t result = _isOutputSeekable
+                ? pwrite(_outputFd, data, request.Size - nbWritten, (off_t)(request.Offset + (int64_t)nbWritten))
+                : write(_outputFd, data, request.Size - nbWritten);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+                return _setError("write error", result < 0 ? -errno : -EIO);
+            nbWritten += (size_t)result;
+        }
+#endif
+        request.Size = 0;
+        return true;
+    }
+
+    bool AsyncFileIo::_setError(const char* what, int64_t errorCode)
+    {
+        if (ErrorMessage.empty())
+            ErrorMessage = std::string(what) + ": " + strerror((int)-errorCode);
+        return false;
+    }
+
+}
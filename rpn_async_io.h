@@ -0,0 +1,86 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+namespace RpnCalculator
+{
+    // Sequential reader of an input file and writer of an output file, which keep several requests in flight,
+    // so that the I/O overlaps with the evaluation (rpn_cli --lines --io-uring).
+    //
+    // The input is read by blocks of BlockSize, up to QueueDepth blocks ahead of the one being evaluated.
+    // Writes are gathered in buffers of BlockSize, and up to QueueDepth of them are in flight.
+    //
+    // Backends:
+    //     * IoUring: Linux io_uring (through the raw system calls: no liburing dependency)
+    //     * Synchronous: plain pread / pwrite (one request at a time), when io_uring is unavailable
+    //       (other platforms, old kernels, or containers which forbid it)
+    // Non seekable files (pipes) are read and written in order, with one request in flight.
+    class AsyncFileIo
+    {
+    public:
+        enum class Backend { IoUring, Synchronous };
+        static constexpr size_t BlockSize = 4 << 20;
+        static constexpr size_t QueueDepth = 8;
+
+        // The file descriptors stay owned by the caller
+        AsyncFileIo(int inputFd, int outputFd, bool useIoUring);
+        ~AsyncFileIo();
+        AsyncFileIo(const AsyncFileIo&) = delete;
+        AsyncFileIo& operator=(const AsyncFileIo&) = delete;
+
+        Backend backend() const { return _backend; }
+
+        // Returns the next block of the input (empty at the end of the input), valid until the next call.
+        // Returns false on error (see ErrorMessage).
+        bool ReadNext(std::string_view& block);
+        // Appends data to the output (data is copied: it may be reused as soon as Write returns)
+        bool Write(const char* data, size_t size);
+        // Waits until all the pending writes are done
+        bool Flush();
+
+        std::string ErrorMessage;
+
+    private:
+        struct Request
+        {
+            std::vector<char> Buffer;
+            size_t Size = 0;          // bytes requested (read) or filled (write)
+            int64_t Offset = -1;      // -1: current position of a non seekable file
+            bool IsInFlight = false;
+            bool IsDone = false;      // the completion was received (Result is valid)
+            int64_t Result = 0;       // bytes transferred, or -errno
+            size_t Index = 0;         // index of its struct iovec, for the io_uring backend
+        };
+        struct IoUring;
+
+        bool _submitRead(Request& request);
+        bool _submitWrite(Request& request);
+        bool _waitFor(Request& request);
+        bool _completeRead(Request& request);
+        bool _completeWrite(Request& request);
+        bool _setError(const char* what, int64_t errorCode);
+
+        Backend _backend = Backend::Synchronous;
+        std::unique_ptr<IoUring> _ioUring;
+
+        int _inputFd, _outputFd;
+        bool _isInputSeekable = false, _isOutputSeekable = false;
+        size_t _readDepth = 1, _writeDepth = 1;
+
+        std::vector<Request> _reads;   // ring: _reads[_nextRead % _readDepth] is the next block of the input
+        size_t _nextRead = 0;
+        int64_t _nextReadOffset = 0;
+        bool _isInputEnd = false;      // a read returned 0 bytes (no more reads are submitted)
+        bool _hasReturnedBlock = false;
+
+        std::vector<Request> _writes;  // ring: _writes[_currentWrite % _writeDepth] is being filled
+        size_t _currentWrite = 0;
+        int64_t _nextWriteOffset = 0;
+    };
+
+}
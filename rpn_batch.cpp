@@ -0,0 +1,309 @@
+#include "rpn_batch.h"
+#include "rpn_jit.h"
+#include "rpn_simd_kernels.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+
+namespace RpnCalculator
+{
+    // The stack has the same depth for all the rows: its errors are known before any row is evaluated
+    bool BatchEvaluator::_checkStackDepth(const Program& program)
+    {
+        // The program is verified: each row starts with an empty stack, so no instruction underflows if the program
+        // needs no value when it starts
+        if (program.MinEntryDepth > 0)
+        {
+            ErrorMessage = "Not enough values on the stack";
+            return false;
+        }
+        size_t nbRequired;
+        int depthChange;
+        int64_t depth = 0;
+        for (const auto& instruction: program.Code)
+        {
+            GetStackEffect(instruction.Op, nbRequired, depthChange);
+            depth = (instruction.Op == Instr::Clear) ? 0 : depth + depthChange;
+        }
+        if (depth == 0)
+        {
+            ErrorMessage = "The program leaves the stack empty";
+            return false;
+        }
+        return true;
+    }
+
+    bool BatchEvaluator::Evaluate(const Program& program, const double* inputs, double* outputs, size_t count)
+    {
+        ErrorMessage.clear();
+        if (!_checkStackDepth(program))
+            return false;
+        if (UseJit)
+        {
+            if (const JitFunction* function = SharedJitCache().Find(program, AngleUnit))
+            {
+                function->Evaluate(inputs, outputs, count);
+                return true;
+            }
+        }
+        _stack.resize((program.MaxGrowth + 2) * BlockSize); // + 2 scratch slots
+        _storedValues.resize(BlockSize);
+        _rowFailed.resize(BlockSize);
+
+        for (size_t start = 0; start < count; start += BlockSize)
+        {
+            size_t nbRows = (count - start < BlockSize) ? count - start : BlockSize;
+            if (!_evaluateBlock(program, inputs + start, outputs + start, nbRows))
+                return false;
+        }
+        return true;
+    }
+
+    bool BatchEvaluator::EvaluateParallel(const Program& program, const double* inputs, double* outputs, size_t count,
+                                          ThreadPool& threadPool)
+    {
+        ErrorMessage.clear();
+        if (!_checkStackDepth(program))
+            return false;
+        _workerEvaluators.resize(threadPool.size());
+        std::vector<char> workerFailed(threadPool.size(), 0);
+        for (auto& evaluator: _workerEvaluators)
+        {
+            evaluator.AngleUnit = AngleUnit;
+            evaluator.UseJit = UseJit;
+        }
+
+        threadPool.ParallelFor(count, ChunkSize, [&](size_t begin, size_t end, size_t workerIndex) {
+            BatchEvaluator& evaluator = _workerEvaluators[workerIndex];
+            if (!evaluator.Evaluate(program, inputs + begin, outputs + begin, end - begin))
+                workerFailed[workerIndex] = 1;
+        });
+
+        // Errors do not depend on the row values (the stack depth is the same for all rows): report any of them
+        for (size_t i = 0; i < workerFailed.size(); ++i)
+        {
+            if (workerFailed[i])
+            {
+                ErrorMessage = _workerEvaluators[i].ErrorMessage;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool BatchEvaluator::_evaluateBlock(const Program& program, const double* inputs, double* outputs, size_t nbRows)
+    {
+        const size_t n = nbRows;
+        double* stack = _stack.data();
+        double* storedValues = _storedValues.data();
+        char* rowFailed = _rowFailed.data();
+        for (size_t i = 0; i < n; ++i)
+        {
+            storedValues[i] = 0.;
+            rowFailed[i] = 0;
+        }
+
+        // The stack has the same depth for all the rows: slot(d) holds the values of stack level d for all the rows
+        size_t depth = 0;
+        auto slot = [stack](size_t d) { return stack + d * BlockSize; };
+        AngleUnitType angleUnit = AngleUnit;
+        const double* constants = program.Constants.data();
+
+        #define RPN_LANES_UNARY(expr) { \
+            double* top = slot(depth - 1); \
+            for (size_t i = 0; i < n; ++i) { double a = top[i]; top[i] = (expr); } \
+            break; }
+        // The kernels write to the top slot, using the free slot above it (slot(depth)) as scratch
+        #define RPN_KERNEL_BINARY(kernel) { \
+            double* as = slot(depth - 2); \
+            Kernels::kernel(as, slot(depth - 1), slot(depth), n); \
+            memcpy(as, slot(depth), n * sizeof(double)); \
+            --depth; break; }
+        #define RPN_KERNEL_UNARY(kernel) { \
+            double* top = slot(depth - 1); \
+            memcpy(slot(depth), top, n * sizeof(double)); \
+            Kernels::kernel(slot(depth), top, n); \
+            break; }
+        // Superinstructions: an operator whose right operand b is a constant, or the input of the row
+        #define RPN_LANES_CONSTANT(expr) { \
+            double b = constants[instruction.Arg]; \
+            double* top = slot(depth - 1); \
+            for (size_t i = 0; i < n; ++i) { double a = top[i]; top[i] = (expr); } \
+            break; }
+        #define RPN_LANES_INPUT(expr) { \
+            double* top = slot(depth - 1); \
+            for (size_t i = 0; i < n; ++i) { double a = top[i], b = inputs[i]; top[i] = (expr); } \
+            break; }
+        // Angle conversions: the angle unit is tested once per instruction and block, and the loops are specialized
+        // on it (Unit)
+        #define RPN_LANES_ANGLE(expr) { \
+            double* top = slot(depth - 1); \
+            WithAngleUnit(angleUnit, [&](auto unit) { \
+                constexpr AngleUnitType Unit = decltype(unit)::value; \
+                for (size_t i = 0; i < n; ++i) { double a = top[i]; top[i] = (expr); } \
+            }); \
+            break; }
+        #define RPN_KERNEL_TRIGONOMETRIC(kernel) { \
+            double* top = slot(depth - 1); \
+            double* radians = slot(depth); \
+            WithAngleUnit(angleUnit, [&](auto unit) { \
+                constexpr AngleUnitType Unit = decltype(unit)::value; \
+                for (size_t i = 0; i < n; ++i) radians[i] = ToRadian<Unit>(top[i]); \
+            }); \
+            Kernels::kernel(radians, top, n); \
+            break; }
+
+        for (const Instruction& instruction: program.Code)
+        {
+            switch (instruction.Op)
+            {
+                case Instr::PushConstant:
+                {
+                    double* dst = slot(depth++);
+                    double v = constants[instruction.Arg];
+                    for (size_t i = 0; i < n; ++i)
+                        dst[i] = v;
+                    break;
+                }
+                case Instr::PushInput: memcpy(slot(depth++), inputs, n * sizeof(double)); break;
+
+                case Instr::Add: Kernels::Add(slot(depth - 2), slot(depth - 1), slot(depth - 2), n); --depth; break;
+                case Instr::Subtract: Kernels::Subtract(slot(depth - 2), slot(depth - 1), slot(depth - 2), n); --depth; break;
+                case Instr::Multiply: Kernels::Multiply(slot(depth - 2), slot(depth - 1), slot(depth - 2), n); --depth; break;
+                case Instr::Divide:
+                {
+                    const double* bs = slot(depth - 1);
+                    for (size_t i = 0; i < n; ++i)
+                        rowFailed[i] |= (bs[i] == 0.);
+                    Kernels::Divide(slot(depth - 2), bs, slot(depth - 2), n);
+                    --depth;
+                    break;
+                }
+                case Instr::Power: RPN_KERNEL_BINARY(Power)
+
+                case Instr::Sin: RPN_KERNEL_TRIGONOMETRIC(Sin)
+                case Instr::Cos: RPN_KERNEL_TRIGONOMETRIC(Cos)
+                case Instr::Tan: RPN_KERNEL_TRIGONOMETRIC(Tan)
+                case Instr::ArcSin: RPN_LANES_ANGLE(FromRadian<Unit>(asin(a)))
+                case Instr::ArcCos: RPN_LANES_ANGLE(FromRadian<Unit>(acos(a)))
+                case Instr::ArcTan: RPN_LANES_ANGLE(FromRadian<Unit>(atan(a)))
+                case Instr::Reciprocal: RPN_LANES_UNARY(1. / a)
+                case Instr::Log10: RPN_KERNEL_UNARY(Log10)
+                case Instr::Ln: RPN_KERNEL_UNARY(Ln)
+                case Instr::Pow10: RPN_KERNEL_UNARY(Pow10)
+                case Instr::Exp: RPN_KERNEL_UNARY(Exp)
+                case Instr::Sqrt: Kernels::Sqrt(slot(depth - 1), slot(depth - 1), n); break;
+                case Instr::Square: RPN_LANES_UNARY(a * a)
+                case Instr::Floor: Kernels::Floor(slot(depth - 1), slot(depth - 1), n); break;
+                case Instr::Negate: RPN_LANES_UNARY(-a)
+                case Instr::ToDeg: RPN_LANES_ANGLE(FromRadian<AngleUnitType::Deg>(ToRadian<Unit>(a)))
+                case Instr::ToRad: RPN_LANES_ANGLE(ToRadian<Unit>(a))
+                case Instr::ToGrad: RPN_LANES_ANGLE(FromRadian<AngleUnitType::Grad>(ToRadian<Unit>(a)))
+
+                case Instr::Swap:
+                {
+                    double* as = slot(depth - 2);
+                    double* bs = slot(depth - 1);
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        double a = as[i];
+                        as[i] = bs[i];
+                        bs[i] = a;
+                    }
+                    break;
+                }
+                case Instr::Dup:
+                {
+                    memcpy(slot(depth), slot(depth - 1), n * sizeof(double));
+                    ++depth;
+                    break;
+                }
+                case Instr::Drop: --depth; break;
+                case Instr::Clear: depth = 0; break;
+                case Instr::Sto: memcpy(storedValues, slot(depth - 1), n * sizeof(double)); break;
+                case Instr::Recall: memcpy(slot(depth++), storedValues, n * sizeof(double)); break;
+                case Instr::Roll:
+                {
+                    // the top slot becomes the bottom slot
+                    memcpy(slot(depth), slot(depth - 1), n * sizeof(double));
+                    memmove(slot(1), slot(0), (depth - 1) * BlockSize * sizeof(double));
+                    memcpy(slot(0), slot(depth), n * sizeof(double));
+                    break;
+                }
+
+                case Instr::SetDeg: angleUnit = AngleUnitType::Deg; break;
+                case Instr::SetRad: angleUnit = AngleUnitType::Rad; break;
+                case Instr::SetGrad: angleUnit = AngleUnitType::Grad; break;
+
+                case Instr::AddConstant: RPN_LANES_CONSTANT(a + b)
+                case Instr::SubtractConstant: RPN_LANES_CONSTANT(a - b)
+                case Instr::MultiplyConstant: RPN_LANES_CONSTANT(a * b)
+                case Instr::DivideConstant:
+                {
+                    if (constants[instruction.Arg] == 0.)
+                        for (size_t i = 0; i < n; ++i)
+                            rowFailed[i] = 1;
+                    RPN_LANES_CONSTANT(a / b)
+                }
+                case Instr::PowerConstant:
+                {
+                    // the exponents in slot(depth), the results in slot(depth + 1)
+                    double* top = slot(depth - 1);
+                    double* exponents = slot(depth);
+                    double v = constants[instruction.Arg];
+                    for (size_t i = 0; i < n; ++i)
+                        exponents[i] = v;
+                    Kernels::Power(top, exponents, slot(depth + 1), n);
+                    memcpy(top, slot(depth + 1), n * sizeof(double));
+                    break;
+                }
+                case Instr::AddInput: RPN_LANES_INPUT(a + b)
+                case Instr::SubtractInput: RPN_LANES_INPUT(a - b)
+                case Instr::MultiplyInput: RPN_LANES_INPUT(a * b)
+                case Instr::DivideInput:
+                {
+                    for (size_t i = 0; i < n; ++i)
+                        rowFailed[i] |= (inputs[i] == 0.);
+                    RPN_LANES_INPUT(a / b)
+                }
+                case Instr::SubtractReversed: Kernels::Subtract(slot(depth - 1), slot(depth - 2), slot(depth - 2), n); --depth; break;
+                case Instr::DivideReversed:
+                {
+                    const double* as = slot(depth - 2);
+                    for (size_t i = 0; i < n; ++i)
+                        rowFailed[i] |= (as[i] == 0.);
+                    Kernels::Divide(slot(depth - 1), as, slot(depth - 2), n);
+                    --depth;
+                    break;
+                }
+                case Instr::SquareAdd:
+                {
+                    double* as = slot(depth - 2);
+                    const double* bs = slot(depth - 1);
+                    for (size_t i = 0; i < n; ++i)
+                        as[i] = as[i] + bs[i] * bs[i];
+                    --depth;
+                    break;
+                }
+
+                case Instr::Count: break;
+            }
+        }
+
+        #undef RPN_LANES_UNARY
+        #undef RPN_KERNEL_BINARY
+        #undef RPN_KERNEL_UNARY
+        #undef RPN_KERNEL_TRIGONOMETRIC
+        #undef RPN_LANES_ANGLE
+        #undef RPN_LANES_CONSTANT
+        #undef RPN_LANES_INPUT
+
+        // depth > 0 (see _checkStackDepth)
+        const double* result = slot(depth - 1);
+        for (size_t i = 0; i < n; ++i)
+            outputs[i] = rowFailed[i] ? std::numeric_limits<double>::quiet_NaN() : result[i];
+        return true;
+    }
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "rpn_bytecode.h"
+#include "rpn_thread_pool.h"
+#include <string>
+#include <vector>
+
+
+namespace RpnCalculator
+{
+    // Evaluates one compiled program over a column of inputs (e.g. "x 1.8 * 32 +" over millions of rows).
+    //
+    // For each row, the stack starts empty, "x" is the input of the row, and the output is the top of the stack
+    // at the end of the program. Rows are processed by blocks of BlockSize, with a structure-of-arrays stack
+    // (each stack slot holds one value per row of the block): each instruction is dispatched once per block,
+    // and applied to all the rows by a tight loop.
+    // Arithmetic and transcendental instructions use the vectorized kernels of rpn_simd_kernels.h: their results
+    // may differ from the scalar path (VirtualMachine, CalculatorState) by the ulp bounds documented there.
+    struct BatchEvaluator
+    {
+        static constexpr size_t BlockSize = 256;
+
+        AngleUnitType AngleUnit = AngleUnitType::Deg;
+        // Runs the native code of the program (see JitFunction, compiled once by SharedJitCache), when it can be
+        // compiled. Its results are then those of VirtualMachine, rather than those of the vectorized kernels.
+        bool UseJit = false;
+        std::string ErrorMessage;
+
+        // Returns false and fills ErrorMessage if the program cannot be evaluated (not enough values on the stack, or
+        // an empty stack at the end), even when count is 0. Rows where a division by zero occurs give NaN.
+        bool Evaluate(const Program& program, const double* inputs, double* outputs, size_t count);
+
+        // Same as Evaluate(), with the rows split into chunks of ChunkSize, evaluated by the workers of the pool.
+        // Each chunk writes its own rows of outputs, so that the results are in input order.
+        static constexpr size_t ChunkSize = 64 * BlockSize;
+        bool EvaluateParallel(const Program& program, const double* inputs, double* outputs, size_t count,
+                              ThreadPool& threadPool);
+
+    private:
+        bool _checkStackDepth(const Program& program);
+        bool _evaluateBlock(const Program& program, const double* inputs, double* outputs, size_t nbRows);
+
+        std::vector<double> _stack;        // (max depth) x BlockSize values
+        std::vector<double> _storedValues; // BlockSize values
+        std::vector<char> _rowFailed;      // BlockSize flags
+        std::vector<BatchEvaluator> _workerEvaluators; // one per worker of the pool (EvaluateParallel)
+    };
+
+}
@@ -0,0 +1,843 @@
+// Micro-benchmarks for the RPN calculator engine
+//
+// Usage:
+//     rpn_bench                 run all benchmarks
+//     rpn_bench parse_number    run the benchmarks whose name contains "parse_number"
+#include "rpn_calculator.h"
+#include "rpn_batch.h"
+#include "rpn_bytecode.h"
+#include "rpn_jit.h"
+#include "rpn_simd_kernels.h"
+#include "rpn_static.h"
+#include "rpn_stream.h"
+#include "rpn_thread_pool.h"
+#include "rpn_vector.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace RpnCalculator;
+
+
+// Prevents the compiler from optimizing away a computed value
+static volatile double gSink = 0.;
+
+// Set by the benchmarks which detect an error (wrong results, or a broken accuracy bound): rpn_bench then exits with 1
+static bool gHasErrors = false;
+
+
+// Runs `fn` (which performs nbOpsPerCall operations) repeatedly during ~0.5s, and returns the time per operation in ns
+double MeasureNsPerOp(const std::function<void()>& fn, size_t nbOpsPerCall)
+{
+    using Clock = std::chrono::steady_clock;
+    fn(); // warm-up
+    size_t nbCalls = 0;
+    auto start = Clock::now();
+    double elapsed = 0.;
+    while (elapsed < 0.5)
+    {
+        fn();
+        ++nbCalls;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return elapsed * 1e9 / (double)(nbCalls * nbOpsPerCall);
+}
+
+
+std::vector<std::string> MakeNumberInputs(size_t count)
+{
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> mantissa(-1000., 1000.);
+    std::uniform_int_distribution<int> exponent(-20, 20);
+    std::vector<std::string> inputs;
+    for (size_t i = 0; i < count; ++i)
+    {
+        char buffer[64];
+        switch (i % 4)
+        {
+            case 0: snprintf(buffer, sizeof(buffer), "%d", (int)mantissa(rng)); break;
+            case 1: snprintf(buffer, sizeof(buffer), "%.6f", mantissa(rng)); break;
+            case 2: snprintf(buffer, sizeof(buffer), "%.3fE%d", mantissa(rng), exponent(rng)); break;
+            default: snprintf(buffer, sizeof(buffer), "3.1415926535897932384626433832795"); break;
+        }
+        inputs.push_back(buffer);
+    }
+    return inputs;
+}
+
+
+void BenchParseNumber()
+{
+    auto inputs = MakeNumberInputs(1000);
+
+    // Reference: the stream based parse that CalculatorState used before ParseNumber
+    auto streamParse = [&inputs]() {
+        double sum = 0.;
+        for (const auto& input: inputs)
+        {
+            std::istringstream iss(input);
+            double v;
+            iss >> v;
+            if (!iss.fail() && iss.eof())
+                sum += v;
+        }
+        gSink = sum;
+    };
+    auto parseNumber = [&inputs]() {
+        double sum = 0.;
+        for (const auto& input: inputs)
+        {
+            std::optional<double> v = ParseNumber(input);
+            if (v.has_value())
+                sum += v.value();
+        }
+        gSink = sum;
+    };
+
+    double nsStream = MeasureNsPerOp(streamParse, inputs.size());
+    double nsParseNumber = MeasureNsPerOp(parseNumber, inputs.size());
+    printf("    istringstream: %8.1f ns/number\n", nsStream);
+    printf("    ParseNumber:   %8.1f ns/number   (x%.1f)\n", nsParseNumber, nsStream / nsParseNumber);
+}
+
+
+void BenchNumberEntry()
+{
+    // Replays the keystrokes of numbers typed on the computer keyboard, each followed by Enter
+    // (a leading '-' is typed as a final "+/-", since '-' would be the minus operator)
+    auto inputs = MakeNumberInputs(1000);
+    CalculatorState calculatorState;
+    auto typeNumbers = [&inputs, &calculatorState]() {
+        for (const auto& input: inputs)
+        {
+            bool isNegative = (input[0] == '-');
+            for (size_t i = isNegative ? 1 : 0; i < input.size(); ++i)
+                calculatorState.OnComputerKey(input[i]);
+            if (isNegative)
+                calculatorState.OnOpCode(OpCode::PlusMinus);
+            calculatorState.OnComputerKey('\n');
+        }
+        gSink = calculatorState.Stack.back();
+        calculatorState.Stack.assign(nullptr, nullptr);
+    };
+    printf("    keystrokes + Enter: %8.1f ns/number\n", MeasureNsPerOp(typeNumbers, inputs.size()));
+}
+
+
+void BenchStackDisplay()
+{
+    // Formats the 4 displayed stack values, as GuiDisplay does on each frame
+    CalculatorStack stack;
+    for (int i = 0; i < 4; ++i)
+        stack.push_back(1. / (i + 3.));
+    int nbDecimals = 12;
+    auto withSnprintf = [&stack, nbDecimals]() {
+        char valueAsString[64];
+        for (int i = 0; i < 4; ++i)
+            snprintf(valueAsString, 64, "%.*G", nbDecimals, stack[i]);
+        gSink = valueAsString[0];
+    };
+    auto withFormat = [&stack, nbDecimals]() {
+        char valueAsString[64];
+        for (int i = 0; i < 4; ++i)
+            FormatDisplayedValue(stack[i], nbDecimals, valueAsString, sizeof(valueAsString));
+        gSink = valueAsString[0];
+    };
+    auto withCache = [&stack, nbDecimals]() {
+        for (int i = 0; i < 4; ++i)
+            gSink = stack.display_string(i, nbDecimals)[0];
+    };
+    printf("    snprintf:             %8.1f ns/frame\n", MeasureNsPerOp(withSnprintf, 1));
+    printf("    FormatDisplayedValue: %8.1f ns/frame\n", MeasureNsPerOp(withFormat, 1));
+    printf("    display_string:       %8.1f ns/frame\n", MeasureNsPerOp(withCache, 1));
+}
+
+
+template<typename StackStorage>
+void StackStorageWorkload(StackStorage& storage)
+{
+    // Typical RPN traffic: push two values, combine them, read the displayed values, and sometimes roll
+    double sum = 0.;
+    for (int i = 0; i < 1000; ++i)
+    {
+        storage.push_back((double)i);
+        storage.push_back(2.);
+        double b = storage.back(); storage.pop_back();
+        double a = storage.back(); storage.pop_back();
+        storage.push_back(a * b);
+        if (i % 16 == 0)
+        {
+            double top = storage.back(); storage.pop_back();
+            storage.push_front(top);
+        }
+        for (size_t j = storage.size() >= 4 ? storage.size() - 4 : 0; j < storage.size(); ++j)
+            sum += storage[j];
+        if (storage.size() > 20)
+            storage.clear();
+    }
+    gSink = sum;
+}
+
+
+void BenchStackStorage()
+{
+    std::deque<double> deque;
+    InlineRing<double, 32> inlineRing;
+    double nsDeque = MeasureNsPerOp([&deque]() { StackStorageWorkload(deque); }, 1000);
+    double nsInlineRing = MeasureNsPerOp([&inlineRing]() { StackStorageWorkload(inlineRing); }, 1000);
+    printf("    std::deque:  %8.1f ns/op\n", nsDeque);
+    printf("    InlineRing:  %8.1f ns/op   (x%.1f)\n", nsInlineRing, nsDeque / nsInlineRing);
+}
+
+
+std::vector<double> MakeColumn(size_t count)
+{
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> distribution(-100., 100.);
+    std::vector<double> column(count);
+    for (auto& v: column)
+        v = distribution(rng);
+    return column;
+}
+
+
+// Compiles a benchmarked program: a program which fails to compile would otherwise be measured truncated
+bool CompileBenchProgram(const std::string& source, Program& program)
+{
+    std::string errorMessage;
+    if (CompileProgram(source, program, errorMessage))
+        return true;
+    printf("    Error: cannot compile \"%s\": %s\n", source.c_str(), errorMessage.c_str());
+    gHasErrors = true;
+    return false;
+}
+
+
+void BenchBatch()
+{
+    const char* source = "x 1.8 * 32 +";
+    Program program;
+    if (!CompileBenchProgram(source, program))
+        return;
+    auto inputs = MakeColumn(1000000);
+    std::vector<double> outputs(inputs.size());
+
+    // One VirtualMachine run per row
+    VirtualMachine vm;
+    CalculatorStack stack;
+    auto perRow = [&]() {
+        for (size_t i = 0; i < inputs.size(); ++i)
+        {
+            vm.Input = inputs[i];
+            stack.assign(nullptr, nullptr);
+            vm.Run(program, stack);
+            outputs[i] = stack.back();
+        }
+        gSink = outputs.back();
+    };
+    BatchEvaluator batchEvaluator;
+    auto batch = [&]() {
+        batchEvaluator.Evaluate(program, inputs.data(), outputs.data(), inputs.size());
+        gSink = outputs.back();
+    };
+    ThreadPool threadPool;
+    auto parallel = [&]() {
+        batchEvaluator.EvaluateParallel(program, inputs.data(), outputs.data(), inputs.size(), threadPool);
+        gSink = outputs.back();
+    };
+    double nsPerRow = MeasureNsPerOp(perRow, inputs.size());
+    double nsBatch = MeasureNsPerOp(batch, inputs.size());
+    double nsParallel = MeasureNsPerOp(parallel, inputs.size());
+    printf("    \"%s\", %zu rows\n", source, inputs.size());
+    printf("    VirtualMachine per row: %8.2f ns/row\n", nsPerRow);
+    printf("    BatchEvaluator:         %8.2f ns/row   (x%.1f)\n", nsBatch, nsPerRow / nsBatch);
+    printf("    EvaluateParallel (%zu workers): %8.2f ns/row   (x%.1f)\n",
+           threadPool.size(), nsParallel, nsPerRow / nsParallel);
+}
+
+
+// Reference interpreters for BenchVmStackCaching, which differ only by the stack caching:
+//     * RunMemoryStack: every instruction loads its operands from the stack memory, and stores its result there
+//     * RunCachedStack: the top of the stack is kept in a register, as in VirtualMachine::Run
+// (only the instructions of the benchmarked programs are implemented)
+double RunMemoryStack(const Program& program, double input, std::vector<double>& buffer)
+{
+    buffer.resize(program.MaxGrowth + 1);
+    double* sp = buffer.data();
+    const double* constants = program.Constants.data();
+    for (const Instruction& instruction: program.Code)
+    {
+        switch (instruction.Op)
+        {
+            case Instr::PushConstant: *sp++ = constants[instruction.Arg]; break;
+            case Instr::PushInput: *sp++ = input; break;
+            case Instr::Add: sp[-2] = sp[-2] + sp[-1]; --sp; break;
+            case Instr::Subtract: sp[-2] = sp[-2] - sp[-1]; --sp; break;
+            case Instr::Multiply: sp[-2] = sp[-2] * sp[-1]; --sp; break;
+            case Instr::Divide: sp[-2] = sp[-2] / sp[-1]; --sp; break;
+            case Instr::Sqrt: sp[-1] = sqrt(sp[-1]); break;
+            case Instr::Square: sp[-1] = sp[-1] * sp[-1]; break;
+            case Instr::Negate: sp[-1] = -sp[-1]; break;
+            case Instr::Swap: { double a = sp[-1]; sp[-1] = sp[-2]; sp[-2] = a; break; }
+            case Instr::Dup: *sp = sp[-1]; ++sp; break;
+            case Instr::Drop: --sp; break;
+            default: break;
+        }
+    }
+    return sp[-1];
+}
+
+double RunCachedStack(const Program& program, double input, std::vector<double>& buffer)
+{
+    buffer.resize(program.MaxGrowth + 2);
+    double* base = buffer.data() + 1;
+    double* sp = base - 1;
+    double tos = 0.;
+    const double* constants = program.Constants.data();
+    for (const Instruction& instruction: program.Code)
+    {
+        switch (instruction.Op)
+        {
+            case Instr::PushConstant: *sp++ = tos; tos = constants[instruction.Arg]; break;
+            case Instr::PushInput: *sp++ = tos; tos = input; break;
+            case Instr::Add: tos = *--sp + tos; break;
+            case Instr::Subtract: tos = *--sp - tos; break;
+            case Instr::Multiply: tos = *--sp * tos; break;
+            case Instr::Divide: tos = *--sp / tos; break;
+            case Instr::Sqrt: tos = sqrt(tos); break;
+            case Instr::Square: tos = tos * tos; break;
+            case Instr::Negate: tos = -tos; break;
+            case Instr::Swap: { double a = sp[-1]; sp[-1] = tos; tos = a; break; }
+            case Instr::Dup: *sp++ = tos; break;
+            case Instr::Drop: tos = *--sp; break;
+            default: break;
+        }
+    }
+    return tos;
+}
+
+// Stack memory accesses (loads + stores) of an instruction, without and with the top of the stack in a register
+void CountStackAccesses(Instr instr, size_t& nbMemoryStackAccesses, size_t& nbCachedAccesses)
+{
+    switch (instr)
+    {
+        case Instr::PushConstant: case Instr::PushInput:
+            nbMemoryStackAccesses = 1; nbCachedAccesses = 1; return;     // store / spill of the previous top
+        case Instr::Add: case Instr::Subtract: case Instr::Multiply: case Instr::Divide:
+            nbMemoryStackAccesses = 3; nbCachedAccesses = 1; return;     // 2 loads + 1 store / 1 load
+        case Instr::Swap:
+            nbMemoryStackAccesses = 4; nbCachedAccesses = 2; return;
+        case Instr::Dup:
+            nbMemoryStackAccesses = 2; nbCachedAccesses = 1; return;
+        case Instr::Drop:
+            nbMemoryStackAccesses = 0; nbCachedAccesses = 1; return;
+        default: // unary operators
+            nbMemoryStackAccesses = 2; nbCachedAccesses = 0; return;
+    }
+}
+
+void BenchVectorOperators()
+{
+    // "x 1.8 * 32 + sin" over a column: keyed on each value (CalculatorState with numbers), or once on a vector
+    auto inputs = MakeColumn(1000000);
+    CalculatorState calculatorState;
+    auto perValue = [&]() {
+        for (double input: inputs)
+        {
+            calculatorState.Stack.assign(&input, &input + 1);
+            calculatorState.OnRpnToken("1.8");
+            calculatorState.OnOpCode(OpCode::Multiply);
+            calculatorState.OnRpnToken("32");
+            calculatorState.OnOpCode(OpCode::Add);
+            calculatorState.OnOpCode(OpCode::Sin);
+        }
+        gSink = calculatorState.Stack.back();
+    };
+    auto onVector = [&]() {
+        calculatorState.Stack.assign(nullptr, nullptr);
+        calculatorState.PushVector(inputs);
+        calculatorState.OnRpnToken("1.8");
+        calculatorState.OnOpCode(OpCode::Multiply);
+        calculatorState.OnRpnToken("32");
+        calculatorState.OnOpCode(OpCode::Add);
+        calculatorState.OnOpCode(OpCode::Sin);
+        gSink = (*calculatorState.Stack.back_value().Vector)[0];
+    };
+    double nsPerValue = MeasureNsPerOp(perValue, inputs.size());
+    double nsVector = MeasureNsPerOp(onVector, inputs.size());
+    printf("    \"x 1.8 * 32 + sin\", %zu values\n", inputs.size());
+    printf("    keys per value:  %8.2f ns/value\n", nsPerValue);
+    printf("    keys on vector:  %8.2f ns/value   (x%.1f)\n", nsVector, nsPerValue / nsVector);
+}
+
+
+void BenchReductions()
+{
+    auto inputs = MakeColumn(4000000);
+    const double* values = inputs.data();
+    const size_t n = inputs.size();
+    auto naiveSum = [&]() {
+        double sum = 0.;
+        for (size_t i = 0; i < n; ++i)
+            sum += values[i];
+        gSink = sum;
+    };
+    auto kahanSum = [&]() {
+        double sum = 0., compensation = 0.;
+        for (size_t i = 0; i < n; ++i)
+        {
+            double y = values[i] - compensation;
+            double t = sum + y;
+            compensation = (t - sum) - y;
+            sum = t;
+        }
+        gSink = sum;
+    };
+    auto pairwiseSum = [&]() { gSink = Kernels::Sum(values, n); };
+    auto reduceSum = [&]() { double r; ReduceValues(OpCode::Sum, values, n, r); gSink = r; };
+    auto naiveMin = [&]() { gSink = *std::min_element(inputs.begin(), inputs.end()); };
+    auto kernelMin = [&]() { gSink = Kernels::Min(values, n); };
+    auto reduceVariance = [&]() { double r; ReduceValues(OpCode::Variance, values, n, r); gSink = r; };
+
+    double nsNaive = MeasureNsPerOp(naiveSum, n);
+    printf("    %zu values, %zu threads\n", n, SharedThreadPool().size());
+    printf("    sum, naive loop:          %8.3f ns/value\n", nsNaive);
+    printf("    sum, Kahan:               %8.3f ns/value\n", MeasureNsPerOp(kahanSum, n));
+    double nsPairwise = MeasureNsPerOp(pairwiseSum, n);
+    printf("    sum, pairwise kernel:     %8.3f ns/value   (x%.1f)\n", nsPairwise, nsNaive / nsPairwise);
+    double nsReduce = MeasureNsPerOp(reduceSum, n);
+    printf("    sum, ReduceValues:        %8.3f ns/value   (x%.1f)\n", nsReduce, nsNaive / nsReduce);
+    double nsNaiveMin = MeasureNsPerOp(naiveMin, n), nsKernelMin = MeasureNsPerOp(kernelMin, n);
+    printf("    min, std::min_element:    %8.3f ns/value\n", nsNaiveMin);
+    printf("    min, kernel:              %8.3f ns/value   (x%.1f)\n", nsKernelMin, nsNaiveMin / nsKernelMin);
+    printf("    variance, ReduceValues:   %8.3f ns/value\n", MeasureNsPerOp(reduceVariance, n));
+
+    // Accuracy: 10^7 times 0.1 (not representable), whose exact sum is 10^6 (up to the rounding of 0.1)
+    std::vector<double> tenths(10000000, 0.1);
+    double naive = 0.;
+    for (double v: tenths)
+        naive += v;
+    double pairwise = Kernels::Sum(tenths.data(), tenths.size());
+    printf("    10^7 x 0.1: error of the naive loop %.3g, of the pairwise sum %.3g\n", naive - 1e6, pairwise - 1e6);
+}
+
+
+void BenchVmStackCaching()
+{
+    // Long programs (a block repeated), so that the time per op is not dominated by the setup of each run
+    struct StackCachingCase { const char* Name; const char* Block; };
+    const StackCachingCase cases[] = {
+        { "Horner scheme", " 1.5 * 0.25 +" },
+        { "unary operators and stack shuffles", " Dup * 1 + sqrt x / 2 Swap - +/- x Dup Drop +" },
+    };
+    auto inputs = MakeColumn(1000);
+    VirtualMachine vm;
+    CalculatorStack stack;
+    std::vector<double> buffer;
+    for (const auto& stackCachingCase: cases)
+    {
+        std::string source = "x";
+        for (int i = 0; i < 100; ++i)
+            source += stackCachingCase.Block;
+        Program program;
+        if (!CompileBenchProgram(source, program))
+            continue;
+        // The reference interpreters only know the plain instructions (and size their buffer with MaxGrowth)
+        std::string errorMessage;
+        ExpandSuperinstructions(program);
+        VerifyProgram(program, errorMessage);
+
+        size_t nbMemoryStackAccesses = 0, nbCachedAccesses = 0;
+        for (const Instruction& instruction: program.Code)
+        {
+            size_t memoryStack, cached;
+            CountStackAccesses(instruction.Op, memoryStack, cached);
+            nbMemoryStackAccesses += memoryStack;
+            nbCachedAccesses += cached;
+        }
+
+        auto memoryStackRun = [&]() {
+            double sum = 0.;
+            for (double input: inputs)
+                sum += RunMemoryStack(program, input, buffer);
+            gSink = sum;
+        };
+        auto cachedStackRun = [&]() {
+            double sum = 0.;
+            for (double input: inputs)
+                sum += RunCachedStack(program, input, buffer);
+            gSink = sum;
+        };
+        auto vmRun = [&]() {
+            double sum = 0.;
+            for (double input: inputs)
+            {
+                vm.Input = input;
+                stack.assign(nullptr, nullptr);
+                vm.Run(program, stack);
+                sum += stack.back();
+            }
+            gSink = sum;
+        };
+        vmRun();
+        double result = RunMemoryStack(program, inputs.back(), buffer);
+        if (stack.back() != result || RunCachedStack(program, inputs.back(), buffer) != result)
+        {
+            printf("    Error: different results for %s\n", stackCachingCase.Name);
+            gHasErrors = true;
+        }
+
+        size_t nbOps = inputs.size() * program.Code.size();
+        double nsMemoryStack = MeasureNsPerOp(memoryStackRun, nbOps);
+        double nsCachedStack = MeasureNsPerOp(cachedStackRun, nbOps);
+        double nsVm = MeasureNsPerOp(vmRun, nbOps);
+        double nbOpsPerProgram = (double)program.Code.size();
+        printf("    %s (\"x%s\" x 100)\n", stackCachingCase.Name, stackCachingCase.Block);
+        printf("        memory stack:       %5.2f ns/op   %4.2f stack loads+stores/op\n",
+               nsMemoryStack, (double)nbMemoryStackAccesses / nbOpsPerProgram);
+        printf("        top in a register:  %5.2f ns/op   %4.2f stack loads+stores/op\n",
+               nsCachedStack, (double)nbCachedAccesses / nbOpsPerProgram);
+        printf("        VirtualMachine:     %5.2f ns/op   (top in a register, all the instructions)\n", nsVm);
+    }
+}
+
+
+void BenchSuperinstructions()
+{
+    const char* sources[] = {
+        "x 1.8 * 32 +",
+        "x 1.5 * 0.25 + x * 2 - x * 0.75 + x * 4 /",
+        "x x^2 1 x^2 + 2 Swap / x Swap -",
+    };
+    auto inputs = MakeColumn(1000000);
+    std::vector<double> outputs(inputs.size());
+    VirtualMachine vm;
+    CalculatorStack stack;
+    BatchEvaluator batchEvaluator;
+    for (const char* source: sources)
+    {
+        Program fused, plain;
+        if (!CompileBenchProgram(source, fused))
+            continue;
+        std::string errorMessage;
+        plain = fused;
+        ExpandSuperinstructions(plain);
+        VerifyProgram(plain, errorMessage);
+
+        auto vmRun = [&](const Program& program) {
+            for (size_t i = 0; i < inputs.size(); ++i)
+            {
+                vm.Input = inputs[i];
+                stack.assign(nullptr, nullptr);
+                vm.Run(program, stack);
+                outputs[i] = stack.back();
+            }
+            gSink = outputs.back();
+        };
+        auto batchRun = [&](const Program& program) {
+            batchEvaluator.Evaluate(program, inputs.data(), outputs.data(), inputs.size());
+            gSink = outputs.back();
+        };
+        double nsVmPlain = MeasureNsPerOp([&]() { vmRun(plain); }, inputs.size());
+        double nsVmFused = MeasureNsPerOp([&]() { vmRun(fused); }, inputs.size());
+        double nsBatchPlain = MeasureNsPerOp([&]() { batchRun(plain); }, inputs.size());
+        double nsBatchFused = MeasureNsPerOp([&]() { batchRun(fused); }, inputs.size());
+        printf("    \"%s\": %zu -> %zu instructions\n", source, plain.Code.size(), fused.Code.size());
+        printf("        VirtualMachine: %6.2f -> %6.2f ns/row   (x%.2f)\n", nsVmPlain, nsVmFused, nsVmPlain / nsVmFused);
+        printf("        BatchEvaluator: %6.2f -> %6.2f ns/row   (x%.2f)\n",
+               nsBatchPlain, nsBatchFused, nsBatchPlain / nsBatchFused);
+    }
+}
+
+
+void BenchJit()
+{
+    const char* sources[] = {
+        "x 1.8 * 32 +",
+        "x 1.5 * 0.25 + x * 2 - x * 0.75 + x * 4 /",
+        "x x^2 1 x^2 + 2 Swap / x Swap -",
+        "x sin x cos * 2 /",
+    };
+    auto inputs = MakeColumn(1000000);
+    std::vector<double> outputs(inputs.size());
+    VirtualMachine vm;
+    CalculatorStack stack;
+    BatchEvaluator batchEvaluator;
+    for (const char* source: sources)
+    {
+        Program program;
+        if (!CompileBenchProgram(source, program))
+            continue;
+        JitFunction jitFunction;
+        if (!jitFunction.Compile(program, AngleUnitType::Deg))
+        {
+            printf("    \"%s\": cannot be compiled to native code on this platform\n", source);
+            continue;
+        }
+
+        auto vmRun = [&]() {
+            for (size_t i = 0; i < inputs.size(); ++i)
+            {
+                vm.Input = inputs[i];
+                stack.assign(nullptr, nullptr);
+                vm.Run(program, stack);
+                outputs[i] = stack.back();
+            }
+            gSink = outputs.back();
+        };
+        auto batchRun = [&]() {
+            batchEvaluator.Evaluate(program, inputs.data(), outputs.data(), inputs.size());
+            gSink = outputs.back();
+        };
+        auto jitRun = [&]() {
+            jitFunction.Evaluate(inputs.data(), outputs.data(), inputs.size());
+            gSink = outputs.back();
+        };
+        double nsVm = MeasureNsPerOp(vmRun, inputs.size());
+        double nsBatch = MeasureNsPerOp(batchRun, inputs.size());
+        double nsJit = MeasureNsPerOp(jitRun, inputs.size());
+        printf("    \"%s\": %zu bytes of native code\n", source, jitFunction.code_size());
+        printf("        VirtualMachine per row: %6.2f ns/row\n", nsVm);
+        printf("        BatchEvaluator:         %6.2f ns/row   (x%.1f)\n", nsBatch, nsVm / nsBatch);
+        printf("        JitFunction:            %6.2f ns/row   (x%.1f)\n", nsJit, nsVm / nsJit);
+    }
+}
+
+
+// Sources of BenchStaticProgram (C++17 template arguments)
+static constexpr char kStaticFahrenheit[] = "x 1.8 * 32 +";
+static constexpr char kStaticPolynomial[] = "x 1.5 * 0.25 + x * 2 - x * 0.75 + x * 4 /";
+static constexpr char kStaticTrigonometry[] = "x sin x cos * 2 /";
+
+void BenchStaticProgram()
+{
+    auto inputs = MakeColumn(1000000);
+    std::vector<double> outputs(inputs.size());
+    VirtualMachine vm;
+    CalculatorStack stack;
+
+    auto bench = [&](const char* source, double (*evaluateStatic)(double)) {
+        Program program;
+        if (!CompileBenchProgram(source, program))
+            return;
+        auto vmRun = [&]() {
+            for (size_t i = 0; i < inputs.size(); ++i)
+            {
+                vm.Input = inputs[i];
+                stack.assign(nullptr, nullptr);
+                vm.Run(program, stack);
+                outputs[i] = stack.back();
+            }
+            gSink = outputs.back();
+        };
+        auto staticRun = [&]() {
+            for (size_t i = 0; i < inputs.size(); ++i)
+                outputs[i] = evaluateStatic(inputs[i]);
+            gSink = outputs.back();
+        };
+        double nsVm = MeasureNsPerOp(vmRun, inputs.size());
+        double nsStatic = MeasureNsPerOp(staticRun, inputs.size());
+        printf("    \"%s\"\n", source);
+        printf("        VirtualMachine per row: %6.2f ns/row\n", nsVm);
+        printf("        StaticProgram:          %6.2f ns/row   (x%.1f)\n", nsStatic, nsVm / nsStatic);
+    };
+    // Through a function pointer, as a formula of another translation unit would be called
+    bench(kStaticFahrenheit, StaticProgram<kStaticFahrenheit>::Evaluate);
+    bench(kStaticPolynomial, StaticProgram<kStaticPolynomial>::Evaluate);
+    bench(kStaticTrigonometry, StaticProgram<kStaticTrigonometry>::Evaluate);
+}
+
+
+// Arguments for the kernels benchmarks: each kernel has its own range of interest
+struct KernelCase
+{
+    const char* Name;
+    void (*Kernel)(const double*, double*, size_t);
+    double (*Scalar)(double);
+    double Min, Max;
+    bool LogUniform; // arguments spread over binades (Min and Max are then exponents of 2)
+    double MaxUlp;   // the maximum error documented in rpn_simd_kernels.h
+};
+
+
+static const std::vector<KernelCase>& KernelCases()
+{
+    static const std::vector<KernelCase> cases = {
+        { "Exp", Kernels::Exp, [](double x) { return exp(x); }, -700., 700., false, 1. },
+        { "Ln", Kernels::Ln, [](double x) { return log(x); }, -1022., 1023., true, 1. },
+        { "Log10", Kernels::Log10, [](double x) { return log10(x); }, -1022., 1023., true, 2. },
+        { "Pow10", Kernels::Pow10, [](double x) { return pow(10., x); }, -300., 300., false, 1. },
+        { "Sin", Kernels::Sin, [](double x) { return sin(x); }, -1000., 1000., false, 1. },
+        { "Cos", Kernels::Cos, [](double x) { return cos(x); }, -1000., 1000., false, 1. },
+        { "Tan", Kernels::Tan, [](double x) { return tan(x); }, -1000., 1000., false, 2. },
+    };
+    return cases;
+}
+
+
+std::vector<double> MakeKernelArguments(double min, double max, bool logUniform, size_t count, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> distribution(min, max);
+    std::vector<double> arguments(count);
+    for (auto& v: arguments)
+        v = logUniform ? exp2(distribution(rng)) : distribution(rng);
+    return arguments;
+}
+
+
+// Distance between two doubles, in units in the last place
+double UlpDistance(double a, double b)
+{
+    if (a == b || (std::isnan(a) && std::isnan(b)))
+        return 0.;
+    if (std::isnan(a) || std::isnan(b))
+        return INFINITY;
+    auto ordered = [](double v) {
+        int64_t i;
+        memcpy(&i, &v, sizeof(i));
+        return i < 0 ? INT64_MIN - i : i;
+    };
+    int64_t distance = ordered(a) - ordered(b);
+    return (double)(distance < 0 ? -distance : distance);
+}
+
+
+void BenchSimdAccuracy()
+{
+    printf("    kernels: %s, max error versus libm over 4M random arguments\n", Kernels::InstructionSet());
+    const size_t count = 4000000;
+    std::vector<double> outputs(count);
+    auto report = [](const char* name, double maxUlp, double documentedMaxUlp) {
+        printf("    %-6s %4.0f ulp\n", name, maxUlp);
+        if (maxUlp > documentedMaxUlp)
+        {
+            printf("    Error: %s exceeds its documented maximum error (%.0f ulp)\n", name, documentedMaxUlp);
+            gHasErrors = true;
+        }
+    };
+    for (const auto& kernelCase: KernelCases())
+    {
+        auto arguments = MakeKernelArguments(kernelCase.Min, kernelCase.Max, kernelCase.LogUniform, count, 1);
+        kernelCase.Kernel(arguments.data(), outputs.data(), count);
+        double maxUlp = 0.;
+        for (size_t i = 0; i < count; ++i)
+            maxUlp = std::max(maxUlp, UlpDistance(outputs[i], kernelCase.Scalar(arguments[i])));
+        report(kernelCase.Name, maxUlp, kernelCase.MaxUlp);
+    }
+
+    // y^x over the whole fast path: x ln(y) is uniform in [-700, 700]
+    auto bases = MakeKernelArguments(-30., 30., true, count, 2);
+    auto exponents = MakeKernelArguments(-700., 700., false, count, 3);
+    for (size_t i = 0; i < count; ++i)
+        exponents[i] /= log(bases[i]);
+    Kernels::Power(bases.data(), exponents.data(), outputs.data(), count);
+    double maxUlp = 0.;
+    for (size_t i = 0; i < count; ++i)
+        maxUlp = std::max(maxUlp, UlpDistance(outputs[i], pow(bases[i], exponents[i])));
+    report("Power", maxUlp, 1.);
+}
+
+
+void BenchSimdKernels()
+{
+    printf("    kernels: %s\n", Kernels::InstructionSet());
+    const size_t count = BatchEvaluator::BlockSize;
+    std::vector<double> outputs(count);
+    for (const auto& kernelCase: KernelCases())
+    {
+        auto arguments = MakeKernelArguments(kernelCase.Min, kernelCase.Max, kernelCase.LogUniform, count, 1);
+        auto scalar = [&]() {
+            for (size_t i = 0; i < count; ++i)
+                outputs[i] = kernelCase.Scalar(arguments[i]);
+            gSink = outputs.back();
+        };
+        auto kernel = [&]() {
+            kernelCase.Kernel(arguments.data(), outputs.data(), count);
+            gSink = outputs.back();
+        };
+        double nsScalar = MeasureNsPerOp(scalar, count);
+        double nsKernel = MeasureNsPerOp(kernel, count);
+        printf("    %-6s libm: %6.2f ns/value   kernel: %6.2f ns/value   (x%.1f)\n",
+               kernelCase.Name, nsScalar, nsKernel, nsScalar / nsKernel);
+    }
+}
+
+
+void BenchLineStream()
+{
+    // A log of typical expressions, one per line
+    const char* expressions[] = {
+        "3 4 + 2 *", "1.5 2.25 * 7 /", "12.75 sqrt 3 y^x", "100 ln 2 +", "45 sin 45 cos +", "1 2 3 4 5 + + + +",
+        "2.5e3 1.1 * 17 -",
+    };
+    std::mt19937 rng(42);
+    std::string input;
+    for (int i = 0; i < 200000; ++i)
+    {
+        input += expressions[rng() % (sizeof(expressions) / sizeof(expressions[0]))];
+        input += '\n';
+    }
+
+    LineEvaluator lineEvaluator;
+    std::string output;
+    auto evaluate = [&]() {
+        output.clear();
+        lineEvaluator.EvaluateLines(input.data(), input.data() + input.size(), output);
+        gSink = (double)output.size();
+    };
+    double nsPerByte = MeasureNsPerOp(evaluate, input.size());
+    printf("    LineEvaluator: %8.1f MB/s of input (%.1f ns/line)\n", 1e3 / nsPerByte,
+           nsPerByte * (double)input.size() / 200000.);
+}
+
+
+struct Benchmark
+{
+    const char* Name;
+    std::function<void()> Run;
+};
+
+
+int main(int argc, char **argv)
+{
+    std::vector<Benchmark> benchmarks = {
+        { "parse_number", BenchParseNumber },
+        { "number_entry", BenchNumberEntry },
+        { "stack_display", BenchStackDisplay },
+        { "stack_storage", BenchStackStorage },
+        { "batch", BenchBatch },
+        { "vector_operators", BenchVectorOperators },
+        { "reductions", BenchReductions },
+        { "vm_stack_caching", BenchVmStackCaching },
+        { "superinstructions", BenchSuperinstructions },
+        { "jit", BenchJit },
+        { "static_program", BenchStaticProgram },
+        { "simd_kernels", BenchSimdKernels },
+        { "simd_accuracy", BenchSimdAccuracy },
+        { "line_stream", BenchLineStream },
+    };
+
+    for (const auto& benchmark: benchmarks)
+    {
+        bool selected = (argc < 2);
+        for (int i = 1; i < argc; ++i)
+            if (std::string(benchmark.Name).find(argv[i]) != std::string::npos)
+                selected = true;
+        if (!selected)
+            continue;
+        printf("%s\n", benchmark.Name);
+        benchmark.Run();
+    }
+    return gHasErrors ? 1 : 0;
+}
@@ -0,0 +1,369 @@
+#include "rpn_bytecode.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+
+namespace RpnCalculator
+{
+    static const char* gInstrNames[] = {
+        "PushConstant", "PushInput",
+        "Add", "Subtract", "Multiply", "Divide", "Power",
+        "Sin", "Cos", "Tan", "ArcSin", "ArcCos", "ArcTan",
+        "Reciprocal", "Log10", "Ln", "Pow10", "Exp", "Sqrt", "Square", "Floor", "Negate",
+        "ToDeg", "ToRad", "ToGrad",
+        "Swap", "Dup", "Drop", "Clear", "Sto", "Recall", "Roll",
+        "SetDeg", "SetRad", "SetGrad",
+        "AddConstant", "SubtractConstant", "MultiplyConstant", "DivideConstant", "PowerConstant",
+        "AddInput", "SubtractInput", "MultiplyInput", "DivideInput",
+        "SubtractReversed", "DivideReversed",
+        "SquareAdd",
+    };
+    static_assert(sizeof(gInstrNames) / sizeof(gInstrNames[0]) == (size_t)Instr::Count,
+                  "gInstrNames must have one name per Instr");
+
+    const char* InstrName(Instr instr)
+    {
+        return gInstrNames[(size_t)instr];
+    }
+
+
+    //
+    // Compiler
+    //
+
+    // Returns true if the OpCode was translated (possibly into no instruction at all)
+    static bool _compileOpCode(OpCode op, Program& program)
+    {
+        CompiledOpCode compiled;
+        if (!CompileOpCode(op, compiled))
+            return false;
+        if (compiled.Kind == CompiledOpCode::KindType::Constant)
+        {
+            program.Code.push_back({Instr::PushConstant, (uint32_t)program.Constants.size()});
+            program.Constants.push_back(compiled.Constant);
+        }
+        else if (compiled.Kind == CompiledOpCode::KindType::Instruction)
+            program.Code.push_back({compiled.Op, 0});
+        return true;
+    }
+
+    //
+    // Superinstructions
+    //
+    struct Superinstruction
+    {
+        Instr First, Second; // the pair of plain instructions
+        Instr Fused;
+    };
+    static const Superinstruction gSuperinstructions[] = {
+        { Instr::PushConstant, Instr::Add, Instr::AddConstant },
+        { Instr::PushConstant, Instr::Subtract, Instr::SubtractConstant },
+        { Instr::PushConstant, Instr::Multiply, Instr::MultiplyConstant },
+        { Instr::PushConstant, Instr::Divide, Instr::DivideConstant },
+        { Instr::PushConstant, Instr::Power, Instr::PowerConstant },
+        { Instr::PushInput, Instr::Add, Instr::AddInput },
+        { Instr::PushInput, Instr::Subtract, Instr::SubtractInput },
+        { Instr::PushInput, Instr::Multiply, Instr::MultiplyInput },
+        { Instr::PushInput, Instr::Divide, Instr::DivideInput },
+        { Instr::Swap, Instr::Subtract, Instr::SubtractReversed },
+        { Instr::Swap, Instr::Divide, Instr::DivideReversed },
+        { Instr::Square, Instr::Add, Instr::SquareAdd },
+    };
+
+    void FuseSuperinstructions(Program& program)
+    {
+        std::vector<Instruction>& code = program.Code;
+        size_t nbFused = 0;
+        for (size_t i = 0; i < code.size(); ++i)
+        {
+            Instruction instruction = code[i];
+            if (i + 1 < code.size())
+            {
+                for (const auto& superinstruction: gSuperinstructions)
+                {
+                    if (code[i].Op == superinstruction.First && code[i + 1].Op == superinstruction.Second)
+                    {
+                        instruction.Op = superinstruction.Fused; // Arg stays the one of the first instruction
+                        ++i;
+                        break;
+                    }
+                }
+            }
+            code[nbFused++] = instruction;
+        }
+        code.resize(nbFused);
+    }
+
+    void ExpandSuperinstructions(Program& program)
+    {
+        std::vector<Instruction> expanded;
+        expanded.reserve(program.Code.size() * 2);
+        for (const Instruction& instruction: program.Code)
+        {
+            const Superinstruction* superinstruction = nullptr;
+            for (const auto& candidate: gSuperinstructions)
+                if (candidate.Fused == instruction.Op)
+                    superinstruction = &candidate;
+            if (superinstruction == nullptr)
+                expanded.push_back(instruction);
+            else
+            {
+                expanded.push_back({superinstruction->First, instruction.Arg});
+                expanded.push_back({superinstruction->Second, 0});
+            }
+        }
+        program.Code = std::move(expanded);
+    }
+
+
+    bool VerifyProgram(Program& program, std::string& errorMessage)
+    {
+        // Until the first Clear, the depth is relative to the entry depth; after it, the depth is absolute
+        bool isDepthAbsolute = false;
+        int64_t depth = 0;
+        int64_t minEntryDepth = 0, maxGrowth = 0;
+        for (const auto& instruction: program.Code)
+        {
+            if (instruction.Op == Instr::Clear)
+            {
+                isDepthAbsolute = true;
+                depth = 0;
+                continue;
+            }
+            size_t nbRequired;
+            int depthChange;
+            GetStackEffect(instruction.Op, nbRequired, depthChange);
+            if (depth < (int64_t)nbRequired)
+            {
+                if (isDepthAbsolute)
+                {
+                    errorMessage = "Not enough values on the stack";
+                    return false;
+                }
+                minEntryDepth = std::max(minEntryDepth, (int64_t)nbRequired - depth);
+            }
+            depth += depthChange;
+            maxGrowth = std::max(maxGrowth, depth);
+        }
+        program.MinEntryDepth = (size_t)minEntryDepth;
+        program.MaxGrowth = (size_t)maxGrowth;
+        return true;
+    }
+
+    bool CompileProgram(std::string_view source, Program& program, std::string& errorMessage)
+    {
+        program.clear();
+
+        RpnTokenizer tokenizer(source);
+        std::string_view token;
+        while (tokenizer.Next(token))
+        {
+            if (IsNumberToken(token))
+            {
+                std::optional<double> v = ParseNumber(token);
+                if (!v.has_value())
+                {
+                    errorMessage = "Invalid number: " + std::string(token);
+                    return false;
+                }
+                program.Code.push_back({Instr::PushConstant, (uint32_t)program.Constants.size()});
+                program.Constants.push_back(v.value());
+            }
+            else if (token == "x")
+                program.Code.push_back({Instr::PushInput, 0});
+            else
+            {
+                OpCode op = OpCodeFromLabel(token);
+                if (!_compileOpCode(op, program))
+                {
+                    errorMessage = "Unsupported token: " + std::string(token);
+                    return false;
+                }
+            }
+        }
+
+        FuseSuperinstructions(program);
+        return VerifyProgram(program, errorMessage);
+    }
+
+
+    //
+    // Virtual machine
+    //
+
+    // State of VirtualMachine::Run, handed over between the specializations of the interpreter loop
+    struct _VmRegisters
+    {
+        const Instruction* Ip;
+        double* Sp;
+        double Tos;
+        double StoredValue;
+        AngleUnitType AngleUnit;
+    };
+
+    // The interpreter loop, specialized on the angle unit, so that the angle conversions are inlined without testing
+    // the unit. It returns at the end of the program, on error (false), or after an instruction which changes the
+    // angle unit: Run() then continues with the specialization for the new unit.
+    template<AngleUnitType Unit>
+    static bool _runWithAngleUnit(_VmRegisters& registers, const Program& program, double input, double* base,
+                                  std::string& errorMessage)
+    {
+        const Instruction* ip = registers.Ip;
+        const Instruction* codeEnd = program.Code.data() + program.Code.size();
+        const double* constants = program.Constants.data();
+        double* sp = registers.Sp;
+        double tos = registers.Tos;
+        double storedValue = registers.StoredValue;
+
+        #define RPN_PUSH(v) { *sp++ = tos; tos = (v); break; }
+        #define RPN_UNARY(expr) { double a = tos; tos = (expr); break; }
+        #define RPN_BINARY(expr) { double a = *--sp, b = tos; tos = (expr); break; }
+        // On error, the stack is left unchanged even if sp was moved (it is only written back on success)
+        #define RPN_DIVIDE(a, b) { \
+            double divisor = (b); \
+            if (divisor == 0.) { errorMessage = "Division by zero"; return false; } \
+            tos = (a) / divisor; break; }
+        #define RPN_SET_ANGLE_UNIT(unit) { \
+            if constexpr (Unit != unit) { registers.AngleUnit = unit; ++ip; goto exit; } \
+            break; }
+
+        for (; ip != codeEnd; ++ip)
+        {
+            switch (ip->Op)
+            {
+                case Instr::PushConstant: RPN_PUSH(constants[ip->Arg])
+                case Instr::PushInput: RPN_PUSH(input)
+
+                case Instr::Add: RPN_BINARY(a + b)
+                case Instr::Subtract: RPN_BINARY(a - b)
+                case Instr::Multiply: RPN_BINARY(a * b)
+                case Instr::Divide: RPN_DIVIDE(*--sp, tos)
+                case Instr::Power: RPN_BINARY(pow(a, b))
+
+                case Instr::Sin: RPN_UNARY(sin(ToRadian<Unit>(a)))
+                case Instr::Cos: RPN_UNARY(cos(ToRadian<Unit>(a)))
+                case Instr::Tan: RPN_UNARY(tan(ToRadian<Unit>(a)))
+                case Instr::ArcSin: RPN_UNARY(FromRadian<Unit>(asin(a)))
+                case Instr::ArcCos: RPN_UNARY(FromRadian<Unit>(acos(a)))
+                case Instr::ArcTan: RPN_UNARY(FromRadian<Unit>(atan(a)))
+                case Instr::Reciprocal: RPN_UNARY(1. / a)
+                case Instr::Log10: RPN_UNARY(log10(a))
+                case Instr::Ln: RPN_UNARY(log(a))
+                case Instr::Pow10: RPN_UNARY(pow(10., a))
+                case Instr::Exp: RPN_UNARY(exp(a))
+                case Instr::Sqrt: RPN_UNARY(sqrt(a))
+                case Instr::Square: RPN_UNARY(a * a)
+                case Instr::Floor: RPN_UNARY(floor(a))
+                case Instr::Negate: RPN_UNARY(-a)
+                case Instr::ToDeg: RPN_UNARY(FromRadian<AngleUnitType::Deg>(ToRadian<Unit>(a)))
+                case Instr::ToRad: RPN_UNARY(ToRadian<Unit>(a))
+                case Instr::ToGrad: RPN_UNARY(FromRadian<AngleUnitType::Grad>(ToRadian<Unit>(a)))
+
+                case Instr::Swap:
+                {
+                    double a = sp[-1];
+                    sp[-1] = tos;
+                    tos = a;
+                    break;
+                }
+                case Instr::Dup: *sp++ = tos; break;
+                case Instr::Drop: tos = *--sp; break;
+                case Instr::Clear: sp = base - 1; break;
+                case Instr::Sto: storedValue = tos; break;
+                case Instr::Recall: RPN_PUSH(storedValue)
+                case Instr::Roll:
+                {
+                    // the top value goes to the bottom, and the value below it becomes the top
+                    if (sp > base)
+                    {
+                        double a = tos;
+                        tos = sp[-1];
+                        memmove(base + 1, base, (size_t)(sp - 1 - base) * sizeof(double));
+                        base[0] = a;
+                    }
+                    break;
+                }
+
+                case Instr::SetDeg: RPN_SET_ANGLE_UNIT(AngleUnitType::Deg)
+                case Instr::SetRad: RPN_SET_ANGLE_UNIT(AngleUnitType::Rad)
+                case Instr::SetGrad: RPN_SET_ANGLE_UNIT(AngleUnitType::Grad)
+
+                case Instr::AddConstant: RPN_UNARY(a + constants[ip->Arg])
+                case Instr::SubtractConstant: RPN_UNARY(a - constants[ip->Arg])
+                case Instr::MultiplyConstant: RPN_UNARY(a * constants[ip->Arg])
+                case Instr::DivideConstant: RPN_DIVIDE(tos, constants[ip->Arg])
+                case Instr::PowerConstant: RPN_UNARY(pow(a, constants[ip->Arg]))
+                case Instr::AddInput: RPN_UNARY(a + input)
+                case Instr::SubtractInput: RPN_UNARY(a - input)
+                case Instr::MultiplyInput: RPN_UNARY(a * input)
+                case Instr::DivideInput: RPN_DIVIDE(tos, input)
+                case Instr::SubtractReversed: RPN_BINARY(b - a)
+                case Instr::DivideReversed: RPN_DIVIDE(tos, *--sp)
+                case Instr::SquareAdd: RPN_BINARY(a + b * b)
+
+                case Instr::Count: break;
+            }
+        }
+
+        #undef RPN_PUSH
+        #undef RPN_DIVIDE
+        #undef RPN_UNARY
+        #undef RPN_BINARY
+        #undef RPN_SET_ANGLE_UNIT
+
+    exit:
+        registers.Ip = ip;
+        registers.Sp = sp;
+        registers.Tos = tos;
+        registers.StoredValue = storedValue;
+        return true;
+    }
+
+    bool VirtualMachine::Run(const Program& program, CalculatorStack& stack)
+    {
+        ErrorMessage.clear();
+        if (stack.has_vectors())
+        {
+            ErrorMessage = "Programs do not support vectors";
+            return false;
+        }
+        // The program is verified: checking the entry depth is enough to ensure that no instruction underflows
+        size_t initialSize = stack.size();
+        if (initialSize < program.MinEntryDepth)
+        {
+            ErrorMessage = "Not enough values on the stack";
+            return false;
+        }
+
+        // Work on a contiguous copy of the stack, whose top value is cached in a register (tos):
+        // the values below it are in memory, and sp points one past them.
+        // base[-1] is a dummy slot: with an empty stack, sp is base - 1, and a push spills the (meaningless)
+        // tos there, so that pushes never need to test the depth.
+        _buffer.resize(initialSize + program.MaxGrowth + 2);
+        double* base = _buffer.data() + 1;
+        for (size_t i = 0; i < initialSize; ++i)
+            base[i] = stack[(int)i];
+        double* sp = base + initialSize - 1;
+        double tos = (initialSize > 0) ? *sp : 0.;
+
+        // The angle unit is tested once per run (and at each instruction which changes it), not once per value
+        _VmRegisters registers{program.Code.data(), sp, tos, StoredValue, AngleUnit};
+        const Instruction* codeEnd = program.Code.data() + program.Code.size();
+        while (registers.Ip != codeEnd)
+        {
+            bool success = WithAngleUnit(registers.AngleUnit, [&](auto unit) {
+                return _runWithAngleUnit<decltype(unit)::value>(registers, program, Input, base, ErrorMessage);
+            });
+            if (!success)
+                return false;
+        }
+
+        AngleUnit = registers.AngleUnit;
+        StoredValue = registers.StoredValue;
+        *registers.Sp = registers.Tos; // spill the top value (into the dummy slot if the stack is empty)
+        stack.assign(base, registers.Sp + 1);
+        return true;
+    }
+
+}
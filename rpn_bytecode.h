@@ -0,0 +1,227 @@
+#pragma once
+#include "rpn_calculator.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+namespace RpnCalculator
+{
+    //
+    // Compiled RPN programs
+    //
+    // An RPN program is a sequence of tokens separated by white spaces, e.g. "x 1.8 * 32 +".
+    // Tokens are numbers, OpCode labels (see OpCodeFromLabel), or "x" (the input value of the program).
+    // CompileProgram() turns it into a compact bytecode, which VirtualMachine runs against a CalculatorStack,
+    // without the interactive overhead of CalculatorState (no input string, no undo, no error string per key).
+    //
+
+    enum class Instr : uint8_t
+    {
+        PushConstant,   // Arg = index in Program::Constants
+        PushInput,      // "x"
+
+        // Binary operators
+        Add, Subtract, Multiply, Divide, Power,
+        // Unary operators
+        Sin, Cos, Tan, ArcSin, ArcCos, ArcTan,
+        Reciprocal, Log10, Ln, Pow10, Exp, Sqrt, Square, Floor, Negate,
+        ToDeg, ToRad, ToGrad,
+        // Stack operators
+        Swap, Dup, Drop, Clear, Sto, Recall, Roll,
+        // Angle unit
+        SetDeg, SetRad, SetGrad,
+
+        // Superinstructions (see FuseSuperinstructions): a pair of instructions, dispatched once
+        AddConstant, SubtractConstant, MultiplyConstant, DivideConstant, PowerConstant, // "3 +": Arg = constant index
+        AddInput, SubtractInput, MultiplyInput, DivideInput,                            // "x +"
+        SubtractReversed, DivideReversed,                                               // "Swap -", "Swap /"
+        SquareAdd,                                                                      // "x^2 +"
+
+        Count
+    };
+    const char* InstrName(Instr instr);
+
+
+    struct Instruction
+    {
+        Instr    Op = Instr::PushConstant;
+        uint32_t Arg = 0;
+    };
+
+
+    struct Program
+    {
+        std::vector<Instruction> Code;
+        std::vector<double> Constants;
+        // Stack depth requirements, computed by VerifyProgram():
+        size_t MinEntryDepth = 0;   // number of values the program needs on the stack when it starts
+        size_t MaxGrowth = 0;       // maximum number of values the program adds above its entry depth
+
+        void clear() { Code.clear(); Constants.clear(); MinEntryDepth = 0; MaxGrowth = 0; }
+    };
+
+
+    // Splits an RPN program into tokens (separated by white spaces)
+    struct RpnTokenizer
+    {
+        std::string_view Source;
+        size_t Position = 0;
+
+        explicit constexpr RpnTokenizer(std::string_view source) : Source(source) {}
+        // Returns false when there are no more tokens
+        constexpr bool Next(std::string_view& token)
+        {
+            while (Position < Source.size() && _isSpace(Source[Position]))
+                ++Position;
+            if (Position >= Source.size())
+                return false;
+            size_t start = Position;
+            while (Position < Source.size() && !_isSpace(Source[Position]))
+                ++Position;
+            token = Source.substr(start, Position - start);
+            return true;
+        }
+
+    private:
+        static constexpr bool _isSpace(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+    };
+
+
+    // How an OpCode is compiled: into one instruction, into a constant (Pi, e), or into nothing at all (keys such as
+    // Enter, which only end the number being typed).
+    // Returns false if the OpCode cannot be compiled (e.g. Undo, which only CalculatorState supports).
+    // (constexpr: also used to compile programs at compile time, see rpn_static.h)
+    struct CompiledOpCode
+    {
+        enum class KindType { Instruction, Constant, Nothing };
+        KindType Kind = KindType::Nothing;
+        Instr    Op = Instr::PushConstant;
+        double   Constant = 0.;
+    };
+    constexpr bool CompileOpCode(OpCode op, CompiledOpCode& compiled)
+    {
+        auto instruction = [&compiled](Instr instr) { compiled = {CompiledOpCode::KindType::Instruction, instr, 0.}; };
+        auto constant = [&compiled](double v) { compiled = {CompiledOpCode::KindType::Constant, Instr::PushConstant, v}; };
+        compiled = CompiledOpCode();
+
+        switch (op)
+        {
+            // Same values as the strings entered by CalculatorState::_onDirectNumber
+            case OpCode::Pi: constant(3.1415926535897932384626433832795); return true;
+            case OpCode::Euler: constant(2.7182818284590452353602874713527); return true;
+
+            case OpCode::PlusMinus: instruction(Instr::Negate); return true;
+
+            case OpCode::Add: instruction(Instr::Add); return true;
+            case OpCode::Subtract: instruction(Instr::Subtract); return true;
+            case OpCode::Multiply: instruction(Instr::Multiply); return true;
+            case OpCode::Divide: instruction(Instr::Divide); return true;
+            case OpCode::Power: instruction(Instr::Power); return true;
+
+            case OpCode::Sin: instruction(Instr::Sin); return true;
+            case OpCode::Cos: instruction(Instr::Cos); return true;
+            case OpCode::Tan: instruction(Instr::Tan); return true;
+            case OpCode::ArcSin: instruction(Instr::ArcSin); return true;
+            case OpCode::ArcCos: instruction(Instr::ArcCos); return true;
+            case OpCode::ArcTan: instruction(Instr::ArcTan); return true;
+            case OpCode::Reciprocal: instruction(Instr::Reciprocal); return true;
+            case OpCode::Log10: instruction(Instr::Log10); return true;
+            case OpCode::Ln: instruction(Instr::Ln); return true;
+            case OpCode::Pow10: instruction(Instr::Pow10); return true;
+            case OpCode::Exp: instruction(Instr::Exp); return true;
+            case OpCode::Sqrt: instruction(Instr::Sqrt); return true;
+            case OpCode::Square: instruction(Instr::Square); return true;
+            case OpCode::Floor: instruction(Instr::Floor); return true;
+
+            case OpCode::Swap: instruction(Instr::Swap); return true;
+            case OpCode::Dup: instruction(Instr::Dup); return true;
+            case OpCode::Drop: instruction(Instr::Drop); return true;
+            case OpCode::Clear: instruction(Instr::Clear); return true;
+            case OpCode::Sto: instruction(Instr::Sto); return true;
+            case OpCode::Recall: instruction(Instr::Recall); return true;
+            case OpCode::Roll: instruction(Instr::Roll); return true;
+
+            case OpCode::Deg: instruction(Instr::SetDeg); return true;
+            case OpCode::Rad: instruction(Instr::SetRad); return true;
+            case OpCode::Grad: instruction(Instr::SetGrad); return true;
+            case OpCode::ToDeg: instruction(Instr::ToDeg); return true;
+            case OpCode::ToRad: instruction(Instr::ToRad); return true;
+            case OpCode::ToGrad: instruction(Instr::ToGrad); return true;
+
+            // Numbers are pushed as soon as they are read: those have nothing to do
+            case OpCode::Enter:
+            case OpCode::Backspace:
+            case OpCode::Inv:
+            case OpCode::ScientificMode:
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    // Compiles an RPN program into `program` (whose buffers are reused), fuses its superinstructions, and verifies it
+    // (see VerifyProgram).
+    // Returns false and fills errorMessage if the program is invalid.
+    bool CompileProgram(std::string_view source, Program& program, std::string& errorMessage);
+
+    // Superinstructions fuse frequent pairs of instructions, so that they are dispatched once.
+    // The set was chosen by hand for the formulas of rpn_bench (e.g. "x 1.8 * 32 +",
+    // "x x^2 1 x^2 + 2 Swap / x Swap -"): operators applied to a constant or to "x", "Swap -", "Swap /" and "x^2 +".
+    // rpn_cli --profile lists the pairs of a file of programs, and which of them are fused, to revisit the set.
+    // CompileProgram() fuses the code it emits; ExpandSuperinstructions() turns the code back into plain instructions
+    // (e.g. to rewrite or profile it).
+    void FuseSuperinstructions(Program& program);
+    void ExpandSuperinstructions(Program& program);
+
+    // Stack effect of an instruction: it needs nbRequired values on the stack, and changes the stack depth by
+    // depthChange (except Clear, which empties the stack whatever its depth)
+    constexpr void GetStackEffect(Instr instr, size_t& nbRequired, int& depthChange)
+    {
+        switch (instr)
+        {
+            case Instr::PushConstant: case Instr::PushInput: case Instr::Recall:
+                nbRequired = 0; depthChange = 1; return;
+            case Instr::Add: case Instr::Subtract: case Instr::Multiply: case Instr::Divide: case Instr::Power:
+            case Instr::SubtractReversed: case Instr::DivideReversed: case Instr::SquareAdd:
+                nbRequired = 2; depthChange = -1; return;
+            case Instr::Swap:
+                nbRequired = 2; depthChange = 0; return;
+            case Instr::Dup:
+                nbRequired = 1; depthChange = 1; return;
+            case Instr::Drop:
+                nbRequired = 1; depthChange = -1; return;
+            case Instr::Clear: case Instr::SetDeg: case Instr::SetRad: case Instr::SetGrad: case Instr::Count:
+                nbRequired = 0; depthChange = 0; return;
+            default: // unary operators (including an operator applied to a constant or to "x"), Sto, Roll
+                nbRequired = 1; depthChange = 0; return;
+        }
+    }
+
+    // Static verification of the stack depth: since a program has no branches, the stack effect of each instruction
+    // is known ahead of time. Fills program.MinEntryDepth and program.MaxGrowth, so that VirtualMachine and
+    // BatchEvaluator only check the stack depth once, when the program starts.
+    // Returns false and fills errorMessage if the program underflows the stack whatever its entry depth
+    // (e.g. "Clear +"). Must be called again after the code is rewritten (e.g. by PeepholeOptimizer).
+    bool VerifyProgram(Program& program, std::string& errorMessage);
+
+
+    struct VirtualMachine
+    {
+        // Registers (they persist between runs, like in CalculatorState)
+        AngleUnitType AngleUnit = AngleUnitType::Deg;
+        double StoredValue = 0.;
+        double Input = 0.;          // value of "x"
+        std::string ErrorMessage;
+
+        // Runs the program (verified by VerifyProgram) on the stack, which may not hold vectors. The stack undo history
+        // is reset. On error, returns false, fills ErrorMessage, and leaves the stack unchanged.
+        bool Run(const Program& program, CalculatorStack& stack);
+
+    private:
+        std::vector<double> _buffer;
+    };
+
+}
@@ -1,4 +1,11 @@
 #include "rpn_calculator.h"
+#include "rpn_vector.h"
+#include <charconv>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
 
 
 namespace RpnCalculator
@@ -28,9 +35,14 @@ namespace RpnCalculator
                 { "floor", ButtonType::UnaryOperator },
                 { "y^x", ButtonType::BinaryOperator }},
 
+            {   { "Sum", ButtonType::Reduction, "Prod" },
+                { "Mean", ButtonType::Reduction },
+                { "Var", ButtonType::Reduction, "Std" },
+                { "Min", ButtonType::Reduction, "Max" }},
+
             {   { "Sto", ButtonType::StackOperator },
                 { "Recall", ButtonType::StackOperator },
-                { "Undo", ButtonType::StackOperator },
+                { "Undo", ButtonType::StackOperator, "Redo" },
                 { "Sci", ButtonType::ScientificMode }},
 
             {   { "Swap", ButtonType::StackOperator },
@@ -63,9 +75,9 @@ namespace RpnCalculator
                 { "+", ButtonType::BinaryOperator }},
         };
 
-        // ButtonsBasicMode = ButtonsScientificMode without the first 4 rows
+        // ButtonsBasicMode = ButtonsScientificMode without the first 5 rows
         ButtonsBasicMode = ButtonsScientificMode;
-        ButtonsBasicMode.erase(ButtonsBasicMode.begin(), ButtonsBasicMode.begin() + 4);
+        ButtonsBasicMode.erase(ButtonsBasicMode.begin(), ButtonsBasicMode.begin() + 5);
     }
 
     std::vector<std::vector<CalculatorButtonWithInverse>>& CalculatorLayoutDefinition::GetButtons(bool scientificMode)
@@ -74,6 +86,65 @@ namespace RpnCalculator
     }
 
 
+    static bool _isSameLabel(std::string_view label, const char* reference)
+    {
+        size_t i = 0;
+        for (; i < label.size() && reference[i] != '\0'; ++i)
+        {
+            char c = (label[i] == '_') ? ' ' : label[i];
+            if (c != reference[i])
+                return false;
+        }
+        return i == label.size() && reference[i] == '\0';
+    }
+
+    // FNV-1a hash of a label, where '_' is hashed as ' '
+    static uint32_t _labelHash(std::string_view label)
+    {
+        uint32_t hash = 2166136261u;
+        for (char c: label)
+            hash = (hash ^ (uint8_t)(c == '_' ? ' ' : c)) * 16777619u;
+        return hash;
+    }
+
+    // Open addressing hash table of the labels (the token streams of rpn_cli --lines look up one label per operator)
+    struct OpCodeLabelTable
+    {
+        static constexpr size_t Size = 128; // power of two, > 2 * OpCode::Count
+        OpCode Slots[Size] = {};
+
+        OpCodeLabelTable()
+        {
+            for (size_t i = 1; i < (size_t)OpCode::Count; ++i)
+            {
+                size_t slot = _labelHash(gOpCodeLabels[i]) & (Size - 1);
+                while (Slots[slot] != OpCode::None)
+                    slot = (slot + 1) & (Size - 1);
+                Slots[slot] = (OpCode)i;
+            }
+        }
+    };
+    static_assert((size_t)OpCode::Count * 2 < OpCodeLabelTable::Size, "OpCodeLabelTable::Size is too small");
+
+    OpCode OpCodeFromLabel(std::string_view label)
+    {
+        static const OpCodeLabelTable table;
+        size_t slot = _labelHash(label) & (OpCodeLabelTable::Size - 1);
+        while (table.Slots[slot] != OpCode::None)
+        {
+            if (_isSameLabel(label, gOpCodeLabels[(size_t)table.Slots[slot]]))
+                return table.Slots[slot];
+            slot = (slot + 1) & (OpCodeLabelTable::Size - 1);
+        }
+        return OpCode::None;
+    }
+
+    const char* OpCodeLabel(OpCode op)
+    {
+        return gOpCodeLabels[(size_t)op];
+    }
+
+
     CalculatorButtonWithInverse::CalculatorButtonWithInverse(
         const std::string& label,
         ButtonType type,
@@ -82,6 +153,7 @@ namespace RpnCalculator
     {
         Button.Label = label;
         Button.Type = type;
+        Button.Op = OpCodeFromLabel(label);
         if (Button.Label == "Enter")
             Button.IsDoubleWidth = true;
         if (!inverseLabel.empty())
@@ -90,6 +162,7 @@ namespace RpnCalculator
             if (inverseType.has_value())
                 InverseButton->Type = inverseType.value();
             InverseButton->IsDoubleWidth = Button.IsDoubleWidth;
+            InverseButton->Op = OpCodeFromLabel(inverseLabel);
         }
     }
 
@@ -111,6 +184,93 @@ namespace RpnCalculator
     }
 
 
+    std::optional<double> ParseNumber(std::string_view s)
+    {
+        // Like istringstream, accept a leading '+', but not "inf", "nan" (which from_chars accepts)
+        if (s.size() > 1 && s[0] == '+' && s[1] != '-')
+            s.remove_prefix(1);
+        size_t firstDigit = (!s.empty() && s[0] == '-') ? 1 : 0;
+        if (firstDigit >= s.size() || !((s[firstDigit] >= '0' && s[firstDigit] <= '9') || s[firstDigit] == '.'))
+            return std::nullopt;
+
+        // Fast path for plain decimals of up to 15 digits (e.g. "12.75"): the mantissa and the power of ten are
+        // exact doubles, so that their quotient is correctly rounded
+        {
+            static const double powersOf10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                                 1e11, 1e12, 1e13, 1e14, 1e15 };
+            uint64_t mantissa = 0;
+            int nbDigits = 0, nbFractionDigits = 0;
+            bool hasDot = false;
+            size_t i = firstDigit;
+            for (; i < s.size() && nbDigits <= 15; ++i)
+            {
+                char c = s[i];
+                if (c >= '0' && c <= '9')
+                {
+                    mantissa = mantissa * 10 + (uint64_t)(c - '0');
+                    ++nbDigits;
+                    nbFractionDigits += hasDot ? 1 : 0;
+                }
+                else if (c == '.' && !hasDot)
+                    hasDot = true;
+                else
+                    break;
+            }
+            if (i == s.size() && nbDigits > 0 && nbDigits <= 15)
+            {
+                double v = (double)mantissa / powersOf10[nbFractionDigits];
+                return firstDigit == 1 ? -v : v;
+            }
+        }
+
+#if defined(__cpp_lib_to_chars)
+        double v;
+        auto [end, error] = std::from_chars(s.data(), s.data() + s.size(), v);
+        if (end != s.data() + s.size())
+            return std::nullopt;
+        if (error == std::errc())
+            return v;
+        // Like istringstream, values that are too small are rounded to zero (but values that are too large are rejected)
+        bool isUnderflow = (s.find("E-") != std::string_view::npos) || (s.find("e-") != std::string_view::npos);
+        if (error == std::errc::result_out_of_range && isUnderflow)
+            return firstDigit == 1 ? -0. : 0.;
+        return std::nullopt;
+#else
+        // Floating point from_chars is not available with this standard library
+        std::istringstream iss{std::string(s)};
+        double v;
+        iss >> v;
+        if (!iss.fail() && iss.eof())
+            return v;
+        return std::nullopt;
+#endif
+    }
+
+    bool ParseNumberList(std::string_view s, std::vector<double>& values)
+    {
+        auto isSeparator = [](char c) {
+            return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == ',' || c == ';';
+        };
+        values.clear();
+        size_t position = 0;
+        while (position < s.size())
+        {
+            while (position < s.size() && isSeparator(s[position]))
+                ++position;
+            size_t start = position;
+            while (position < s.size() && !isSeparator(s[position]))
+                ++position;
+            if (position == start)
+                break;
+            std::optional<double> v = ParseNumber(s.substr(start, position - start));
+            if (!v.has_value())
+                return false;
+            values.push_back(v.value());
+        }
+        return true;
+    }
+
+
 // Helper functions for AngleUnit enum since it's not directly supported by nlohmann/json
     NLOHMANN_JSON_SERIALIZE_ENUM( AngleUnitType, {
         {AngleUnitType::Deg, "Deg"},
@@ -120,137 +280,622 @@ namespace RpnCalculator
 
 
     //
-    //  CalculatorState implementation
+    //  CalculatorStack implementation
     //
 
-    bool CalculatorState::_stackInput()
+    void CalculatorStack::assign(const double* first, const double* last)
     {
-        if (Input.empty())
-            return true;
+        Stack.assign(first, last);
+        _vectors.clear();
+        _nbVectors = 0;
+        _clearUndoHistory();
+    }
 
-        bool success = false;
+    void CalculatorStack::clear()
+    {
+        if (_nbVectors > 0)
+        {
+            while (!Stack.empty())
+                pop_back();
+        }
+        else if (!Stack.empty())
+            pop_all(numbers());
+    }
+
+    StackVector CalculatorStack::numbers() const
+    {
+        auto values = std::make_shared<std::vector<double>>(Stack.size());
+        for (size_t i = 0; i < Stack.size(); ++i)
+            (*values)[i] = Stack[i];
+        return values;
+    }
+
+    void CalculatorStack::pop_all(const StackVector& numbers)
+    {
+        _logUndoVector(UndoEntry::Kind::PopAll, numbers);
+        Stack.clear();
+    }
+
+    StackValue CalculatorStack::value(int index) const
+    {
+        if (_nbVectors > 0 && _vectors[(size_t)index] != nullptr)
+            return {Stack[(size_t)index], _vectors[(size_t)index]};
+        return {Stack[(size_t)index], nullptr};
+    }
+
+    void CalculatorStack::push_back(const StackValue& v)
+    {
+        _pushBack(v);
+        if (v.is_vector())
+            _logUndoVector(UndoEntry::Kind::PushBack, v.Vector);
+        else
+            _logUndo(UndoEntry::Kind::PushBack, v.Scalar);
+    }
+
+    void CalculatorStack::push_front(const StackValue& v)
+    {
+        _pushFront(v);
+        if (v.is_vector())
+            _logUndoVector(UndoEntry::Kind::PushFront, v.Vector);
+        else
+            _logUndo(UndoEntry::Kind::PushFront, v.Scalar);
+    }
+
+    void CalculatorStack::_pushBack(const StackValue& v)
+    {
+        if (v.is_vector())
+        {
+            if (_nbVectors++ == 0)
+                _vectors.assign(Stack.size(), nullptr);
+            Stack.push_back(std::numeric_limits<double>::quiet_NaN());
+            _vectors.push_back(v.Vector);
+        }
+        else
+        {
+            Stack.push_back(v.Scalar);
+            if (_nbVectors > 0)
+                _vectors.push_back(nullptr);
+        }
+    }
+
+    void CalculatorStack::_pushFront(const StackValue& v)
+    {
+        if (v.is_vector())
+        {
+            if (_nbVectors++ == 0)
+                _vectors.assign(Stack.size(), nullptr);
+            Stack.push_front(std::numeric_limits<double>::quiet_NaN());
+            _vectors.push_front(v.Vector);
+        }
+        else
+        {
+            Stack.push_front(v.Scalar);
+            if (_nbVectors > 0)
+                _vectors.push_front(nullptr);
+        }
+    }
+
+    void CalculatorStack::_popBack()
+    {
+        if (_nbVectors > 0)
+        {
+            // Once the last vector is gone, _vectors only holds nullptr
+            if (_vectors.back() != nullptr && --_nbVectors == 0)
+                _vectors.clear();
+            else
+                _vectors.pop_back();
+        }
+        Stack.pop_back();
+    }
+
+    void CalculatorStack::_popFront()
+    {
+        if (_nbVectors > 0)
+        {
+            if (_vectors.front() != nullptr && --_nbVectors == 0)
+                _vectors.clear();
+            else
+                _vectors.pop_front();
+        }
+        Stack.pop_front();
+    }
+
+    void CalculatorStack::_popBackLogged()
+    {
+        if (_vectors.back() != nullptr)
+            _logUndoVector(UndoEntry::Kind::PopBack, _vectors.back());
+        else
+            _logUndo(UndoEntry::Kind::PopBack, Stack.back());
+        _popBack();
+    }
+
+    static size_t _vectorMemory(const StackVector& vector)
+    {
+        return sizeof(std::vector<double>) + vector->size() * sizeof(double);
+    }
+
+    static void _releaseVector(UndoEntry& entry, size_t& undoVectorMemory)
+    {
+        if (entry.Vector != nullptr)
+        {
+            undoVectorMemory -= _vectorMemory(entry.Vector);
+            entry.Vector = nullptr;
+        }
+    }
+
+    void CalculatorStack::_logUndoVector(UndoEntry::Kind change, const StackVector& vector)
+    {
+        _logUndo(change, std::numeric_limits<double>::quiet_NaN());
+        if (_isStepDiscarded)
+            return;
+        _undoRing[(_undoCursor - 1) & (_undoCapacity - 1)].Vector = vector;
+        _undoVectorMemory += _vectorMemory(vector);
+    }
 
+    // Called before a change is logged, while the log holds vectors: releases the vectors of the redo log (which the
+    // change forgets), and when an operation starts, evicts the oldest operations while the vectors use more than
+    // their budget
+    void CalculatorStack::_trimUndoVectors()
+    {
+        for (uint64_t position = _undoCursor; position != _undoEnd; ++position)
+            _releaseVector(_undoRing[position & (_undoCapacity - 1)], _undoVectorMemory);
+        _undoEnd = _undoCursor;
+        if (_isStepStartPending)
         {
-            std::istringstream iss(Input);
-            double v;
-            iss >> v;
+            while (_undoVectorMemory > _undoVectorBudget && _undoBegin != _undoCursor)
+                _evictOldestUndoStep();
+        }
+    }
 
-            if (!iss.fail() && iss.eof())
+    void CalculatorStack::undo()
+    {
+        if (!can_undo())
+            return;
+        bool isStepStart = false;
+        while (!isStepStart && _undoCursor != _undoBegin)
+        {
+            --_undoCursor;
+            const UndoEntry& entry = _undoRing[_undoCursor & (_undoCapacity - 1)];
+            switch (entry.Change)
             {
-                Stack.store_undo();
-                Stack.push_back(v);
-                success = true;
+                case UndoEntry::Kind::PushBack: _popBack(); break;
+                case UndoEntry::Kind::PopBack: _pushBack({entry.Value, entry.Vector}); break;
+                case UndoEntry::Kind::PushFront: _popFront(); break;
+                case UndoEntry::Kind::PopAll:
+                    Stack.assign(entry.Vector->data(), entry.Vector->data() + entry.Vector->size());
+                    break;
             }
-            else
-                ErrorMessage = "Invalid input";
+            isStepStart = entry.IsStepStart;
+        }
+    }
+
+    void CalculatorStack::redo()
+    {
+        if (!can_redo())
+            return;
+        do
+        {
+            const UndoEntry& entry = _undoRing[_undoCursor & (_undoCapacity - 1)];
+            switch (entry.Change)
+            {
+                case UndoEntry::Kind::PushBack: _pushBack({entry.Value, entry.Vector}); break;
+                case UndoEntry::Kind::PopBack: _popBack(); break;
+                case UndoEntry::Kind::PushFront: _pushFront({entry.Value, entry.Vector}); break;
+                case UndoEntry::Kind::PopAll: Stack.clear(); break;
+            }
+            ++_undoCursor;
+        } while (_undoCursor != _undoEnd && !_undoRing[_undoCursor & (_undoCapacity - 1)].IsStepStart);
+    }
+
+    void CalculatorStack::set_undo_memory_budget(size_t nbBytes)
+    {
+        size_t capacity = 1;
+        while (capacity * 2 * sizeof(UndoEntry) <= nbBytes)
+            capacity *= 2;
+        _clearUndoHistory();
+        _undoCapacity = capacity;
+        _undoRing.clear();
+        _undoRing.shrink_to_fit();
+    }
+
+    void CalculatorStack::_evictOldestUndoStep()
+    {
+        // Remove the oldest entry, and the remaining entries of its step
+        do
+        {
+            _releaseVector(_undoRing[_undoBegin & (_undoCapacity - 1)], _undoVectorMemory);
+            ++_undoBegin;
         }
+        while (_undoBegin != _undoCursor && !_undoRing[_undoBegin & (_undoCapacity - 1)].IsStepStart);
+    }
 
-        Input = "";
-        return success;
+    // The ring is full: evicts the oldest operation. If it is the current operation (its first change would be
+    // evicted), the current operation cannot be undone: the history is forgotten, and its next changes are not logged
+    bool CalculatorStack::_makeRoomForUndoEntry()
+    {
+        _evictOldestUndoStep();
+        if (_undoBegin == _undoCursor && !_isStepStartPending)
+        {
+            _clearUndoHistory();
+            _isStepDiscarded = true;
+            return false;
+        }
+        return true;
     }
 
-    void CalculatorState::_onEnter()
+    void CalculatorStack::_clearUndoHistory()
     {
-        (void)_stackInput();
+        for (uint64_t position = _undoBegin; _undoVectorMemory > 0 && position != _undoEnd; ++position)
+            _releaseVector(_undoRing[position & (_undoCapacity - 1)], _undoVectorMemory);
+        _undoBegin = _undoCursor = _undoEnd = 0;
+        _isStepStartPending = _isStepDiscarded = false;
     }
 
-    void CalculatorState::_onDirectNumber(const std::string& label)
+    void FormatDisplayedValue(double v, int nbDecimals, char* text, size_t textSize)
     {
-        if (label == "Pi")
-            Input += "3.1415926535897932384626433832795";
-        else if (label == "e")
-            Input += "2.7182818284590452353602874713527";
+#if defined(__cpp_lib_to_chars)
+        // to_chars with a precision formats like printf("%.*g"): convert to upper case for "%.*G"
+        auto [end, error] = std::to_chars(text, text + textSize - 1, v, std::chars_format::general, nbDecimals);
+        if (error == std::errc())
+        {
+            *end = '\0';
+            for (char* c = text; c != end; ++c)
+                *c = (char)toupper(*c);
+            return;
+        }
+#endif
+        snprintf(text, textSize, "%.*G", nbDecimals, v);
     }
 
-    void CalculatorState::_onStackOperator(const std::string& cmd)
+    // Text of a vector: its size, then as many of its first values as fit, e.g. "[1000] 0.5 0.25 0.125 ..."
+    static void _formatVector(const std::vector<double>& values, int nbDecimals, char* text, size_t textSize)
     {
-        if (cmd == "Swap")
+        const char ellipsis[] = " ...";
+        size_t length = (size_t)snprintf(text, textSize, "[%zu]", values.size());
+        for (size_t i = 0; i < values.size(); ++i)
         {
-            if (Stack.size() < 2)
+            char valueText[64];
+            FormatDisplayedValue(values[i], nbDecimals, valueText, sizeof(valueText));
+            size_t valueLength = strlen(valueText);
+            bool isLast = (i + 1 == values.size());
+            size_t reserved = isLast ? 0 : sizeof(ellipsis) - 1;
+            if (length + 1 + valueLength + reserved >= textSize)
             {
-                ErrorMessage = "Not enough values on the stack";
+                memcpy(text + length, ellipsis, sizeof(ellipsis));
                 return;
             }
-            Stack.store_undo();
-            double a = Stack.back();
-            Stack.pop_back();
-            double b = Stack.back();
-            Stack.pop_back();
-            Stack.push_back(a);
-            Stack.push_back(b);
+            text[length++] = ' ';
+            memcpy(text + length, valueText, valueLength + 1);
+            length += valueLength;
         }
-        else if (cmd == "Dup")
+    }
+
+    const char* CalculatorStack::display_string(int index, int nbDecimals) const
+    {
+        size_t indexFromTop = Stack.size() - 1 - (size_t)index;
+        if (_displayCache.size() <= indexFromTop)
+            _displayCache.resize(indexFromTop + 1);
+        DisplayCacheEntry& entry = _displayCache[indexFromTop];
+        if (is_vector(index))
         {
-            if (Stack.empty())
+            const StackVector& vector = _vectors[(size_t)index];
+            if (!entry.IsVector || entry.NbDecimals != nbDecimals || entry.Vector.lock() != vector)
             {
-                ErrorMessage = "Not enough values on the stack";
+                _formatVector(*vector, nbDecimals, entry.Text, sizeof(entry.Text));
+                entry.IsVector = true;
+                entry.Vector = vector;
+                entry.NbDecimals = nbDecimals;
+            }
+            return entry.Text;
+        }
+        double v = Stack[(size_t)index];
+        if (entry.IsVector || entry.NbDecimals != nbDecimals || memcmp(&entry.Value, &v, sizeof(double)) != 0)
+        {
+            FormatDisplayedValue(v, nbDecimals, entry.Text, sizeof(entry.Text));
+            entry.Value = v;
+            entry.IsVector = false;
+            entry.Vector.reset();
+            entry.NbDecimals = nbDecimals;
+        }
+        return entry.Text;
+    }
+
+    NLOHMANN_JSON_SERIALIZE_ENUM( UndoEntry::Kind, {
+        {UndoEntry::Kind::PushBack, "PushBack"},
+        {UndoEntry::Kind::PopBack, "PopBack"},
+        {UndoEntry::Kind::PushFront, "PushFront"},
+        {UndoEntry::Kind::PopAll, "PopAll"},
+    })
+
+    nlohmann::json CalculatorStack::to_json() const
+    {
+        nlohmann::json j;
+        nlohmann::json values = nlohmann::json::array();
+        for (size_t i = 0; i < Stack.size(); ++i)
+        {
+            if (is_vector((int)i))
+                values.push_back(*_vectors[i]);
+            else
+                values.push_back(Stack[i]);
+        }
+        j["Stack"] = values;
+
+        nlohmann::json undoLog = nlohmann::json::array();
+        for (uint64_t position = _undoBegin; position != _undoEnd; ++position)
+        {
+            const UndoEntry& entry = _undoRing[position & (_undoCapacity - 1)];
+            if (entry.Change == UndoEntry::Kind::PopAll)
+                undoLog.push_back({entry.Change, entry.Value, entry.IsStepStart, *entry.Vector});
+            else if (entry.Vector != nullptr)
+                return j;
+            else
+                undoLog.push_back({entry.Change, entry.Value, entry.IsStepStart});
+        }
+        j["UndoLog"] = undoLog;
+        j["UndoCursor"] = _undoCursor - _undoBegin;
+        return j;
+    }
+
+    void CalculatorStack::from_json(const nlohmann::json& j)
+    {
+        assign(nullptr, nullptr);
+        for (const auto& jValue: j["Stack"])
+        {
+            if (jValue.is_array())
+                _pushBack({0., std::make_shared<const std::vector<double>>(jValue.get<std::vector<double>>())});
+            else
+                _pushBack({jValue.get<double>(), nullptr});
+        }
+
+        if (j.contains("UndoLog") && j.contains("UndoCursor"))
+        {
+            const auto& undoLog = j["UndoLog"];
+            uint64_t undoCursor = j["UndoCursor"].get<uint64_t>();
+            if (undoLog.size() > _undoCapacity || undoCursor > undoLog.size())
                 return;
+            _undoRing.resize(_undoCapacity);
+            for (const auto& jEntry: undoLog)
+            {
+                UndoEntry& entry = _undoRing[_undoEnd & (_undoCapacity - 1)];
+                entry.Change = jEntry[0].get<UndoEntry::Kind>();
+                entry.Value = jEntry[1].get<double>();
+                entry.IsStepStart = jEntry[2].get<bool>();
+                entry.Vector = nullptr;
+                if (entry.Change == UndoEntry::Kind::PopAll && jEntry.size() > 3)
+                {
+                    entry.Vector = std::make_shared<const std::vector<double>>(jEntry[3].get<std::vector<double>>());
+                    _undoVectorMemory += _vectorMemory(entry.Vector);
+                }
+                ++_undoEnd;
             }
-            Stack.store_undo();
-            double a = Stack.back();
-            Stack.push_back(a);
+            _undoCursor = undoCursor;
+            if (!_isUndoLogConsistent())
+                _clearUndoHistory();
         }
-        else if (cmd == "Drop")
+    }
+
+    // Replays the changes of the log on the depth of the stack (the undo log backwards from the current stack, then
+    // the redo log forwards): false if a change would pop an empty stack, or if a PopAll does not remove the whole
+    // stack, i.e. if the log does not belong to the stack
+    bool CalculatorStack::_isUndoLogConsistent() const
+    {
+        size_t depth = Stack.size();
+        for (uint64_t position = _undoCursor; position != _undoBegin; --position)
         {
-            if (Stack.empty())
+            const UndoEntry& entry = _undoRing[(position - 1) & (_undoCapacity - 1)];
+            if (entry.Change == UndoEntry::Kind::PopAll)
             {
-                ErrorMessage = "Not enough values on the stack";
-                return;
+                if (depth != 0 || entry.Vector == nullptr)
+                    return false;
+                depth = entry.Vector->size();
             }
-            Stack.store_undo();
-            Stack.pop_back();
+            else if (entry.Change == UndoEntry::Kind::PopBack)
+                ++depth;
+            else if (depth-- == 0)
+                return false;
         }
-        else if (cmd == "Clear")
+        depth = Stack.size();
+        for (uint64_t position = _undoCursor; position != _undoEnd; ++position)
         {
-            Stack.store_undo();
-            Stack.clear();
+            const UndoEntry& entry = _undoRing[position & (_undoCapacity - 1)];
+            if (entry.Change == UndoEntry::Kind::PopAll)
+            {
+                if (entry.Vector == nullptr || depth != entry.Vector->size())
+                    return false;
+                depth = 0;
+            }
+            else if (entry.Change != UndoEntry::Kind::PopBack)
+                ++depth;
+            else if (depth-- == 0)
+                return false;
         }
-        else if (cmd == "Undo")
+        return true;
+    }
+
+
+    //
+    //  CalculatorState implementation
+    //
+
+    void CalculatorState::_appendInput(std::string_view chars)
+    {
+        if (_inputParser.length() != Input.size())
+            _inputParser.parse(Input);
+        Input += chars;
+        for (char c: chars)
+            _inputParser.push(c);
+        // Set after each key (OnOpCode clears it), as long as the input stays invalid
+        if (_inputParser.status() == NumberInputParser::Status::Invalid)
+            ErrorMessage = "Invalid input";
+    }
+
+    void CalculatorState::_onInputEdited()
+    {
+        _inputParser.parse(Input);
+        // e.g. a backspace may fix an invalid input, or leave it invalid
+        if (_inputParser.status() == NumberInputParser::Status::Invalid)
+            ErrorMessage = "Invalid input";
+        else if (ErrorMessage == "Invalid input")
+            ErrorMessage = "";
+    }
+
+    bool CalculatorState::_stackInput()
+    {
+        if (Input.empty())
+            return true;
+
+        bool success = false;
+
         {
-            Stack.undo();
+            // Input was normally parsed while it was typed: only complex numbers need a full parse
+            if (_inputParser.length() != Input.size())
+                _inputParser.parse(Input);
+            std::optional<double> v;
+            if (_inputParser.status() == NumberInputParser::Status::Valid)
+            {
+                v = _inputParser.fast_value();
+                if (!v.has_value())
+                    v = ParseNumber(Input);
+            }
+            if (v.has_value())
+            {
+                Stack.store_undo();
+                Stack.push_back(v.value());
+                success = true;
+            }
+            else
+                ErrorMessage = "Invalid input";
         }
-        else if (cmd == "Sto")
+
+        Input = "";
+        _inputParser.reset();
+        return success;
+    }
+
+    void CalculatorState::_onEnter()
+    {
+        (void)_stackInput();
+    }
+
+    void CalculatorState::_onDirectNumber(OpCode op)
+    {
+        if (op == OpCode::Pi)
+            _appendInput("3.1415926535897932384626433832795");
+        else if (op == OpCode::Euler)
+            _appendInput("2.7182818284590452353602874713527");
+    }
+
+    void CalculatorState::_onStackOperator(OpCode op)
+    {
+        switch (op)
         {
-            if (!Input.empty())
+            case OpCode::Swap:
             {
-                if (!_stackInput())
+                if (Stack.size() < 2)
                 {
-                    ErrorMessage = "Invalid number";
+                    ErrorMessage = "Not enough values on the stack";
                     return;
                 }
-                StoredValue = Stack.back();
+                Stack.store_undo();
+                StackValue a = Stack.back_value();
+                Stack.pop_back();
+                StackValue b = Stack.back_value();
                 Stack.pop_back();
+                Stack.push_back(a);
+                Stack.push_back(b);
+                break;
             }
-            else
+            case OpCode::Dup:
             {
                 if (Stack.empty())
                 {
                     ErrorMessage = "Not enough values on the stack";
                     return;
                 }
-                StoredValue = Stack.back();
+                Stack.store_undo();
+                Stack.push_back(Stack.back_value());
+                break;
             }
-        }
-        else if (cmd == "Recall")
-        {
-            Stack.store_undo();
-            Stack.push_back(StoredValue);
-        }
-        else if (cmd == "Roll")
-        {
-            if (Stack.empty())
+            case OpCode::Drop:
             {
-                ErrorMessage = "Not enough values on the stack";
-                return;
+                if (Stack.empty())
+                {
+                    ErrorMessage = "Not enough values on the stack";
+                    return;
+                }
+                Stack.store_undo();
+                Stack.pop_back();
+                break;
             }
-            Stack.store_undo();
-            double a = Stack.back();
-            Stack.pop_back();
-            Stack.push_front(a);
+            case OpCode::Clear:
+            {
+                Stack.store_undo();
+                Stack.clear();
+                break;
+            }
+            case OpCode::Undo:
+            {
+                Stack.undo();
+                break;
+            }
+            case OpCode::Redo:
+            {
+                Stack.redo();
+                break;
+            }
+            case OpCode::Sto:
+            {
+                if (!Input.empty())
+                {
+                    if (!_stackInput())
+                    {
+                        ErrorMessage = "Invalid number";
+                        return;
+                    }
+                    StoredValue = Stack.back();
+                    Stack.pop_back();
+                }
+                else
+                {
+                    if (Stack.empty())
+                    {
+                        ErrorMessage = "Not enough values on the stack";
+                        return;
+                    }
+                    if (Stack.is_vector((int)Stack.size() - 1))
+                    {
+                        ErrorMessage = "Cannot store a vector";
+                        return;
+                    }
+                    StoredValue = Stack.back();
+                }
+                break;
+            }
+            case OpCode::Recall:
+            {
+                Stack.store_undo();
+                Stack.push_back(StoredValue);
+                break;
+            }
+            case OpCode::Roll:
+            {
+                if (Stack.empty())
+                {
+                    ErrorMessage = "Not enough values on the stack";
+                    return;
+                }
+                Stack.store_undo();
+                StackValue a = Stack.back_value();
+                Stack.pop_back();
+                Stack.push_front(a);
+                break;
+            }
+            default:
+                break;
         }
     }
 
-    void CalculatorState::_onBinaryOperator(const std::string& cmd)
+    void CalculatorState::_onBinaryOperator(OpCode op)
     {
         if (!_stackInput())
             return;
@@ -259,49 +904,92 @@ namespace RpnCalculator
             ErrorMessage = "Not enough values on the stack";
             return;
         }
+        if (Stack.has_vectors() && (Stack.is_vector((int)Stack.size() - 1) || Stack.is_vector((int)Stack.size() - 2)))
+        {
+            _onVectorOperator(op);
+            return;
+        }
         Stack.store_undo();
         double b = Stack.back();
         Stack.pop_back();
         double a = Stack.back();
         Stack.pop_back();
-        if (cmd == "+")
-            Stack.push_back(a + b);
-        else if (cmd == "-")
-            Stack.push_back(a - b);
-        else if (cmd == "*")
-            Stack.push_back(a * b);
-        else if (cmd == "/")
-        {
-            if (b == 0.)
-                ErrorMessage = "Division by zero";
-            else
-                Stack.push_back(a / b);
+        switch (op)
+        {
+            case OpCode::Add: Stack.push_back(a + b); break;
+            case OpCode::Subtract: Stack.push_back(a - b); break;
+            case OpCode::Multiply: Stack.push_back(a * b); break;
+            case OpCode::Divide:
+                if (b == 0.)
+                    ErrorMessage = "Division by zero";
+                else
+                    Stack.push_back(a / b);
+                break;
+            case OpCode::Power: Stack.push_back(pow(a, b)); break;
+            default: break;
         }
-        else if (cmd == "y^x")
-            Stack.push_back(pow(a, b));
     }
 
-    double CalculatorState::_toRadian(double v) const
+    void CalculatorState::_onUnaryOperator(OpCode op)
     {
-        if (AngleUnit == AngleUnitType::Deg)
-            return v * 3.1415926535897932384626433832795 / 180.;
-        else if (AngleUnit == AngleUnitType::Grad)
-            return v * 3.1415926535897932384626433832795 / 200.;
-        else
-            return v;
+        if (!_stackInput())
+            return;
+        if (Stack.empty())
+        {
+            ErrorMessage = "Not enough values on the stack";
+            return;
+        }
+        if (Stack.is_vector((int)Stack.size() - 1))
+        {
+            _onVectorOperator(op);
+            return;
+        }
+        Stack.store_undo();
+        double a = Stack.back();
+        Stack.pop_back();
+        switch (op)
+        {
+            case OpCode::Sin: Stack.push_back(sin(ToRadian(a, AngleUnit))); break;
+            case OpCode::Cos: Stack.push_back(cos(ToRadian(a, AngleUnit))); break;
+            case OpCode::Tan: Stack.push_back(tan(ToRadian(a, AngleUnit))); break;
+            case OpCode::ArcSin: Stack.push_back(FromRadian(asin(a), AngleUnit)); break;
+            case OpCode::ArcCos: Stack.push_back(FromRadian(acos(a), AngleUnit)); break;
+            case OpCode::ArcTan: Stack.push_back(FromRadian(atan(a), AngleUnit)); break;
+            case OpCode::Reciprocal: Stack.push_back(1. / a); break;
+            case OpCode::Log10: Stack.push_back(log10(a)); break;
+            case OpCode::Ln: Stack.push_back(log(a)); break;
+            case OpCode::Pow10: Stack.push_back(pow(10., a)); break;
+            case OpCode::Exp: Stack.push_back(exp(a)); break;
+            case OpCode::Sqrt: Stack.push_back(sqrt(a)); break;
+            case OpCode::Square: Stack.push_back(a * a); break;
+            case OpCode::Floor: Stack.push_back(floor(a)); break;
+            default: break;
+        }
     }
 
-    double CalculatorState::_toCurrentAngleUnit(double radian) const
+    // An operator whose operands include a vector (the depth of the stack is checked): applied element-wise
+    void CalculatorState::_onVectorOperator(OpCode op)
     {
-        if (AngleUnit == AngleUnitType::Deg)
-            return radian * 180. / 3.1415926535897932384626433832795;
-        else if (AngleUnit == AngleUnitType::Grad)
-            return radian * 200. / 3.1415926535897932384626433832795;
+        StackVector result;
+        bool isBinary = (op >= OpCode::Add && op <= OpCode::Power);
+        if (isBinary)
+        {
+            StackValue a = Stack.value((int)Stack.size() - 2), b = Stack.back_value();
+            if (!ApplyVectorBinaryOperator(op, a, b, result, ErrorMessage))
+                return;
+        }
         else
-            return radian;
+            result = ApplyVectorUnaryOperator(op, *Stack.back_value().Vector, AngleUnit);
+
+        Stack.store_undo();
+        Stack.pop_back();
+        if (isBinary)
+            Stack.pop_back();
+        Stack.push_back(StackValue{0., result});
     }
 
-    void CalculatorState::_onUnaryOperator(const std::string& cmd)
+    // Reduces the vector on top of the stack to a number, or else the whole stack (see ReduceValues)
+    void CalculatorState::_onReduction(OpCode op)
     {
         if (!_stackInput())
             return;
@@ -310,74 +998,75 @@ namespace RpnCalculator
             ErrorMessage = "Not enough values on the stack";
             return;
         }
+        const bool isVector = Stack.is_vector((int)Stack.size() - 1);
+        if (!isVector && Stack.has_vectors())
+        {
+            ErrorMessage = "Cannot reduce a stack which holds vectors";
+            return;
+        }
+
+        // The copy of the stack is reduced, then kept by the undo log: the reduction is a single undo change
+        StackVector values = isVector ? Stack.back_value().Vector : Stack.numbers();
+        double result = 0.;
+        if (!ReduceValues(op, values->data(), values->size(), result))
+        {
+            ErrorMessage = isVector ? "Not enough values in the vector" : "Not enough values on the stack";
+            return;
+        }
+
         Stack.store_undo();
-        double a = Stack.back();
-        Stack.pop_back();
-        if (cmd == "sin")
-            Stack.push_back(sin(_toRadian(a)));
-        else if (cmd == "cos")
-            Stack.push_back(cos(_toRadian(a)));
-        else if (cmd == "tan")
-            Stack.push_back(tan(_toRadian(a)));
-        else if (cmd == "sin^-1")
-            Stack.push_back(_toCurrentAngleUnit(asin(a)));
-        else if (cmd == "cos^-1")
-            Stack.push_back(_toCurrentAngleUnit(acos(a)));
-        else if (cmd == "tan^-1")
-            Stack.push_back(_toCurrentAngleUnit(atan(a)));
-        else if (cmd == "1/x")
-            Stack.push_back(1. / a);
-        else if (cmd == "log")
-            Stack.push_back(log10(a));
-        else if (cmd == "ln")
-            Stack.push_back(log(a));
-        else if (cmd == "10^x")
-            Stack.push_back(pow(10., a));
-        else if (cmd == "e^x")
-            Stack.push_back(exp(a));
-        else if (cmd == "sqrt")
-            Stack.push_back(sqrt(a));
-        else if (cmd == "x^2")
-            Stack.push_back(a * a);
-        else if (cmd == "floor")
-            Stack.push_back(floor(a));
+        if (isVector)
+            Stack.pop_back();
+        else
+            Stack.pop_all(values);
+        Stack.push_back(result);
     }
 
     void CalculatorState::_onBackspace()
     {
         if (!Input.empty())
+        {
             Input.pop_back(); // Remove last input character
+            _onInputEdited();
+        }
     }
 
-    void CalculatorState::_onDegRadGrad(const std::string& cmd)
+    void CalculatorState::_onDegRadGrad(OpCode op)
     {
-        if (! InverseMode)
-        {
-            if (cmd == "Deg")
-                AngleUnit = AngleUnitType::Deg;
-            else if (cmd == "Rad")
-                AngleUnit = AngleUnitType::Rad;
-            else if (cmd == "Grad")
-                AngleUnit = AngleUnitType::Grad;
-        }
-        else
+        switch (op)
         {
-            if (!_stackInput())
-                return;
-            if (Stack.empty())
+            case OpCode::Deg: AngleUnit = AngleUnitType::Deg; break;
+            case OpCode::Rad: AngleUnit = AngleUnitType::Rad; break;
+            case OpCode::Grad: AngleUnit = AngleUnitType::Grad; break;
+            case OpCode::ToDeg:
+            case OpCode::ToRad:
+            case OpCode::ToGrad:
             {
-                ErrorMessage = "Not enough values on the stack";
-                return;
+                if (!_stackInput())
+                    return;
+                if (Stack.empty())
+                {
+                    ErrorMessage = "Not enough values on the stack";
+                    return;
+                }
+                if (Stack.is_vector((int)Stack.size() - 1))
+                {
+                    _onVectorOperator(op);
+                    return;
+                }
+                Stack.store_undo();
+                double a = Stack.back();
+                Stack.pop_back();
+                if (op == OpCode::ToDeg)
+                    Stack.push_back(FromRadian<AngleUnitType::Deg>(ToRadian(a, AngleUnit)));
+                else if (op == OpCode::ToRad)
+                    Stack.push_back(ToRadian(a, AngleUnit));
+                else
+                    Stack.push_back(FromRadian<AngleUnitType::Grad>(ToRadian(a, AngleUnit)));
+                break;
             }
-            Stack.store_undo();
-            double a = Stack.back();
-            Stack.pop_back();
-            if (cmd == "To Deg")
-                Stack.push_back(_toRadian(a) * 180. / 3.1415926535897932384626433832795);
-            else if (cmd == "To Rad")
-                Stack.push_back(_toRadian(a));
-            else if (cmd == "To Grad")
-                Stack.push_back(_toRadian(a) * 200. / 3.1415926535897932384626433832795);
+            default:
+                break;
         }
     }
 
@@ -390,7 +1079,7 @@ namespace RpnCalculator
     void CalculatorState::_onComputerKeyMinus()
     {
         if (Input.empty())
-            _onBinaryOperator("-");
+            _onBinaryOperator(OpCode::Subtract);
         else
             _onPlusMinus();
     }
@@ -398,25 +1087,25 @@ namespace RpnCalculator
     void CalculatorState::OnComputerKey(char key)
     {
         if (key >= '0' && key <= '9')
-            _onDigit(std::string(1, key));
+            _onDigit((OpCode)((int)OpCode::Digit0 + (key - '0')));
         if (key == 'E' || key == 'e')
-            _onDigit("E");
+            _onDigit(OpCode::Exponent);
         else if (key == '.')
-            _onDigit(".");
+            _onDigit(OpCode::Dot);
         else if (key == '+')
-            _onBinaryOperator("+");
+            _onBinaryOperator(OpCode::Add);
         else if (key == '-')
             _onComputerKeyMinus();
         else if (key == '*')
-            _onBinaryOperator("*");
+            _onBinaryOperator(OpCode::Multiply);
         else if (key == '/')
-            _onBinaryOperator("/");
+            _onBinaryOperator(OpCode::Divide);
         else if (key == '\n' || key == '\r')
             _onEnter();
         else if (key == '\b') // backspace: remove from input or stack
         {
             if (!Input.empty())
-                Input.pop_back(); // Remove last input character
+                _onBackspace();
             else
             {
                 if (Stack.empty())
@@ -440,6 +1129,11 @@ namespace RpnCalculator
                 ErrorMessage = "Not enough values on the stack";
                 return;
             }
+            if (Stack.is_vector((int)Stack.size() - 1))
+            {
+                _onVectorOperator(OpCode::PlusMinus);
+                return;
+            }
             Stack.store_undo();
             double a = Stack.back();
             Stack.pop_back();
@@ -451,41 +1145,139 @@ namespace RpnCalculator
                 Input = Input.substr(1);
             else
                 Input = "-" + Input;
+            _onInputEdited();
         }
     }
 
-    void CalculatorState::_onDigit(const std::string& digit)
+    void CalculatorState::_onDigit(OpCode op)
     {
-        if (digit == "+/-")
+        if (op == OpCode::PlusMinus)
             _onPlusMinus();
+        else if (op == OpCode::Dot)
+            _appendInput(".");
+        else if (op == OpCode::Exponent)
+            _appendInput("E");
         else
-            Input += digit;
+        {
+            char digit = (char)('0' + ((int)op - (int)OpCode::Digit0));
+            _appendInput(std::string_view(&digit, 1));
+        }
     }
 
     void CalculatorState::OnCalculatorButton(const CalculatorButton& button)
+    {
+        OnOpCode(button.Op);
+    }
+
+    void CalculatorState::OnOpCode(OpCode op)
+    {
+        ErrorMessage = "";
+
+        switch (op)
+        {
+            case OpCode::Digit0: case OpCode::Digit1: case OpCode::Digit2: case OpCode::Digit3:
+            case OpCode::Digit4: case OpCode::Digit5: case OpCode::Digit6: case OpCode::Digit7:
+            case OpCode::Digit8: case OpCode::Digit9:
+            case OpCode::Dot: case OpCode::Exponent: case OpCode::PlusMinus:
+                _onDigit(op); break;
+
+            case OpCode::Pi: case OpCode::Euler:
+                _onDirectNumber(op); break;
+
+            case OpCode::Backspace:
+                _onBackspace(); break;
+
+            case OpCode::Add: case OpCode::Subtract: case OpCode::Multiply: case OpCode::Divide:
+            case OpCode::Power:
+                _onBinaryOperator(op); break;
+
+            case OpCode::Sin: case OpCode::Cos: case OpCode::Tan:
+            case OpCode::ArcSin: case OpCode::ArcCos: case OpCode::ArcTan:
+            case OpCode::Reciprocal: case OpCode::Log10: case OpCode::Ln: case OpCode::Pow10:
+            case OpCode::Exp: case OpCode::Sqrt: case OpCode::Square: case OpCode::Floor:
+                _onUnaryOperator(op); break;
+
+            case OpCode::Swap: case OpCode::Dup: case OpCode::Drop: case OpCode::Clear:
+            case OpCode::Undo: case OpCode::Redo: case OpCode::Sto: case OpCode::Recall: case OpCode::Roll:
+                _onStackOperator(op); break;
+
+            case OpCode::Sum: case OpCode::Product: case OpCode::Mean: case OpCode::Variance:
+            case OpCode::StdDev: case OpCode::Min: case OpCode::Max:
+                _onReduction(op); break;
+
+            case OpCode::Inv:
+                _onInverse(); break;
+
+            case OpCode::Deg: case OpCode::Rad: case OpCode::Grad:
+            case OpCode::ToDeg: case OpCode::ToRad: case OpCode::ToGrad:
+                _onDegRadGrad(op); break;
+
+            case OpCode::Enter:
+                _onEnter(); break;
+
+            case OpCode::ScientificMode:
+                ScientificMode = !ScientificMode; break;
+
+            case OpCode::None:
+            case OpCode::Count:
+                break;
+        }
+    }
+
+    void CalculatorState::PushVector(std::vector<double> values)
     {
         ErrorMessage = "";
+        if (!_stackInput())
+            return;
+        Stack.store_undo();
+        Stack.push_back(StackValue{0., std::make_shared<const std::vector<double>>(std::move(values))});
+    }
+
+    void CalculatorState::OnPaste(std::string_view text)
+    {
+        ErrorMessage = "";
+        std::vector<double> values;
+        if (!ParseNumberList(text, values) || values.empty())
+        {
+            ErrorMessage = "Invalid pasted text";
+            return;
+        }
+        if (values.size() > 1)
+        {
+            PushVector(std::move(values));
+            return;
+        }
+        if (!_stackInput())
+            return;
+        Stack.store_undo();
+        Stack.push_back(values[0]);
+    }
+
+    bool CalculatorState::OnRpnToken(const std::string& token)
+    {
+        if (token.empty())
+            return true;
 
-        if (button.Type == ButtonType::Digit)
-            _onDigit(button.Label);
-        else if (button.Type == ButtonType::Backspace)
-            _onBackspace();
-        else if (button.Type == ButtonType::DirectNumber)
-            _onDirectNumber(button.Label);
-        else if (button.Type == ButtonType::Enter)
+        // Numbers are entered as if typed, then followed by Enter
+        if (IsNumberToken(token))
+        {
+            ErrorMessage = "";
+            Input = token;
+            _onInputEdited();
             _onEnter();
-        else if (button.Type == ButtonType::StackOperator)
-            _onStackOperator(button.Label);
-        else if (button.Type == ButtonType::BinaryOperator)
-            _onBinaryOperator(button.Label);
-        else if (button.Type == ButtonType::UnaryOperator)
-            _onUnaryOperator(button.Label);
-        else if (button.Type == ButtonType::DegRadGrad)
-            _onDegRadGrad(button.Label);
-        else if (button.Type == ButtonType::Inv)
-            _onInverse();
-        else if (button.Type == ButtonType::ScientificMode)
-            ScientificMode = !ScientificMode;
+            return true;
+        }
+
+        OpCode op = OpCodeFromLabel(token);
+        if (op == OpCode::None)
+        {
+            ErrorMessage = "Unknown token: " + token;
+            return false;
+        }
+        OnOpCode(op);
+        if (op == OpCode::Pi || op == OpCode::Euler)
+            _onEnter(); // "Pi" is a number by itself
+        return true;
     }
 
     // Serialization
@@ -509,6 +1301,7 @@ namespace RpnCalculator
         {
             Stack.from_json(j["Stack"]);
             Input = j["Input"].get<std::string>();
+            _onInputEdited();
             ErrorMessage = j["ErrorMessage"].get<std::string>();
             InverseMode = j["InverseMode"].get<bool>();
             AngleUnit = j["AngleUnit"].get<AngleUnitType>();
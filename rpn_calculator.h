@@ -1,10 +1,15 @@
 #pragma once
 #include <string>
+#include <string_view>
+#include <cstdint>
 #include <deque>
-#include <stack>
+#include <memory>
 #include <sstream>
 #include <optional>
+#include <type_traits>
+#include <vector>
 #include "nlohmann_json.hpp"
+#include "rpn_inline_ring.h"
 
 
 
@@ -20,6 +25,7 @@ namespace RpnCalculator
         BinaryOperator,   // +, -, *
         UnaryOperator,    // sin, cos, tan, log, ln, sqrt, x^2, floor
         StackOperator,    // Swap, Dup, Drop, Clear
+        Reduction,        // Sum, Mean, Var, Min, Max (of the stack, or of a vector)
 
         Inv,            // Inverse
         DegRadGrad,     // Degree, Radian, Gradian
@@ -29,11 +35,72 @@ namespace RpnCalculator
     };
 
 
+    // The operation performed by a button.
+    // It is resolved once from the label when the layout is built: labels are only used for display.
+    enum class OpCode
+    {
+        None,
+
+        // Digit
+        Digit0, Digit1, Digit2, Digit3, Digit4, Digit5, Digit6, Digit7, Digit8, Digit9,
+        Dot, Exponent, PlusMinus,
+        // DirectNumber
+        Pi, Euler,
+        // Backspace
+        Backspace,
+
+        // BinaryOperator
+        Add, Subtract, Multiply, Divide, Power,
+        // UnaryOperator
+        Sin, Cos, Tan, ArcSin, ArcCos, ArcTan,
+        Reciprocal, Log10, Ln, Pow10, Exp, Sqrt, Square, Floor,
+        // StackOperator
+        Swap, Dup, Drop, Clear, Undo, Redo, Sto, Recall, Roll,
+        // Reduction
+        Sum, Product, Mean, Variance, StdDev, Min, Max,
+
+        // Inv
+        Inv,
+        // DegRadGrad
+        Deg, Rad, Grad, ToDeg, ToRad, ToGrad,
+        // Enter
+        Enter,
+        // ScientificMode
+        ScientificMode,
+
+        Count
+    };
+    // Label of each OpCode (constexpr: also used to compile programs at compile time, see rpn_static.h)
+    inline constexpr const char* gOpCodeLabels[] = {
+        "",
+        "0", "1", "2", "3", "4", "5", "6", "7", "8", "9",
+        ".", "E", "+/-",
+        "Pi", "e",
+        "<=",
+        "+", "-", "*", "/", "y^x",
+        "sin", "cos", "tan", "sin^-1", "cos^-1", "tan^-1",
+        "1/x", "log", "ln", "10^x", "e^x", "sqrt", "x^2", "floor",
+        "Swap", "Dup", "Drop", "Clear", "Undo", "Redo", "Sto", "Recall", "Roll",
+        "Sum", "Prod", "Mean", "Var", "Std", "Min", "Max",
+        "Inv",
+        "Deg", "Rad", "Grad", "To Deg", "To Rad", "To Grad",
+        "Enter",
+        "Sci",
+    };
+    static_assert(sizeof(gOpCodeLabels) / sizeof(gOpCodeLabels[0]) == (size_t)OpCode::Count,
+                  "gOpCodeLabels must have one label per OpCode");
+
+    // Returns OpCode::None if the label is unknown. Spaces inside labels may be written as '_' (e.g. "To_Deg")
+    OpCode OpCodeFromLabel(std::string_view label);
+    const char* OpCodeLabel(OpCode op);
+
+
     struct CalculatorButton
     {
         std::string Label;
         ButtonType  Type = ButtonType::Digit;
         bool        IsDoubleWidth = false;
+        OpCode      Op = OpCode::None;
     };
 
 
@@ -93,26 +160,170 @@ namespace RpnCalculator
     };
 
 
+    // Formats a value with nbDecimals significant digits, exactly like printf("%.*G"), but faster
+    void FormatDisplayedValue(double v, int nbDecimals, char* text, size_t textSize);
+
+
+    // A dense vector of values, held by a single stack entry (e.g. a column loaded from a file, see
+    // CalculatorState::PushVector). Vectors are immutable once pushed: Dup, the undo log and the copies of the stack
+    // share them.
+    using StackVector = std::shared_ptr<const std::vector<double>>;
+
+    // A stack entry: a number, or a vector
+    struct StackValue
+    {
+        double      Scalar = 0.;
+        StackVector Vector;     // nullptr for a number
+
+        bool is_vector() const { return Vector != nullptr; }
+    };
+
+
+    // An elementary change made to the stack, as recorded in the undo log
+    struct UndoEntry
+    {
+        // PopAll: a stack of numbers was emptied at once (see CalculatorStack::pop_all)
+        enum class Kind : uint8_t { PushBack, PopBack, PushFront, PopAll };
+        double Value = 0.;
+        Kind   Change = Kind::PushBack;
+        bool   IsStepStart = false;  // first change of an operation
+        StackVector Vector;          // the vector pushed or popped, if any; for PopAll, the numbers removed
+    };
+
+
     struct CalculatorStack
     {
-        std::deque<double> Stack;
-        std::stack<std::deque<double>> _undoStack;
+        // Usual stacks fit in the inline storage, deeper stacks spill to the heap
+        InlineRing<double, 32> Stack;
 
         size_t size() const { return Stack.size(); }
         bool empty() const { return Stack.empty(); }
         double back() const { return Stack.back();}
-        double operator[](int index) const { return Stack[index]; }
-        void push_back(double v) { Stack.push_back(v); }
-        void push_front(double v) { Stack.push_front(v); }
-        void pop_back() { Stack.pop_back(); }
-        void clear() { Stack.clear(); }
-
-        void undo() { if (!_undoStack.empty()) { Stack = _undoStack.top(); _undoStack.pop(); } }
-        void store_undo() {_undoStack.push(Stack); }
-
-        // Serialization
-        nlohmann::json to_json() const {  nlohmann::json j; j["Stack"] = Stack; return j; }
-        void from_json(const nlohmann::json& j) { Stack = j["Stack"].get<std::deque<double>>(); }
+        double operator[](int index) const { return Stack[(size_t)index]; }
+        void push_back(double v)
+        {
+            Stack.push_back(v);
+            if (_nbVectors > 0)
+                _vectors.push_back(nullptr);
+            _logUndo(UndoEntry::Kind::PushBack, v);
+        }
+        void push_front(double v) { push_front(StackValue{v, nullptr}); }
+        void pop_back()
+        {
+            if (_nbVectors > 0)
+                _popBackLogged();
+            else
+            {
+                _logUndo(UndoEntry::Kind::PopBack, Stack.back());
+                Stack.pop_back();
+            }
+        }
+        // While the stack holds only numbers, clear() is logged as a single change (see pop_all)
+        void clear();
+        // The numbers of the stack, bottom first. The stack must hold no vector
+        StackVector numbers() const;
+        // Empties a stack of numbers, where numbers is the result of numbers(): the undo log keeps it, as a single
+        // change, instead of one change per value (e.g. Clear or Sum on a stack of a million values)
+        void pop_all(const StackVector& numbers);
+        // Replaces the whole content of the stack (with numbers), and forgets the undo history
+        void assign(const double* first, const double* last);
+
+        // Vectors
+        // The slot of a vector in Stack holds NaN: code which reads the values as numbers (e.g. VirtualMachine) must
+        // check has_vectors() first. _vectors follows Stack (one entry per slot, nullptr for numbers) only while the
+        // stack holds vectors, so that stacks of numbers pay one test per push for them.
+        bool has_vectors() const { return _nbVectors > 0; }
+        bool is_vector(int index) const { return _nbVectors > 0 && _vectors[(size_t)index] != nullptr; }
+        StackValue value(int index) const;
+        StackValue back_value() const { return value((int)Stack.size() - 1); }
+        void push_back(const StackValue& v);
+        void push_front(const StackValue& v);
+
+        // Undo / Redo
+        // Each operation (started by store_undo) records only the elementary changes it made, so that
+        // storing an undo step costs O(1) instead of a copy of the whole stack.
+        // The changes are stored in a ring buffer that is allocated once: when it is full,
+        // the oldest operations are evicted. An operation which makes more changes than the ring holds cannot be
+        // undone: the whole history is then forgotten (a partial operation is never kept).
+        void store_undo() { _isStepStartPending = true; _isStepDiscarded = false; }
+        void undo();
+        void redo();
+        bool can_undo() const { return _undoCursor != _undoBegin; }
+        bool can_redo() const { return _undoCursor != _undoEnd; }
+        // Sets the size of the undo ring buffer, and forgets the undo history
+        void set_undo_memory_budget(size_t nbBytes);
+        size_t undo_memory_budget() const { return _undoCapacity * sizeof(UndoEntry); }
+        // The vectors kept alive by the undo log (e.g. the operand of "sin" on a vector) are not in the ring buffer:
+        // when they use more than this budget, the oldest operations are evicted (when the next operation starts)
+        void set_undo_vector_memory_budget(size_t nbBytes) { _undoVectorBudget = nbBytes; }
+        size_t undo_vector_memory_budget() const { return _undoVectorBudget; }
+
+        // Text of a stack value, as displayed with nbDecimals significant digits (see FormatDisplayedValue).
+        // It is cached for each slot (counted from the top of the stack, so that only the displayed slots are cached),
+        // and computed again only when the slot value or nbDecimals changes.
+        const char* display_string(int index, int nbDecimals) const;
+
+        // Serialization (vectors are saved as arrays of values; the undo log is not saved when it holds vectors, but
+        // the numbers kept by pop_all are saved with it)
+        nlohmann::json to_json() const;
+        void from_json(const nlohmann::json& j);
+
+    private:
+        struct DisplayCacheEntry
+        {
+            double Value = 0.;
+            bool   IsVector = false;
+            std::weak_ptr<const std::vector<double>> Vector;
+            int    NbDecimals = -1;
+            char   Text[64] = "";
+        };
+        mutable std::vector<DisplayCacheEntry> _displayCache;
+
+        void _logUndo(UndoEntry::Kind change, double value)
+        {
+            if (_isStepDiscarded)
+                return;
+            if (_undoRing.empty())
+                _undoRing.resize(_undoCapacity); // allocated once, on first use
+            else if (_undoCursor - _undoBegin == _undoCapacity && !_makeRoomForUndoEntry())
+                return;
+            if (_undoVectorMemory > 0)
+                _trimUndoVectors();
+            UndoEntry& entry = _undoRing[_undoCursor & (_undoCapacity - 1)];
+            entry.Value = value;
+            entry.Change = change;
+            entry.IsStepStart = _isStepStartPending;
+            _isStepStartPending = false;
+            ++_undoCursor;
+            _undoEnd = _undoCursor; // a new change forgets the redo history
+        }
+        void _logUndoVector(UndoEntry::Kind change, const StackVector& vector);
+        void _popBackLogged(); // pop_back, while the stack holds vectors
+        void _trimUndoVectors();
+        void _evictOldestUndoStep();
+        bool _makeRoomForUndoEntry(); // makes room for a change of the current operation: false if it is discarded
+        void _clearUndoHistory();
+        bool _isUndoLogConsistent() const;
+
+        // Changes of the stack, without undo log
+        void _pushBack(const StackValue& v);
+        void _pushFront(const StackValue& v);
+        void _popBack();
+        void _popFront();
+
+        // The undo log occupies positions [_undoBegin, _undoCursor) of the ring,
+        // and the redo log occupies positions [_undoCursor, _undoEnd) (positions are taken modulo _undoCapacity)
+        std::vector<UndoEntry> _undoRing;
+        size_t _undoCapacity = 131072; // power of two: 4MB
+        uint64_t _undoBegin = 0, _undoCursor = 0, _undoEnd = 0;
+        bool _isStepStartPending = false;
+        bool _isStepDiscarded = false; // the current operation outgrew the ring: its changes are not logged
+        // Memory of the vectors held by the entries [_undoBegin, _undoEnd) of the ring
+        size_t _undoVectorMemory = 0;
+        size_t _undoVectorBudget = (size_t)1 << 30;
+
+        std::deque<StackVector> _vectors;
+        size_t _nbVectors = 0;
     };
 
 
@@ -122,6 +333,221 @@ namespace RpnCalculator
     };
     std::string to_string(AngleUnitType t);
 
+    // Angle conversions specialized on the angle unit: the conversion constants are compile time constants, and the
+    // unit is not tested. The formulas keep two operations (v * pi / 180) rather than a single factor
+    // (v * (pi / 180)), which rounds differently: all the evaluation paths give the same results as CalculatorState.
+    template<AngleUnitType Unit>
+    constexpr double ToRadian(double v)
+    {
+        if constexpr (Unit == AngleUnitType::Deg)
+            return v * 3.1415926535897932384626433832795 / 180.;
+        else if constexpr (Unit == AngleUnitType::Grad)
+            return v * 3.1415926535897932384626433832795 / 200.;
+        else
+            return v;
+    }
+    template<AngleUnitType Unit>
+    constexpr double FromRadian(double radian)
+    {
+        if constexpr (Unit == AngleUnitType::Deg)
+            return radian * 180. / 3.1415926535897932384626433832795;
+        else if constexpr (Unit == AngleUnitType::Grad)
+            return radian * 200. / 3.1415926535897932384626433832795;
+        else
+            return radian;
+    }
+
+    // Calls f(std::integral_constant<AngleUnitType, unit>()): the unit is tested once, and f can be specialized on it
+    // (e.g. once per program or per block of rows, rather than once per value)
+    template<typename F>
+    decltype(auto) WithAngleUnit(AngleUnitType angleUnit, F&& f)
+    {
+        switch (angleUnit)
+        {
+            case AngleUnitType::Rad: return f(std::integral_constant<AngleUnitType, AngleUnitType::Rad>());
+            case AngleUnitType::Grad: return f(std::integral_constant<AngleUnitType, AngleUnitType::Grad>());
+            default: return f(std::integral_constant<AngleUnitType, AngleUnitType::Deg>());
+        }
+    }
+
+    // Runtime angle unit (CalculatorState, where each key tests it anyway)
+    inline double ToRadian(double v, AngleUnitType angleUnit)
+    {
+        return WithAngleUnit(angleUnit, [v](auto unit) { return ToRadian<decltype(unit)::value>(v); });
+    }
+    inline double FromRadian(double radian, AngleUnitType angleUnit)
+    {
+        return WithAngleUnit(angleUnit, [radian](auto unit) { return FromRadian<decltype(unit)::value>(radian); });
+    }
+
+    // Parses a number as typed by the user (e.g. "-1.5E3"). Returns std::nullopt if invalid.
+    // Accepts the same numbers as `std::istringstream >> double`, but does not allocate.
+    std::optional<double> ParseNumber(std::string_view s);
+    // Parses a list of numbers separated by white spaces, ',' or ';' (e.g. a column copied from a spreadsheet).
+    // Returns false if one of them is invalid.
+    bool ParseNumberList(std::string_view s, std::vector<double>& values);
+    // Returns true if a token of an RPN program should be read as a number (e.g. "3", ".5", "-2", but not "1/x")
+    // (constexpr: also used to compile programs at compile time, see rpn_static.h)
+    constexpr bool IsNumberToken(std::string_view token)
+    {
+        if (token.empty())
+            return false;
+        char first = token[0];
+        char second = token.size() > 1 ? token[1] : '\0';
+        bool isDigitOrDot = (first >= '0' && first <= '9') || first == '.';
+        bool isSignedNumber = (first == '-' || first == '+') && ((second >= '0' && second <= '9') || second == '.');
+        if (!(isDigitOrDot || isSignedNumber))
+            return false;
+        // Labels such as "1/x" or "10^x" also start with a digit
+        for (char c: token)
+        {
+            bool isNumberChar = (c >= '0' && c <= '9') || c == '.' || c == 'E' || c == 'e' || c == '+' || c == '-';
+            if (!isNumberChar)
+                return false;
+        }
+        return true;
+    }
+
+
+    // Incremental parse of the number being typed (CalculatorState::Input): it is updated on each key,
+    // so that invalid input is detected immediately, and so that Enter does not need to parse the whole input.
+    // Accepts the same numbers as ParseNumber: [+|-] digits [. digits] [E [+|-] digits]
+    class NumberInputParser
+    {
+    public:
+        enum class Status { Empty, Incomplete, Valid, Invalid };
+
+        void reset() { *this = NumberInputParser(); }
+        void parse(std::string_view input) { reset(); for (char c: input) push(c); }
+        constexpr void push(char c);
+
+        constexpr Status status() const;
+        size_t length() const { return _length; }
+        // The value of a Valid input, when it can be computed exactly from the parsed mantissa and exponent
+        // (i.e. up to 15 significant digits and a small exponent). Otherwise, returns std::nullopt:
+        // use ParseNumber instead.
+        // (constexpr: also used to compile programs at compile time, see rpn_static.h)
+        constexpr std::optional<double> fast_value() const;
+
+    private:
+        static constexpr double _exactPowersOf10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        size_t   _length = 0;
+        bool     _isInvalid = false;
+        bool     _isNegative = false;
+        uint64_t _mantissa = 0;
+        int      _nbMantissaDigits = 0;     // significant digits stored in _mantissa
+        bool     _hasMantissaDigits = false;
+        bool     _isMantissaTruncated = false;
+        int      _mantissaExponent = 0;     // power of 10 to apply to _mantissa (digits after the dot, or dropped digits)
+        bool     _hasDot = false;
+        bool     _hasExponent = false;
+        bool     _hasExponentSign = false;
+        bool     _isExponentNegative = false;
+        int      _exponent = 0;
+        int      _nbExponentDigits = 0;
+    };
+
+    constexpr void NumberInputParser::push(char c)
+    {
+        bool isFirstChar = (_length == 0);
+        ++_length;
+        if (_isInvalid)
+            return;
+
+        if (c >= '0' && c <= '9')
+        {
+            int digit = c - '0';
+            if (_hasExponent)
+            {
+                if (_exponent < 100000)
+                    _exponent = _exponent * 10 + digit;
+                ++_nbExponentDigits;
+                return;
+            }
+            _hasMantissaDigits = true;
+            if (_mantissa == 0 && digit == 0)
+            {
+                // leading zero
+                if (_hasDot)
+                    --_mantissaExponent;
+            }
+            else if (_nbMantissaDigits < 19)
+            {
+                _mantissa = _mantissa * 10 + (uint64_t)digit;
+                ++_nbMantissaDigits;
+                if (_hasDot)
+                    --_mantissaExponent;
+            }
+            else
+            {
+                // the digit does not fit in _mantissa
+                if (digit != 0)
+                    _isMantissaTruncated = true;
+                if (!_hasDot)
+                    ++_mantissaExponent;
+            }
+        }
+        else if (c == '.')
+        {
+            if (_hasDot || _hasExponent)
+                _isInvalid = true;
+            _hasDot = true;
+        }
+        else if (c == 'E' || c == 'e')
+        {
+            if (_hasExponent || !_hasMantissaDigits)
+                _isInvalid = true;
+            _hasExponent = true;
+        }
+        else if (c == '-' || c == '+')
+        {
+            if (isFirstChar)
+                _isNegative = (c == '-');
+            else if (_hasExponent && !_hasExponentSign && _nbExponentDigits == 0)
+            {
+                _hasExponentSign = true;
+                _isExponentNegative = (c == '-');
+            }
+            else
+                _isInvalid = true;
+        }
+        else
+            _isInvalid = true;
+    }
+
+    constexpr NumberInputParser::Status NumberInputParser::status() const
+    {
+        if (_length == 0)
+            return Status::Empty;
+        if (_isInvalid)
+            return Status::Invalid;
+        if (_hasMantissaDigits && (!_hasExponent || _nbExponentDigits > 0))
+            return Status::Valid;
+        return Status::Incomplete;
+    }
+
+    constexpr std::optional<double> NumberInputParser::fast_value() const
+    {
+        // When the mantissa and the power of 10 are both exactly representable as doubles,
+        // a single multiplication or division gives the correctly rounded result (same as from_chars)
+        if (status() != Status::Valid || _isMantissaTruncated || _mantissa > (1ull << 53))
+            return std::nullopt;
+        int exponent = _mantissaExponent + (_isExponentNegative ? -_exponent : _exponent);
+        if (exponent < -22 || exponent > 22)
+            return std::nullopt;
+
+        double v = (double)_mantissa;
+        if (exponent >= 0)
+            v = v * _exactPowersOf10[exponent];
+        else
+            v = v / _exactPowersOf10[-exponent];
+        return _isNegative ? -v : v;
+    }
+
 
     class CalculatorState
     {
@@ -140,31 +566,45 @@ namespace RpnCalculator
 
         // callbacks for the UI
         void OnCalculatorButton(const CalculatorButton& button);
+        // same as OnCalculatorButton, for a button that is identified by its OpCode
+        void OnOpCode(OpCode op);
         // callbacks for the computer keyboard (transmit \b for backspace)
         void OnComputerKey(char key);
+        // callbacks for textual RPN programs: a token is either a number or an OpCode label (e.g. "3.5", "sin", "Swap")
+        // returns false if the token is unknown
+        bool OnRpnToken(const std::string& token);
+        // Pushes a vector (e.g. values loaded from a file): the operators then apply to each of its values
+        // (see rpn_vector.h)
+        void PushVector(std::vector<double> values);
+        // Pastes a list of numbers (see ParseNumberList): a single number is pushed as a number, several as a vector
+        void OnPaste(std::string_view text);
 
         // serialization
         nlohmann::json to_json() const;
         void from_json(const nlohmann::json& j);
 
     private:
+        NumberInputParser _inputParser; // follows Input
+
+        // private input helpers
+        void _appendInput(std::string_view chars);
+        void _onInputEdited(); // call after any modification of Input, except _appendInput
+
         // private callback helpers
         bool _stackInput();
-        void _onDigit(const std::string& digit);
-        void _onBinaryOperator(const std::string& cmd); // cmd is +, -, *, /, y^x
+        void _onDigit(OpCode op);
+        void _onBinaryOperator(OpCode op); // op is +, -, *, /, y^x
         void _onComputerKeyMinus(); // if Input is not empty, add/remove a minus sign, else call the "-" operator
         void _onBackspace();
         void _onEnter();
-        void _onDirectNumber(const std::string& label);
-        void _onStackOperator(const std::string& cmd);
-        void _onUnaryOperator(const std::string& cmd);
-        void _onDegRadGrad(const std::string& cmd);
+        void _onDirectNumber(OpCode op);
+        void _onStackOperator(OpCode op);
+        void _onUnaryOperator(OpCode op);
+        void _onVectorOperator(OpCode op); // an operator applied to a vector
+        void _onReduction(OpCode op);
+        void _onDegRadGrad(OpCode op);
         void _onInverse();
         void _onPlusMinus();
-
-        // private angle helpers
-        double _toRadian(double v) const;
-        double _toCurrentAngleUnit(double radian) const;
     };
 
 }
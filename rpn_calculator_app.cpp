@@ -29,6 +29,7 @@ std::map<ButtonType, ImVec4> ButtonColors = {
     { ButtonType::BinaryOperator, { 0.2f, 0.2f, 0.8f, 1.0f } },
     { ButtonType::UnaryOperator, { 0.4f, 0.4f, 0.8f, 1.0f } },
     { ButtonType::StackOperator, { 0.4f, 0.3f, 0.3f, 1.0f } },
+    { ButtonType::Reduction, { 0.3f, 0.4f, 0.5f, 1.0f } },
     { ButtonType::Inv, { 0.8f, 0.6f, 0.0f, 1.0f } },
     { ButtonType::ScientificMode, { 0.8f, 0.6f, 0.0f, 1.0f } },
     { ButtonType::DegRadGrad, { 0.6f, 0.6f, 0.0f, 1.0f } },
@@ -300,10 +301,9 @@ void GuiDisplay(AppState& appState)
         {
             ImGui::Text("%i:", nbViewableStackLines - i);
             // Display the stack value at the right of the screen
-            // Convert value to string with a fixed number of decimals
+            // Convert value to string with a fixed number of decimals (cached by the stack)
             int nbDecimals = calculatorState.LayoutDefinition.NbDecimals;
-            char valueAsString[64];
-            snprintf(valueAsString, 64, "%.*G", nbDecimals, calculatorState.Stack[stackIndex]);
+            const char* valueAsString = calculatorState.Stack.display_string(stackIndex, nbDecimals);
             ImVec2 textSize = ImGui::CalcTextSize(valueAsString);
             ImGui::SameLine(ImGui::GetWindowWidth() - textSize.x);
             ImGui::Text("%s", valueAsString);
@@ -347,6 +347,13 @@ void HandleComputerKeyboard(CalculatorState& calculatorState)
         calculatorState.OnComputerKey('\b');
     if (ImGui::IsKeyPressed(ImGuiKey_Enter) || ImGui::IsKeyPressed(ImGuiKey_KeypadEnter))
         calculatorState.OnComputerKey('\n');
+    // Ctrl+V (Cmd+V on macOS): paste a number, or a list of numbers as a vector (e.g. a column of a spreadsheet)
+    if ((io.KeyCtrl || io.KeySuper) && ImGui::IsKeyPressed(ImGuiKey_V))
+    {
+        const char* text = ImGui::GetClipboardText();
+        if (text != nullptr)
+            calculatorState.OnPaste(text);
+    }
 }
 
 
@@ -0,0 +1,793 @@
+// A command line front-end for the RPN calculator engine (no GUI dependency)
+//
+// Usage:
+//     rpn_cli 3 4 + 2 '*'         evaluate the tokens given on the command line
+//     echo "3 4 + 2 *" | rpn_cli  evaluate the tokens read from stdin
+//     rpn_cli --lines [FILE]      evaluate each line of FILE (or stdin) as an independent expression
+//             [--threads N]       number of threads (default: one per hardware thread)
+//             [--output OUT]      write the results to OUT instead of stdout
+//             [--io-uring]        read and write through io_uring (Linux), overlapping the I/O with the evaluation
+//     rpn_cli --program "x 1.8 * 32 +" --in IN --out OUT [--threads N] [--jit]
+//                                 evaluate a program over each value of a binary column file (see rpn_column.h);
+//                                 IN / OUT may be "-" for stdin / stdout (OUT is replaced only if the evaluation
+//                                 succeeds, and may not be IN). With --jit, the program is compiled to native code
+//                                 when possible (see rpn_jit.h)
+//     rpn_cli --verify [FILE]     differential test of the compiled programs (each line of FILE or stdin), with and
+//                                 without the peephole optimizer, and of their native code, against CalculatorState;
+//                                 then checks the limits of the undo log
+//     rpn_cli --verify --random N the same, on N random programs
+//     rpn_cli --profile [FILE]    the most frequent pairs of instructions in the programs of FILE (or stdin)
+//
+// Tokens are either numbers, or calculator button labels (e.g. "sin", "Swap", "y^x"), or @FILE, which pushes the
+// values of a column file as a vector (the operators then apply to each of its values, see rpn_vector.h).
+// The final stack is printed on stdout, one value per line (top of the stack last); vectors are printed as their
+// size and first values.
+// With --lines, one result line is printed per input line (see LineEvaluator), for use in pipelines.
+#include "rpn_calculator.h"
+#include "rpn_async_io.h"
+#include "rpn_batch.h"
+#include "rpn_column.h"
+#include "rpn_jit.h"
+#include "rpn_optimizer.h"
+#include "rpn_stream.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define RPN_CLI_HAS_POSIX_IO
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+using namespace RpnCalculator;
+
+
+bool EvaluateToken(CalculatorState& calculatorState, const std::string& token)
+{
+    if (token.size() > 1 && token[0] == '@')
+    {
+        const char* path = token.c_str() + 1;
+        ColumnReader reader;
+        if (!reader.Open(path))
+        {
+            fprintf(stderr, "rpn_cli: %s: %s\n", path, reader.ErrorMessage.c_str());
+            return false;
+        }
+        calculatorState.PushVector(std::vector<double>(reader.values(), reader.values() + reader.size()));
+        return true;
+    }
+
+    bool success = calculatorState.OnRpnToken(token);
+    if (!calculatorState.ErrorMessage.empty())
+    {
+        fprintf(stderr, "rpn_cli: %s (token \"%s\")\n", calculatorState.ErrorMessage.c_str(), token.c_str());
+        success = false;
+    }
+    return success;
+}
+
+
+void PrintStack(const CalculatorState& calculatorState)
+{
+    int nbDecimals = calculatorState.LayoutDefinition.NbDecimals;
+    char valueAsString[64];
+    for (size_t i = 0; i < calculatorState.Stack.size(); ++i)
+    {
+        if (calculatorState.Stack.is_vector((int)i))
+        {
+            printf("%s\n", calculatorState.Stack.display_string((int)i, nbDecimals));
+            continue;
+        }
+        FormatDisplayedValue(calculatorState.Stack[(int)i], nbDecimals, valueAsString, sizeof(valueAsString));
+        printf("%s\n", valueAsString);
+    }
+}
+
+
+// Size of the reads and writes of the --lines mode
+static const size_t kStreamBufferSize = 1 << 20;
+
+
+bool WriteOutput(const std::string& output, FILE* outputFile)
+{
+    return fwrite(output.data(), 1, output.size(), outputFile) == output.size();
+}
+
+
+struct LinesOptions
+{
+    const char* InputPath = nullptr;   // nullptr: stdin
+    const char* OutputPath = nullptr;  // nullptr: stdout
+    size_t NbThreads = 0;
+    bool UseIoUring = false;
+};
+
+
+// --lines mode, for a regular file: the file is mapped in memory, and its lines are evaluated in place by all the threads
+int EvaluateMappedLines(const MappedFile& mappedFile, const LinesOptions& options, FILE* outputFile)
+{
+    ThreadPool threadPool(options.NbThreads);
+    ParallelLineEvaluator lineEvaluator;
+    bool success = lineEvaluator.EvaluateLines(
+        mappedFile.data(), mappedFile.data() + mappedFile.size(), threadPool,
+        [outputFile](const std::string& output) { return WriteOutput(output, outputFile); });
+    if (fflush(outputFile) != 0)
+        success = false;
+    return (success && lineEvaluator.NbErrors == 0) ? 0 : 1;
+}
+
+
+// --lines --io-uring mode: AsyncFileIo keeps reads ahead and writes in flight, while the threads evaluate the
+// complete lines of each block in place. A line which spans two blocks is joined in `pendingLine`.
+int EvaluateLinesAsync(const LinesOptions& options)
+{
+#ifdef RPN_CLI_HAS_POSIX_IO
+    int inputFd = options.InputPath ? open(options.InputPath, O_RDONLY) : 0;
+    if (inputFd < 0)
+    {
+        fprintf(stderr, "rpn_cli: cannot open %s: %s\n", options.InputPath, strerror(errno));
+        return 1;
+    }
+    int outputFd = options.OutputPath ? open(options.OutputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644) : 1;
+    if (outputFd < 0)
+    {
+        fprintf(stderr, "rpn_cli: cannot open %s: %s\n", options.OutputPath, strerror(errno));
+        return 1;
+    }
+
+    bool success = true;
+    size_t nbErrors = 0;
+    {
+        AsyncFileIo fileIo(inputFd, outputFd, true);
+        if (fileIo.backend() != AsyncFileIo::Backend::IoUring)
+            fprintf(stderr, "rpn_cli: io_uring is not available, using pread/pwrite\n");
+
+        ThreadPool threadPool(options.NbThreads);
+        ParallelLineEvaluator parallelEvaluator;
+        LineEvaluator lineEvaluator;
+        std::string pendingLine, output;
+        auto write = [&fileIo](const std::string& text) { return fileIo.Write(text.data(), text.size()); };
+
+        std::string_view block;
+        while (success && (success = fileIo.ReadNext(block)) && !block.empty())
+        {
+            const char* begin = block.data();
+            const char* end = begin + block.size();
+            if (!pendingLine.empty())
+            {
+                const char* endOfLine = (const char*)memchr(begin, '\n', block.size());
+                pendingLine.append(begin, endOfLine ? endOfLine : end);
+                if (endOfLine == nullptr)
+                    continue;
+                output.clear();
+                lineEvaluator.EvaluateLine(pendingLine, output);
+                pendingLine.clear();
+                success = write(output);
+                begin = endOfLine + 1;
+            }
+            const char* completeEnd = end;
+            while (completeEnd > begin && completeEnd[-1] != '\n')
+                --completeEnd;
+            success = success && parallelEvaluator.EvaluateLines(begin, completeEnd, threadPool, write);
+            nbErrors += parallelEvaluator.NbErrors;
+            pendingLine.assign(completeEnd, end);
+        }
+        if (success && !pendingLine.empty()) // last line, without end of line
+        {
+            output.clear();
+            lineEvaluator.EvaluateLine(pendingLine, output);
+            success = write(output);
+        }
+        success = success && fileIo.Flush();
+        if (!success)
+            fprintf(stderr, "rpn_cli: %s\n", fileIo.ErrorMessage.c_str());
+        nbErrors += lineEvaluator.NbErrors;
+    }
+
+    if (options.InputPath)
+        close(inputFd);
+    if (options.OutputPath && close(outputFd) != 0)
+        success = false;
+    return (success && nbErrors == 0) ? 0 : 1;
+#else
+    (void)options;
+    fprintf(stderr, "rpn_cli: --io-uring is not supported on this platform\n");
+    return 1;
+#endif
+}
+
+
+// --lines mode, for stdin or a file that cannot be mapped:
+// reads big blocks, evaluates their complete lines, and keeps the incomplete tail for the next read
+int EvaluateLines(const char* inputPath, FILE* outputFile)
+{
+    FILE* inputFile = inputPath ? fopen(inputPath, "rb") : stdin;
+    if (inputFile == nullptr)
+    {
+        fprintf(stderr, "rpn_cli: cannot open %s: %s\n", inputPath, strerror(errno));
+        return 1;
+    }
+
+    LineEvaluator lineEvaluator;
+    std::vector<char> buffer(kStreamBufferSize);
+    std::string output;
+    output.reserve(kStreamBufferSize + 4096);
+    size_t nbPending = 0; // bytes of the incomplete line, at the start of the buffer
+    bool success = true;
+    while (true)
+    {
+        if (nbPending == buffer.size())
+            buffer.resize(buffer.size() * 2); // a line longer than the buffer
+        size_t nbRead = fread(buffer.data() + nbPending, 1, buffer.size() - nbPending, inputFile);
+        if (nbRead == 0)
+            break;
+        const char* begin = buffer.data();
+        const char* end = begin + nbPending + nbRead;
+        const char* tail = lineEvaluator.EvaluateLines(begin, end, output);
+        nbPending = (size_t)(end - tail);
+        memmove(buffer.data(), tail, nbPending);
+        if (output.size() >= kStreamBufferSize)
+        {
+            success = WriteOutput(output, outputFile) && success;
+            output.clear();
+        }
+    }
+    if (ferror(inputFile))
+    {
+        fprintf(stderr, "rpn_cli: read error: %s\n", strerror(errno));
+        success = false;
+    }
+    if (nbPending > 0) // last line, without end of line
+        lineEvaluator.EvaluateLine(std::string_view(buffer.data(), nbPending), output);
+    success = WriteOutput(output, outputFile) && success;
+    if (fflush(outputFile) != 0)
+        success = false;
+
+    if (inputPath)
+        fclose(inputFile);
+    return (success && lineEvaluator.NbErrors == 0) ? 0 : 1;
+}
+
+
+// --program mode: the input column is mapped in memory, and evaluated by windows of rows with all the threads
+int EvaluateColumn(const char* source, const char* inputPath, const char* outputPath, size_t nbThreads, bool useJit)
+{
+    Program program;
+    std::string errorMessage;
+    if (!CompileProgram(source, program, errorMessage))
+    {
+        fprintf(stderr, "rpn_cli: %s\n", errorMessage.c_str());
+        return 1;
+    }
+    OptimizeProgram(program, AngleUnitType::Deg);
+    if (IsSameFile(inputPath, outputPath))
+    {
+        fprintf(stderr, "rpn_cli: %s: the output file cannot be the input file\n", outputPath);
+        return 1;
+    }
+    ColumnReader reader;
+    if (!reader.Open(inputPath))
+    {
+        fprintf(stderr, "rpn_cli: %s: %s\n", inputPath, reader.ErrorMessage.c_str());
+        return 1;
+    }
+    ColumnWriter writer;
+    if (!writer.Open(outputPath, reader.size()))
+    {
+        fprintf(stderr, "rpn_cli: %s\n", writer.ErrorMessage.c_str());
+        return 1;
+    }
+
+    const size_t windowSize = 1 << 20;
+    ThreadPool threadPool(nbThreads);
+    BatchEvaluator batchEvaluator;
+    batchEvaluator.UseJit = useJit;
+    std::vector<double> outputs(reader.size() < windowSize ? reader.size() : windowSize);
+    for (size_t start = 0; start < reader.size(); start += windowSize)
+    {
+        size_t count = (reader.size() - start < windowSize) ? reader.size() - start : windowSize;
+        if (!batchEvaluator.EvaluateParallel(program, reader.values() + start, outputs.data(), count, threadPool))
+        {
+            fprintf(stderr, "rpn_cli: %s\n", batchEvaluator.ErrorMessage.c_str());
+            return 1;
+        }
+        if (!writer.Write(outputs.data(), count))
+            break;
+    }
+    if (!writer.Close())
+    {
+        fprintf(stderr, "rpn_cli: %s\n", writer.ErrorMessage.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+
+// --profile mode: counts the pairs of consecutive instructions (bigrams) of the programs of a file (one per line),
+// to choose the superinstructions (see FuseSuperinstructions)
+int ProfileBigrams(const char* inputPath)
+{
+    std::ifstream inputFile;
+    if (inputPath)
+    {
+        inputFile.open(inputPath);
+        if (!inputFile)
+        {
+            fprintf(stderr, "rpn_cli: cannot open %s\n", inputPath);
+            return 1;
+        }
+    }
+    std::istream& input = inputPath ? inputFile : std::cin;
+
+    const size_t nbInstrs = (size_t)Instr::Count;
+    std::vector<size_t> counts(nbInstrs * nbInstrs, 0);
+    size_t nbPrograms = 0, nbInstructions = 0, nbFusedInstructions = 0, nbBigrams = 0;
+    Program program;
+    std::string errorMessage, line;
+    while (std::getline(input, line))
+    {
+        if (!CompileProgram(line, program, errorMessage))
+            continue;
+        ++nbPrograms;
+        nbFusedInstructions += program.Code.size();
+        ExpandSuperinstructions(program);
+        nbInstructions += program.Code.size();
+        for (size_t i = 0; i + 1 < program.Code.size(); ++i)
+        {
+            ++counts[(size_t)program.Code[i].Op * nbInstrs + (size_t)program.Code[i + 1].Op];
+            ++nbBigrams;
+        }
+    }
+
+    std::vector<size_t> order(counts.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&counts](size_t a, size_t b) { return counts[a] > counts[b]; });
+
+    printf("%zu programs: %zu instructions, %zu dispatches with the superinstructions\n",
+           nbPrograms, nbInstructions, nbFusedInstructions);
+    printf("Most frequent bigrams:\n");
+    for (size_t i = 0; i < 20 && i < order.size() && counts[order[i]] > 0; ++i)
+    {
+        Instr first = (Instr)(order[i] / nbInstrs), second = (Instr)(order[i] % nbInstrs);
+        // Is the pair fused?
+        Program pair;
+        pair.Code = { {first, 0}, {second, 0} };
+        FuseSuperinstructions(pair);
+        if (pair.Code.size() == 1)
+            printf("    %6.2f%%  %-14s %-14s -> %s\n", 100. * (double)counts[order[i]] / (double)nbBigrams,
+                   InstrName(first), InstrName(second), InstrName(pair.Code[0].Op));
+        else
+            printf("    %6.2f%%  %-14s %s\n", 100. * (double)counts[order[i]] / (double)nbBigrams,
+                   InstrName(first), InstrName(second));
+    }
+    return 0;
+}
+
+
+// --verify mode: a differential test of the compiled programs.
+// Each program is evaluated token by token by CalculatorState (the reference), and by the VirtualMachine before
+// and after the peephole optimizer: the final stacks and registers must be bit for bit identical, and the
+// programs must fail together. "x" is replaced by kVerifyInput for CalculatorState.
+static const char* kVerifyInput = "0.7";
+
+// Bitwise equality, except that all NaNs are equal: IEEE-754 does not specify the sign and payload of a NaN
+// computed from two NaN operands, and the compiler may swap the operands of + and *.
+static bool IsSameValue(double a, double b)
+{
+    if (std::isnan(a) && std::isnan(b))
+        return true;
+    return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+struct VerifyResult
+{
+    bool Success = false;
+    std::vector<double> Stack;
+    AngleUnitType AngleUnit = AngleUnitType::Deg;
+    double StoredValue = 0.;
+    std::string ErrorMessage;
+
+    bool IsSameAs(const VerifyResult& other) const
+    {
+        if (Success != other.Success)
+            return false;
+        if (!Success)
+            return true;
+        if (Stack.size() != other.Stack.size() || AngleUnit != other.AngleUnit
+            || !IsSameValue(StoredValue, other.StoredValue))
+            return false;
+        for (size_t i = 0; i < Stack.size(); ++i)
+            if (!IsSameValue(Stack[i], other.Stack[i]))
+                return false;
+        return true;
+    }
+
+    std::string ToString() const
+    {
+        if (!Success)
+            return "Error: " + ErrorMessage;
+        std::string s;
+        for (double v: Stack)
+        {
+            AppendRoundTripValue(v, s);
+            s += ' ';
+        }
+        s += "(" + to_string(AngleUnit) + ", Sto ";
+        AppendRoundTripValue(StoredValue, s);
+        return s + ")";
+    }
+};
+
+VerifyResult EvaluateWithCalculatorState(const std::string& source)
+{
+    CalculatorState calculatorState;
+    calculatorState.ScientificMode = true;
+    VerifyResult result;
+    result.Success = true;
+    RpnTokenizer tokenizer(source);
+    std::string_view token;
+    while (result.Success && tokenizer.Next(token))
+    {
+        std::string tokenString = (token == "x") ? kVerifyInput : std::string(token);
+        result.Success = calculatorState.OnRpnToken(tokenString) && calculatorState.ErrorMessage.empty();
+        result.ErrorMessage = calculatorState.ErrorMessage;
+    }
+    for (size_t i = 0; i < calculatorState.Stack.size(); ++i)
+        result.Stack.push_back(calculatorState.Stack[(int)i]);
+    result.AngleUnit = calculatorState.AngleUnit;
+    result.StoredValue = calculatorState.StoredValue;
+    return result;
+}
+
+VerifyResult EvaluateWithVirtualMachine(const Program& program)
+{
+    VirtualMachine vm;
+    vm.Input = ParseNumber(kVerifyInput).value();
+    CalculatorStack stack;
+    VerifyResult result;
+    result.Success = vm.Run(program, stack);
+    result.ErrorMessage = vm.ErrorMessage;
+    for (size_t i = 0; i < stack.size(); ++i)
+        result.Stack.push_back(stack[(int)i]);
+    result.AngleUnit = vm.AngleUnit;
+    result.StoredValue = vm.StoredValue;
+    return result;
+}
+
+struct ProgramVerifier
+{
+    size_t NbPrograms = 0, NbSkipped = 0, NbMismatches = 0;
+    size_t NbInstructions = 0, NbOptimizedInstructions = 0;
+    size_t NbJitPrograms = 0;
+    size_t NbUndoChecks = 0;
+
+    void Verify(const std::string& source)
+    {
+        Program program;
+        std::string errorMessage;
+        bool isCompiled = CompileProgram(source, program, errorMessage);
+        VerifyResult reference = EvaluateWithCalculatorState(source);
+        if (!isCompiled)
+        {
+            if (errorMessage != "Not enough values on the stack")
+            {
+                ++NbSkipped; // e.g. "Undo", which only CalculatorState supports
+                return;
+            }
+            // A program rejected by VerifyProgram must fail in CalculatorState too
+            ++NbPrograms;
+            if (reference.Success)
+            {
+                ++NbMismatches;
+                fprintf(stderr, "Mismatch for \"%s\": rejected by VerifyProgram, but CalculatorState gives %s\n",
+                        source.c_str(), reference.ToString().c_str());
+            }
+            return;
+        }
+        ++NbPrograms;
+        VerifyResult compiled = EvaluateWithVirtualMachine(program);
+
+        // Optimized without knowing the initial angle unit, and knowing it (as EvaluateColumn does)
+        Program optimized = program, optimizedInDeg = program;
+        OptimizeProgram(optimized);
+        OptimizeProgram(optimizedInDeg, AngleUnitType::Deg);
+        VerifyResult optimizedResult = EvaluateWithVirtualMachine(optimized);
+        VerifyResult optimizedInDegResult = EvaluateWithVirtualMachine(optimizedInDeg);
+        NbInstructions += program.Code.size();
+        NbOptimizedInstructions += optimizedInDeg.Code.size();
+
+        bool isSame = compiled.IsSameAs(reference)
+            && optimizedResult.IsSameAs(compiled) && optimizedResult.ErrorMessage == compiled.ErrorMessage
+            && optimizedInDegResult.IsSameAs(compiled) && optimizedInDegResult.ErrorMessage == compiled.ErrorMessage;
+        if (!isSame)
+        {
+            ++NbMismatches;
+            fprintf(stderr, "Mismatch for \"%s\"\n", source.c_str());
+            fprintf(stderr, "    CalculatorState:    %s\n", reference.ToString().c_str());
+            fprintf(stderr, "    compiled:           %s\n", compiled.ToString().c_str());
+            fprintf(stderr, "    optimized:          %s\n", optimizedResult.ToString().c_str());
+            fprintf(stderr, "    optimized (in Deg): %s\n", optimizedInDegResult.ToString().c_str());
+        }
+
+        // Native code, as EvaluateColumn runs it with --jit: the output is the top of the stack, or NaN if the
+        // program fails (a division by zero)
+        if (!JitFunction::IsSupported())
+            return;
+        for (const Program* jitProgram: { &program, &optimizedInDeg })
+        {
+            JitFunction jitFunction;
+            if (!jitFunction.Compile(*jitProgram, AngleUnitType::Deg))
+                continue;
+            ++NbJitPrograms;
+            double input = ParseNumber(kVerifyInput).value(), output;
+            jitFunction.Evaluate(&input, &output, 1);
+            double expected = (reference.Success && !reference.Stack.empty())
+                ? reference.Stack.back() : std::numeric_limits<double>::quiet_NaN();
+            if (!IsSameValue(output, expected))
+            {
+                ++NbMismatches;
+                std::string outputString;
+                AppendRoundTripValue(output, outputString);
+                fprintf(stderr, "Mismatch for \"%s\"%s\n", source.c_str(), jitProgram == &program ? "" : " (optimized)");
+                fprintf(stderr, "    CalculatorState: %s\n", reference.ToString().c_str());
+                fprintf(stderr, "    native code:     %s\n", outputString.c_str());
+            }
+        }
+    }
+
+    // The limits of the undo log (see CalculatorStack::store_undo), on a ring of 64 changes: an operation which
+    // outgrows the ring must not be undoable, and an operation which fits must be undone entirely. Then the
+    // validation of the saved undo logs, and the operations which empty the stack at once (see pop_all)
+    void VerifyUndoLimits()
+    {
+        auto check = [this](bool isOk, const char* name) {
+            ++NbUndoChecks;
+            if (!isOk)
+            {
+                ++NbMismatches;
+                fprintf(stderr, "Undo check failed: %s\n", name);
+            }
+        };
+        const double initialValues[10] = {0., 1., 2., 3., 4., 5., 6., 7., 8., 9.};
+        auto makeStack = [&](CalculatorStack& stack) {
+            stack.set_undo_memory_budget(64 * sizeof(UndoEntry));
+            stack.assign(initialValues, initialValues + 10);
+            stack.store_undo();
+            stack.push_back(10.);
+        };
+        auto pushValues = [](CalculatorStack& stack, size_t count) {
+            stack.store_undo();
+            for (size_t i = 0; i < count; ++i)
+                stack.push_back((double)i);
+        };
+
+        {
+            CalculatorStack stack;
+            makeStack(stack);
+            pushValues(stack, 100);
+            check(!stack.can_undo(), "an operation larger than the ring cannot be undone");
+            stack.undo();
+            check(stack.size() == 111, "undo after an operation larger than the ring");
+            pushValues(stack, 1);
+            stack.undo();
+            check(stack.size() == 111 && !stack.can_undo(), "the operation after an operation larger than the ring");
+        }
+        {
+            CalculatorStack stack;
+            makeStack(stack);
+            pushValues(stack, 64);
+            stack.undo();
+            check(stack.size() == 11 && !stack.can_undo(), "an operation as large as the ring");
+        }
+        {
+            CalculatorStack stack;
+            makeStack(stack);
+            pushValues(stack, 63);
+            stack.undo();
+            stack.undo();
+            check(stack.size() == 10, "an operation which evicts the previous one");
+        }
+        {
+            // A saved undo log which does not belong to the saved stack is forgotten
+            CalculatorStack stack;
+            stack.from_json(nlohmann::json::parse(
+                R"({"Stack": [], "UndoLog": [["PushBack", 1, true]], "UndoCursor": 1})"));
+            stack.undo();
+            check(stack.size() == 0 && !stack.can_undo(), "an undo log which pops an empty stack");
+            stack.from_json(nlohmann::json::parse(
+                R"({"Stack": [5], "UndoLog": [["PopBack", 1, true]], "UndoCursor": 0})"));
+            stack.redo();
+            stack.redo();
+            check(stack.size() == 0, "a redo log which fits the stack");
+        }
+        {
+            // Clear and the reductions of a stack of numbers larger than the ring are a single change
+            std::vector<double> values(1000);
+            for (size_t i = 0; i < values.size(); ++i)
+                values[i] = (double)i;
+            for (const char* token: { "Clear", "Sum" })
+            {
+                CalculatorState calculatorState;
+                calculatorState.Stack.set_undo_memory_budget(64 * sizeof(UndoEntry));
+                calculatorState.Stack.assign(values.data(), values.data() + values.size());
+                calculatorState.OnRpnToken(token);
+                size_t size = calculatorState.Stack.size();
+                CalculatorStack saved;
+                saved.from_json(calculatorState.Stack.to_json());
+                calculatorState.OnRpnToken("Undo");
+                saved.undo();
+                bool isRestored = calculatorState.Stack.size() == values.size() && saved.size() == values.size()
+                    && calculatorState.Stack[999] == 999. && saved[999] == 999.;
+                calculatorState.OnRpnToken("Redo");
+                check(isRestored && calculatorState.Stack.size() == size, token);
+            }
+        }
+    }
+
+    int PrintSummary() const
+    {
+        printf("%zu programs (%zu skipped), %zu mismatches; %zu instructions, %zu after optimization; "
+               "%zu native functions; %zu undo checks\n",
+               NbPrograms, NbSkipped, NbMismatches, NbInstructions, NbOptimizedInstructions, NbJitPrograms,
+               NbUndoChecks);
+        return NbMismatches == 0 ? 0 : 1;
+    }
+};
+
+// Random programs, made of tokens which give the peephole optimizer something to do
+std::string MakeRandomProgram(std::mt19937& rng)
+{
+    static const char* values[] = { "0", "1", "2", "0.5", "180", "1E3", "Pi", "e", "x", "Recall" };
+    static const char* operators[] = {
+        "+", "-", "*", "/", "y^x",
+        "sin", "cos", "tan", "sin^-1", "cos^-1", "tan^-1",
+        "1/x", "log", "ln", "10^x", "e^x", "sqrt", "x^2", "floor", "+/-",
+        "Swap", "Dup", "Drop", "Clear", "Sto", "Roll", "Deg", "Rad", "Grad",
+    };
+    const size_t nbValues = sizeof(values) / sizeof(values[0]);
+    const size_t nbOperators = sizeof(operators) / sizeof(operators[0]);
+
+    size_t nbTokens = 1 + rng() % 12;
+    std::string source;
+    for (size_t i = 0; i < nbTokens; ++i)
+    {
+        if (!source.empty())
+            source += ' ';
+        if (rng() % 5 < 2)
+            source += values[rng() % nbValues];
+        else
+            source += operators[rng() % nbOperators];
+    }
+    return source;
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--program") == 0)
+    {
+        const char *source = nullptr, *inputPath = nullptr, *outputPath = nullptr;
+        size_t nbThreads = 0;
+        bool useJit = false;
+        for (int i = 1; i < argc; ++i)
+        {
+            if (strcmp(argv[i], "--jit") == 0)
+                useJit = true;
+            else if (i + 1 == argc)
+                break;
+            else if (strcmp(argv[i], "--program") == 0)
+                source = argv[++i];
+            else if (strcmp(argv[i], "--in") == 0)
+                inputPath = argv[++i];
+            else if (strcmp(argv[i], "--out") == 0)
+                outputPath = argv[++i];
+            else if (strcmp(argv[i], "--threads") == 0)
+                nbThreads = (size_t)strtoul(argv[++i], nullptr, 10);
+        }
+        if (source == nullptr || inputPath == nullptr || outputPath == nullptr)
+        {
+            fprintf(stderr, "usage: rpn_cli --program PROGRAM --in IN --out OUT [--threads N] [--jit]\n");
+            return 1;
+        }
+        return EvaluateColumn(source, inputPath, outputPath, nbThreads, useJit);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--profile") == 0)
+        return ProfileBigrams(argc > 2 ? argv[2] : nullptr);
+
+    if (argc > 1 && strcmp(argv[1], "--verify") == 0)
+    {
+        ProgramVerifier verifier;
+        if (argc > 2 && strcmp(argv[2], "--random") == 0)
+        {
+            size_t nbPrograms = (argc > 3) ? (size_t)strtoul(argv[3], nullptr, 10) : 100000;
+            std::mt19937 rng(42);
+            for (size_t i = 0; i < nbPrograms; ++i)
+                verifier.Verify(MakeRandomProgram(rng));
+        }
+        else
+        {
+            std::ifstream inputFile;
+            if (argc > 2)
+            {
+                inputFile.open(argv[2]);
+                if (!inputFile)
+                {
+                    fprintf(stderr, "rpn_cli: cannot open %s\n", argv[2]);
+                    return 1;
+                }
+            }
+            std::istream& input = (argc > 2) ? inputFile : std::cin;
+            std::string line;
+            while (std::getline(input, line))
+                verifier.Verify(line);
+        }
+        verifier.VerifyUndoLimits();
+        return verifier.PrintSummary();
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--lines") == 0)
+    {
+        LinesOptions options;
+        for (int i = 2; i < argc; ++i)
+        {
+            if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+                options.NbThreads = (size_t)strtoul(argv[++i], nullptr, 10);
+            else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+                options.OutputPath = argv[++i];
+            else if (strcmp(argv[i], "--io-uring") == 0)
+                options.UseIoUring = true;
+            else
+                options.InputPath = argv[i];
+        }
+        if (options.UseIoUring)
+            return EvaluateLinesAsync(options);
+
+        FILE* outputFile = options.OutputPath ? fopen(options.OutputPath, "wb") : stdout;
+        if (outputFile == nullptr)
+        {
+            fprintf(stderr, "rpn_cli: cannot open %s: %s\n", options.OutputPath, strerror(errno));
+            return 1;
+        }
+        int exitCode;
+        MappedFile mappedFile(options.InputPath ? options.InputPath : "");
+        if (options.InputPath && mappedFile.is_mapped())
+            exitCode = EvaluateMappedLines(mappedFile, options, outputFile);
+        else
+            exitCode = EvaluateLines(options.InputPath, outputFile);
+        if (options.OutputPath && fclose(outputFile) != 0)
+            exitCode = 1;
+        return exitCode;
+    }
+
+    CalculatorState calculatorState;
+    calculatorState.ScientificMode = true;
+
+    bool success = true;
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; ++i)
+            success = EvaluateToken(calculatorState, argv[i]) && success;
+    }
+    else
+    {
+        std::string token;
+        while (std::cin >> token)
+            success = EvaluateToken(calculatorState, token) && success;
+    }
+
+    PrintStack(calculatorState);
+    return success ? 0 : 1;
+}
@@ -0,0 +1,255 @@
+#include "rpn_column.h"
+#include <cerrno>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define RPN_HAS_STAT
+    #include <sys/stat.h>
+#endif
+
+
+namespace RpnCalculator
+{
+    static const char gColumnMagic[8] = { 'R', 'P', 'N', 'C', 'O', 'L', '0', '1' };
+
+    static bool _isLittleEndianHost()
+    {
+        const uint16_t one = 1;
+        uint8_t firstByte;
+        memcpy(&firstByte, &one, 1);
+        return firstByte == 1;
+    }
+
+    static uint64_t _byteSwap(uint64_t v)
+    {
+        uint64_t swapped = 0;
+        for (int i = 0; i < 8; ++i)
+            swapped |= ((v >> (8 * i)) & 0xff) << (8 * (7 - i));
+        return swapped;
+    }
+
+    // Little-endian bytes <-> host values
+    static uint64_t _loadLittleEndian64(const char* data)
+    {
+        uint64_t v = 0;
+        for (int i = 0; i < 8; ++i)
+            v |= (uint64_t)(uint8_t)data[i] << (8 * i);
+        return v;
+    }
+
+    static void _storeLittleEndian64(uint64_t v, char* data)
+    {
+        for (int i = 0; i < 8; ++i)
+            data[i] = (char)((v >> (8 * i)) & 0xff);
+    }
+
+
+    //
+    // ColumnReader
+    //
+    bool ColumnReader::Open(const char* path)
+    {
+        ErrorMessage.clear();
+        _mappedFile.reset();
+        _ownedValues.clear();
+        _values = nullptr;
+        _size = 0;
+
+        bool isStdin = (strcmp(path, "-") == 0);
+        if (!isStdin)
+        {
+            _mappedFile = std::make_unique<MappedFile>(path);
+            if (_mappedFile->is_mapped())
+            {
+                if (!_parseHeader(_mappedFile->data(), _mappedFile->size()))
+                    return false;
+                if (_isLittleEndianHost())
+                {
+                    _values = (const double*)(_mappedFile->data() + ColumnHeaderSize);
+                    return true;
+                }
+                _ownedValues.resize(_size);
+                memcpy(_ownedValues.data(), _mappedFile->data() + ColumnHeaderSize, _size * sizeof(double));
+            }
+            _mappedFile.reset();
+        }
+
+        if (_ownedValues.empty())
+        {
+            // Not mapped: read the whole file
+            FILE* file = isStdin ? stdin : fopen(path, "rb");
+            if (file == nullptr)
+            {
+                ErrorMessage = std::string("cannot open ") + path + ": " + strerror(errno);
+                return false;
+            }
+            std::vector<char> content;
+            size_t nbRead = 0;
+            do
+            {
+                content.resize(content.size() + (1 << 20));
+                nbRead = fread(content.data() + content.size() - (1 << 20), 1, 1 << 20, file);
+                content.resize(content.size() - (1 << 20) + nbRead);
+            } while (nbRead > 0);
+            bool isReadError = ferror(file) != 0;
+            if (!isStdin)
+                fclose(file);
+            if (isReadError)
+            {
+                ErrorMessage = std::string("cannot read ") + path;
+                return false;
+            }
+            if (!_parseHeader(content.data(), content.size()))
+                return false;
+            _ownedValues.resize(_size);
+            if (_size > 0)
+                memcpy(_ownedValues.data(), content.data() + ColumnHeaderSize, _size * sizeof(double));
+        }
+
+        if (!_isLittleEndianHost())
+        {
+            for (double& v: _ownedValues)
+            {
+                uint64_t bits;
+                memcpy(&bits, &v, sizeof(bits));
+                bits = _byteSwap(bits);
+                memcpy(&v, &bits, sizeof(bits));
+            }
+        }
+        _values = _ownedValues.data();
+        return true;
+    }
+
+    bool ColumnReader::_parseHeader(const char* data, size_t dataSize)
+    {
+        if (dataSize < ColumnHeaderSize || memcmp(data, gColumnMagic, sizeof(gColumnMagic)) != 0)
+        {
+            ErrorMessage = "not a column file (bad header)";
+            return false;
+        }
+        uint64_t count = _loadLittleEndian64(data + 8);
+        if (count != (dataSize - ColumnHeaderSize) / sizeof(double) || (dataSize - ColumnHeaderSize) % sizeof(double) != 0)
+        {
+            ErrorMessage = "truncated column file (the header announces " + std::to_string(count) + " values)";
+            return false;
+        }
+        _size = (size_t)count;
+        return true;
+    }
+
+
+    //
+    // ColumnWriter
+    //
+    ColumnWriter::~ColumnWriter()
+    {
+        if (_file != nullptr && !_isStdout)
+        {
+            fclose(_file);
+            remove(_temporaryPath.c_str());
+        }
+    }
+
+    bool ColumnWriter::Open(const char* path, uint64_t count)
+    {
+        ErrorMessage.clear();
+        _isStdout = (strcmp(path, "-") == 0);
+        _path = path;
+        _temporaryPath = _path + ".tmp";
+        _file = _isStdout ? stdout : fopen(_temporaryPath.c_str(), "wb");
+        if (_file == nullptr)
+        {
+            ErrorMessage = "cannot open " + _temporaryPath + ": " + strerror(errno);
+            return false;
+        }
+        _expectedCount = count;
+        _writtenCount = 0;
+
+        char header[ColumnHeaderSize];
+        memcpy(header, gColumnMagic, sizeof(gColumnMagic));
+        _storeLittleEndian64(count, header + 8);
+        return _write(header, sizeof(header));
+    }
+
+    bool ColumnWriter::Write(const double* values, size_t count)
+    {
+        _writtenCount += count;
+        if (_isLittleEndianHost())
+            return _write(values, count * sizeof(double));
+
+        _swappedValues.resize(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint64_t bits;
+            memcpy(&bits, &values[i], sizeof(bits));
+            bits = _byteSwap(bits);
+            memcpy(&_swappedValues[i], &bits, sizeof(bits));
+        }
+        return _write(_swappedValues.data(), count * sizeof(double));
+    }
+
+    bool ColumnWriter::Close()
+    {
+        if (_file == nullptr)
+            return false;
+        bool success = ErrorMessage.empty();
+        if (success && _writtenCount != _expectedCount)
+        {
+            ErrorMessage = "wrote " + std::to_string(_writtenCount) + " values instead of " + std::to_string(_expectedCount);
+            success = false;
+        }
+        if (_isStdout ? fflush(_file) != 0 : fclose(_file) != 0)
+        {
+            if (success)
+                ErrorMessage = std::string("write error: ") + strerror(errno);
+            success = false;
+        }
+        _file = nullptr;
+        if (_isStdout)
+            return success;
+
+#ifdef _WIN32
+        // rename() does not replace an existing file on Windows
+        if (success)
+            remove(_path.c_str());
+#endif
+        if (success && rename(_temporaryPath.c_str(), _path.c_str()) != 0)
+        {
+            ErrorMessage = "cannot rename " + _temporaryPath + " to " + _path + ": " + strerror(errno);
+            success = false;
+        }
+        if (!success)
+            remove(_temporaryPath.c_str());
+        return success;
+    }
+
+    bool ColumnWriter::_write(const void* data, size_t size)
+    {
+        if (!ErrorMessage.empty())
+            return false;
+        if (fwrite(data, 1, size, _file) != size)
+        {
+            ErrorMessage = std::string("write error: ") + strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+
+    bool IsSameFile(const char* path1, const char* path2)
+    {
+#ifdef RPN_HAS_STAT
+        if (strcmp(path1, "-") == 0 || strcmp(path2, "-") == 0)
+            return false;
+        struct stat status1, status2;
+        if (stat(path1, &status1) != 0 || stat(path2, &status2) != 0)
+            return false;
+        return status1.st_dev == status2.st_dev && status1.st_ino == status2.st_ino;
+#else
+        (void)path1;
+        (void)path2;
+        return false;
+#endif
+    }
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include "rpn_stream.h"
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+namespace RpnCalculator
+{
+    // Binary column files: columns of values exchanged without any text conversion (rpn_cli --program).
+    //
+    // Layout (all little-endian):
+    //     bytes 0-7     magic "RPNCOL01"
+    //     bytes 8-15    number of values (uint64)
+    //     bytes 16-     the values (IEEE-754 float64)
+    // The values start at offset 16, so that they are aligned when the file is mapped in memory.
+    static constexpr size_t ColumnHeaderSize = 16;
+
+
+    // Reads a column file: the file is mapped in memory (zero copy) when possible, otherwise (pipes, "-" for
+    // stdin, big-endian hosts) its values are read into memory.
+    class ColumnReader
+    {
+    public:
+        // Returns false and fills ErrorMessage if the file cannot be read, or is not a valid column file
+        bool Open(const char* path);
+
+        const double* values() const { return _values; }
+        size_t size() const { return _size; }
+
+        std::string ErrorMessage;
+
+    private:
+        bool _parseHeader(const char* data, size_t dataSize);
+
+        std::unique_ptr<MappedFile> _mappedFile;
+        std::vector<double> _ownedValues;
+        const double* _values = nullptr;
+        size_t _size = 0;
+    };
+
+
+    // Writes a column file ("-" for stdout): Open() writes the header, Write() appends values.
+    // A file is written as "<path>.tmp", which Close() renames to path on success: a failed or interrupted
+    // evaluation leaves no truncated file (and the previous file is kept). The destructor removes the temporary file
+    // if Close() was not called.
+    class ColumnWriter
+    {
+    public:
+        ~ColumnWriter();
+
+        bool Open(const char* path, uint64_t count);
+        bool Write(const double* values, size_t count);
+        // Returns false if the number of values written differs from the count given to Open, or on write error
+        // (the temporary file is then removed)
+        bool Close();
+
+        std::string ErrorMessage;
+
+    private:
+        bool _write(const void* data, size_t size);
+
+        FILE* _file = nullptr;
+        bool _isStdout = false;
+        std::string _path, _temporaryPath;
+        uint64_t _expectedCount = 0, _writtenCount = 0;
+        std::vector<double> _swappedValues; // big-endian hosts only
+    };
+
+
+    // True if both paths name the same existing file (same device and inode: e.g. through a link, or a different
+    // path). Always false where this cannot be known (non POSIX platforms), and for "-".
+    bool IsSameFile(const char* path1, const char* path2);
+
+}
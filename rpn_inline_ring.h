@@ -0,0 +1,115 @@
+#pragma once
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+
+
+namespace RpnCalculator
+{
+    // A double-ended queue with contiguous storage:
+    //     * the first InlineCapacity elements are stored inline (no heap allocation for usual stacks)
+    //     * deeper stacks spill to a heap buffer, whose capacity doubles when needed
+    //     * elements are stored in a ring, so that push_front / pop_front are O(1), like push_back / pop_back
+    // InlineCapacity must be a power of two.
+    template<typename T, size_t InlineCapacity>
+    class InlineRing
+    {
+        static_assert(InlineCapacity > 0 && (InlineCapacity & (InlineCapacity - 1)) == 0,
+                      "InlineCapacity must be a power of two");
+    public:
+        InlineRing() = default;
+        InlineRing(const InlineRing& other) { *this = other; }
+        InlineRing& operator=(const InlineRing& other)
+        {
+            if (this != &other)
+            {
+                clear();
+                _reserve(other._size);
+                for (size_t i = 0; i < other._size; ++i)
+                    push_back(other[i]);
+            }
+            return *this;
+        }
+        InlineRing(InlineRing&& other) noexcept { *this = std::move(other); }
+        InlineRing& operator=(InlineRing&& other) noexcept
+        {
+            if (this != &other)
+            {
+                _inline = other._inline;
+                _heap = std::move(other._heap);
+                _capacity = other._capacity;
+                _head = other._head;
+                _size = other._size;
+                other._capacity = InlineCapacity;
+                other._head = other._size = 0;
+            }
+            return *this;
+        }
+
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+        size_t capacity() const { return _capacity; }
+
+        const T& operator[](size_t index) const { return _data()[(_head + index) & (_capacity - 1)]; }
+        T& operator[](size_t index) { return _data()[(_head + index) & (_capacity - 1)]; }
+        const T& front() const { return (*this)[0]; }
+        const T& back() const { return (*this)[_size - 1]; }
+
+        void push_back(const T& v)
+        {
+            if (_size == _capacity)
+                _reserve(_capacity * 2);
+            _data()[(_head + _size) & (_capacity - 1)] = v;
+            ++_size;
+        }
+        void push_front(const T& v)
+        {
+            if (_size == _capacity)
+                _reserve(_capacity * 2);
+            _head = (_head - 1) & (_capacity - 1);
+            _data()[_head] = v;
+            ++_size;
+        }
+        // The ring must not be empty (checked in debug builds only: pop_back is on the hot path of the VM)
+        void pop_back() { assert(_size > 0); --_size; }
+        void pop_front() { assert(_size > 0); _head = (_head + 1) & (_capacity - 1); --_size; }
+        // Keeps the heap buffer, if any
+        void clear() { _head = _size = 0; }
+
+        void assign(const T* first, const T* last)
+        {
+            clear();
+            _reserve((size_t)(last - first));
+            for (const T* it = first; it != last; ++it)
+                push_back(*it);
+        }
+
+    private:
+        T* _data() { return _heap ? _heap.get() : _inline.data(); }
+        const T* _data() const { return _heap ? _heap.get() : _inline.data(); }
+
+        // Moves the elements to a bigger heap buffer (in order, starting at index 0)
+        void _reserve(size_t minCapacity)
+        {
+            if (minCapacity <= _capacity)
+                return;
+            size_t newCapacity = _capacity;
+            while (newCapacity < minCapacity)
+                newCapacity *= 2;
+            std::unique_ptr<T[]> newHeap(new T[newCapacity]);
+            for (size_t i = 0; i < _size; ++i)
+                newHeap[i] = (*this)[i];
+            _heap = std::move(newHeap);
+            _capacity = newCapacity;
+            _head = 0;
+        }
+
+        std::array<T, InlineCapacity> _inline;
+        std::unique_ptr<T[]> _heap;
+        size_t _capacity = InlineCapacity;
+        size_t _head = 0;
+        size_t _size = 0;
+    };
+
+}
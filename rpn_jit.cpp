@@ -0,0 +1,525 @@
+#include "rpn_jit.h"
+#include <cmath>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__)
+    #define RPN_HAS_JIT
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+
+namespace RpnCalculator
+{
+#ifdef RPN_HAS_JIT
+    // General purpose registers used by the generated code
+    enum : int { _rax = 0, _rbx = 3, _rsp = 4, _r12 = 12, _r13 = 13 };
+
+    // SSE2 scalar double instructions: mandatory prefix, and opcode after the 0x0F escape byte
+    struct _SseOp
+    {
+        uint8_t Prefix, Opcode;
+    };
+    static constexpr _SseOp _movsdLoad{0xF2, 0x10}, _movsdStore{0xF2, 0x11}, _sqrtsd{0xF2, 0x51};
+    static constexpr _SseOp _addsd{0xF2, 0x58}, _mulsd{0xF2, 0x59}, _subsd{0xF2, 0x5C}, _divsd{0xF2, 0x5E};
+    static constexpr _SseOp _movapd{0x66, 0x28}, _ucomisd{0x66, 0x2E}, _xorpd{0x66, 0x57};
+
+    // Condition code of je
+    enum : uint8_t { _conditionEqual = 0x4 };
+
+
+    // Encodes the few x86-64 instructions which the code generator needs
+    class _X64Assembler
+    {
+    public:
+        std::vector<uint8_t> Code;
+
+        void Bytes(std::initializer_list<uint8_t> bytes) { Code.insert(Code.end(), bytes); }
+        void Int32(uint32_t v) { for (int i = 0; i < 4; ++i) Code.push_back((uint8_t)(v >> (8 * i))); }
+        void Int64(uint64_t v) { for (int i = 0; i < 8; ++i) Code.push_back((uint8_t)(v >> (8 * i))); }
+
+        // op xmm(reg), xmm(rm)
+        void Sse(_SseOp op, int reg, int rm)
+        {
+            Code.push_back(op.Prefix);
+            _rex(reg, rm);
+            Bytes({0x0F, op.Opcode, _modRm(3, reg, rm)});
+        }
+        // op xmm(reg), [base + disp32] (or op [base + disp32], xmm(reg) for a store)
+        void SseMemory(_SseOp op, int reg, int base, int32_t disp)
+        {
+            Code.push_back(op.Prefix);
+            _rex(reg, base);
+            Bytes({0x0F, op.Opcode, _modRm(2, reg, base)});
+            if ((base & 7) == _rsp)
+                Code.push_back(0x24); // SIB byte: base rsp / r12, no index
+            Int32((uint32_t)disp);
+        }
+        // op xmm(reg), [rip + disp32]: returns the position of disp32, patched by PatchRel32
+        size_t SseRipRelative(_SseOp op, int reg)
+        {
+            Code.push_back(op.Prefix);
+            _rex(reg, 0);
+            Bytes({0x0F, op.Opcode, _modRm(0, reg, 5)});
+            return _rel32();
+        }
+        // roundsd xmm(reg), xmm(rm), mode (SSE4.1)
+        void Roundsd(int reg, int rm, uint8_t mode)
+        {
+            Code.push_back(0x66);
+            _rex(reg, rm);
+            Bytes({0x0F, 0x3A, 0x0B, _modRm(3, reg, rm), mode});
+        }
+
+        // Jumps: return the position of their rel32, patched by PatchRel32
+        size_t Jump() { Code.push_back(0xE9); return _rel32(); }
+        size_t JumpIf(uint8_t condition) { Bytes({0x0F, (uint8_t)(0x80 | condition)}); return _rel32(); }
+        void PatchRel32(size_t position, size_t target)
+        {
+            uint32_t rel = (uint32_t)((int64_t)target - (int64_t)(position + 4));
+            memcpy(&Code[position], &rel, 4);
+        }
+
+    private:
+        void _rex(int reg, int rm)
+        {
+            uint8_t rex = (uint8_t)(0x40 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+            if (rex != 0x40)
+                Code.push_back(rex);
+        }
+        static uint8_t _modRm(int mod, int reg, int rm) { return (uint8_t)((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+        size_t _rel32() { size_t position = Code.size(); Int32(0); return position; }
+    };
+
+
+    // Translates a program without superinstructions into a native function (see JitFunction).
+    //
+    // Registers: rbx -> input of the row, r12 -> output of the row, r13 = number of rows left;
+    // xmm0 and xmm1 are scratch, xmm2..xmm15 hold the stack.
+    // Frame: [rsp + 8 * level] saves the stack levels around the libm calls, [rsp + _storedValueOffset] is Sto.
+    class _JitCodeGenerator
+    {
+    public:
+        bool Generate(const Program& program, AngleUnitType angleUnit, std::vector<uint8_t>& code);
+
+    private:
+        static constexpr int32_t _storedValueOffset = 8 * (int32_t)JitFunction::JitMaxDepth;
+        static constexpr int32_t _frameSize = _storedValueOffset + 16; // keeps rsp aligned on 16 bytes for the calls
+        static constexpr int _firstStackRegister = 2;
+
+        bool _instruction(const Program& program, Instruction instruction);
+        bool _push(int& reg);
+        int _pop();
+        int _top() const { return _stack.back(); }
+
+        void _constantOperand(_SseOp op, int reg, double v);   // op xmm(reg), [constant]
+        void _callLibm(uintptr_t function);                     // xmm0 (, xmm1) -> xmm0
+        void _callUnary(double (*function)(double));            // top = function(top)
+        void _toRadian(int reg);
+        void _fromRadian(int reg);
+
+        _X64Assembler _asm;
+        AngleUnitType _angleUnit = AngleUnitType::Deg;
+        std::vector<int> _stack;            // xmm register of each stack level
+        uint32_t _freeRegisters = 0;        // bit mask of the free xmm registers
+        std::vector<double> _pool;          // constants, placed after the code
+        std::vector<std::pair<size_t, size_t>> _poolReferences;  // (position of disp32, index in _pool)
+        std::vector<size_t> _failJumps;     // jumps to the division by zero exit
+    };
+
+    bool _JitCodeGenerator::Generate(const Program& program, AngleUnitType angleUnit, std::vector<uint8_t>& code)
+    {
+        _angleUnit = angleUnit;
+        _freeRegisters = 0xFFFFu & ~((1u << _firstStackRegister) - 1);
+        bool usesStoredValue = false;
+        for (const Instruction& instruction: program.Code)
+            usesStoredValue = usesStoredValue || instruction.Op == Instr::Recall;
+
+        // Prologue: push rbx, r12, r13; mov rbx, rdi; mov r12, rsi; mov r13, rdx; sub rsp, _frameSize
+        _asm.Bytes({0x53, 0x41, 0x54, 0x41, 0x55});
+        _asm.Bytes({0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xD5});
+        _asm.Bytes({0x48, 0x81, 0xEC});
+        _asm.Int32(_frameSize);
+
+        // For each row: the stack starts empty, and Sto at 0
+        size_t loop = _asm.Code.size();
+        _asm.Bytes({0x4D, 0x85, 0xED}); // test r13, r13
+        size_t jumpToDone = _asm.JumpIf(_conditionEqual);
+        if (usesStoredValue)
+        {
+            _asm.Sse(_xorpd, 0, 0);
+            _asm.SseMemory(_movsdStore, 0, _rsp, _storedValueOffset);
+        }
+        for (const Instruction& instruction: program.Code)
+            if (!_instruction(program, instruction))
+                return false;
+        if (_stack.empty())
+            return false;
+        _asm.SseMemory(_movsdStore, _top(), _r12, 0);
+
+        size_t next = _asm.Code.size();
+        _asm.Bytes({0x48, 0x83, 0xC3, 0x08});   // add rbx, 8
+        _asm.Bytes({0x49, 0x83, 0xC4, 0x08});   // add r12, 8
+        _asm.Bytes({0x49, 0xFF, 0xCD});         // dec r13
+        _asm.PatchRel32(_asm.Jump(), loop);
+
+        // Division by zero: the output of the row is NaN
+        if (!_failJumps.empty())
+        {
+            for (size_t jump: _failJumps)
+                _asm.PatchRel32(jump, _asm.Code.size());
+            _asm.Bytes({0x48, 0xB8});           // mov rax, NaN
+            double nan = std::numeric_limits<double>::quiet_NaN();
+            uint64_t nanBits;
+            memcpy(&nanBits, &nan, sizeof(nanBits));
+            _asm.Int64(nanBits);
+            _asm.Bytes({0x49, 0x89, 0x04, 0x24}); // mov [r12], rax
+            _asm.PatchRel32(_asm.Jump(), next);
+        }
+
+        // Epilogue: add rsp, _frameSize; pop r13, r12, rbx; ret
+        _asm.PatchRel32(jumpToDone, _asm.Code.size());
+        _asm.Bytes({0x48, 0x81, 0xC4});
+        _asm.Int32(_frameSize);
+        _asm.Bytes({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+
+        // Constant pool
+        while (_asm.Code.size() % 8 != 0)
+            _asm.Code.push_back(0xCC); // int3
+        size_t poolPosition = _asm.Code.size();
+        for (double v: _pool)
+        {
+            uint64_t bits;
+            memcpy(&bits, &v, sizeof(bits));
+            _asm.Int64(bits);
+        }
+        for (const auto& [position, index]: _poolReferences)
+            _asm.PatchRel32(position, poolPosition + 8 * index);
+
+        code = std::move(_asm.Code);
+        return true;
+    }
+
+    bool _JitCodeGenerator::_instruction(const Program& program, Instruction instruction)
+    {
+        // The program is verified, this only guards the register allocation
+        size_t nbRequired;
+        int depthChange;
+        GetStackEffect(instruction.Op, nbRequired, depthChange);
+        if (instruction.Op != Instr::Clear && _stack.size() < nbRequired)
+            return false;
+
+        int reg, b;
+        switch (instruction.Op)
+        {
+            case Instr::PushConstant:
+                if (!_push(reg))
+                    return false;
+                _constantOperand(_movsdLoad, reg, program.Constants[instruction.Arg]);
+                return true;
+            case Instr::PushInput:
+                if (!_push(reg))
+                    return false;
+                _asm.SseMemory(_movsdLoad, reg, _rbx, 0);
+                return true;
+
+            case Instr::Add: b = _pop(); _asm.Sse(_addsd, _top(), b); return true;
+            case Instr::Subtract: b = _pop(); _asm.Sse(_subsd, _top(), b); return true;
+            case Instr::Multiply: b = _pop(); _asm.Sse(_mulsd, _top(), b); return true;
+            case Instr::Divide:
+                // if (b == 0) the row fails: ucomisd sets ZF for equal or unordered, and PF for unordered only
+                b = _pop();
+                _asm.Sse(_xorpd, 0, 0);
+                _asm.Sse(_ucomisd, b, 0);
+                _asm.Bytes({0x7A, 0x06}); // jp over the je
+                _failJumps.push_back(_asm.JumpIf(_conditionEqual));
+                _asm.Sse(_divsd, _top(), b);
+                return true;
+            case Instr::Power:
+                b = _pop();
+                _asm.Sse(_movapd, 0, _top());
+                _asm.Sse(_movapd, 1, b);
+                _callLibm(reinterpret_cast<uintptr_t>(static_cast<double (*)(double, double)>(std::pow)));
+                _asm.Sse(_movapd, _top(), 0);
+                return true;
+
+            case Instr::Sin: _toRadian(_top()); _callUnary(std::sin); return true;
+            case Instr::Cos: _toRadian(_top()); _callUnary(std::cos); return true;
+            case Instr::Tan: _toRadian(_top()); _callUnary(std::tan); return true;
+            case Instr::ArcSin: _callUnary(std::asin); _fromRadian(_top()); return true;
+            case Instr::ArcCos: _callUnary(std::acos); _fromRadian(_top()); return true;
+            case Instr::ArcTan: _callUnary(std::atan); _fromRadian(_top()); return true;
+            case Instr::Reciprocal:
+                _constantOperand(_movsdLoad, 0, 1.);
+                _asm.Sse(_divsd, 0, _top());
+                _asm.Sse(_movapd, _top(), 0);
+                return true;
+            case Instr::Log10: _callUnary(std::log10); return true;
+            case Instr::Ln: _callUnary(std::log); return true;
+            case Instr::Pow10:
+                _constantOperand(_movsdLoad, 0, 10.);
+                _asm.Sse(_movapd, 1, _top());
+                _callLibm(reinterpret_cast<uintptr_t>(static_cast<double (*)(double, double)>(std::pow)));
+                _asm.Sse(_movapd, _top(), 0);
+                return true;
+            case Instr::Exp: _callUnary(std::exp); return true;
+            case Instr::Sqrt: _asm.Sse(_sqrtsd, _top(), _top()); return true;
+            case Instr::Square: _asm.Sse(_mulsd, _top(), _top()); return true;
+            case Instr::Floor:
+                if (__builtin_cpu_supports("sse4.1"))
+                    _asm.Roundsd(_top(), _top(), 0x9); // round toward -inf, without the precision exception
+                else
+                    _callUnary(std::floor);
+                return true;
+            case Instr::Negate:
+                _constantOperand(_movsdLoad, 0, -0.);
+                _asm.Sse(_xorpd, _top(), 0);
+                return true;
+            case Instr::ToDeg:
+                _toRadian(_top());
+                _constantOperand(_mulsd, _top(), 180.);
+                _constantOperand(_divsd, _top(), 3.1415926535897932384626433832795);
+                return true;
+            case Instr::ToRad: _toRadian(_top()); return true;
+            case Instr::ToGrad:
+                _toRadian(_top());
+                _constantOperand(_mulsd, _top(), 200.);
+                _constantOperand(_divsd, _top(), 3.1415926535897932384626433832795);
+                return true;
+
+            // Stack operators only rename the registers, except Dup
+            case Instr::Swap: std::swap(_stack[_stack.size() - 1], _stack[_stack.size() - 2]); return true;
+            case Instr::Dup:
+                b = _top();
+                if (!_push(reg))
+                    return false;
+                _asm.Sse(_movapd, reg, b);
+                return true;
+            case Instr::Drop: _pop(); return true;
+            case Instr::Clear:
+                while (!_stack.empty())
+                    _pop();
+                return true;
+            case Instr::Sto: _asm.SseMemory(_movsdStore, _top(), _rsp, _storedValueOffset); return true;
+            case Instr::Recall:
+                if (!_push(reg))
+                    return false;
+                _asm.SseMemory(_movsdLoad, reg, _rsp, _storedValueOffset);
+                return true;
+            case Instr::Roll:
+                // the top value goes to the bottom
+                _stack.insert(_stack.begin(), _stack.back());
+                _stack.pop_back();
+                return true;
+
+            case Instr::SetDeg: _angleUnit = AngleUnitType::Deg; return true;
+            case Instr::SetRad: _angleUnit = AngleUnitType::Rad; return true;
+            case Instr::SetGrad: _angleUnit = AngleUnitType::Grad; return true;
+
+            default: // superinstructions: the program is expanded before
+                return false;
+        }
+    }
+
+    bool _JitCodeGenerator::_push(int& reg)
+    {
+        if (_stack.size() >= JitFunction::JitMaxDepth)
+            return false;
+        reg = __builtin_ctz(_freeRegisters);
+        _freeRegisters &= ~(1u << reg);
+        _stack.push_back(reg);
+        return true;
+    }
+
+    int _JitCodeGenerator::_pop()
+    {
+        int reg = _stack.back();
+        _stack.pop_back();
+        _freeRegisters |= 1u << reg;
+        return reg;
+    }
+
+    void _JitCodeGenerator::_constantOperand(_SseOp op, int reg, double v)
+    {
+        size_t index = 0;
+        while (index < _pool.size() && memcmp(&_pool[index], &v, sizeof(v)) != 0)
+            ++index;
+        if (index == _pool.size())
+            _pool.push_back(v);
+        _poolReferences.push_back({_asm.SseRipRelative(op, reg), index});
+    }
+
+    // The xmm registers are not preserved by calls: the stack levels below the top (which receives the result)
+    // are saved in the frame
+    void _JitCodeGenerator::_callLibm(uintptr_t function)
+    {
+        for (size_t level = 0; level + 1 < _stack.size(); ++level)
+            _asm.SseMemory(_movsdStore, _stack[level], _rsp, 8 * (int32_t)level);
+        _asm.Bytes({0x48, 0xB8}); // mov rax, function
+        _asm.Int64(function);
+        _asm.Bytes({0xFF, 0xD0}); // call rax
+        for (size_t level = 0; level + 1 < _stack.size(); ++level)
+            _asm.SseMemory(_movsdLoad, _stack[level], _rsp, 8 * (int32_t)level);
+    }
+
+    void _JitCodeGenerator::_callUnary(double (*function)(double))
+    {
+        _asm.Sse(_movapd, 0, _top());
+        _callLibm(reinterpret_cast<uintptr_t>(function));
+        _asm.Sse(_movapd, _top(), 0);
+    }
+
+    // Same operations, in the same order, as ToRadian() and FromRadian()
+    void _JitCodeGenerator::_toRadian(int reg)
+    {
+        if (_angleUnit == AngleUnitType::Rad)
+            return;
+        _constantOperand(_mulsd, reg, 3.1415926535897932384626433832795);
+        _constantOperand(_divsd, reg, _angleUnit == AngleUnitType::Deg ? 180. : 200.);
+    }
+
+    void _JitCodeGenerator::_fromRadian(int reg)
+    {
+        if (_angleUnit == AngleUnitType::Rad)
+            return;
+        _constantOperand(_mulsd, reg, _angleUnit == AngleUnitType::Deg ? 180. : 200.);
+        _constantOperand(_divsd, reg, 3.1415926535897932384626433832795);
+    }
+#endif // RPN_HAS_JIT
+
+
+    //
+    // JitFunction
+    //
+    bool JitFunction::IsSupported()
+    {
+#ifdef RPN_HAS_JIT
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    JitFunction::~JitFunction()
+    {
+        _release();
+    }
+
+    bool JitFunction::Compile(const Program& program, AngleUnitType initialAngleUnit)
+    {
+        _release();
+#ifdef RPN_HAS_JIT
+        if (program.MinEntryDepth > 0)
+            return false;
+        Program expanded = program;
+        ExpandSuperinstructions(expanded);
+        std::vector<uint8_t> code;
+        _JitCodeGenerator generator;
+        if (!generator.Generate(expanded, initialAngleUnit, code))
+            return false;
+
+        // Written while writable, then executable only
+        size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        size_t mappedSize = (code.size() + pageSize - 1) / pageSize * pageSize;
+        void* memory = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return false;
+        memcpy(memory, code.data(), code.size());
+        if (mprotect(memory, mappedSize, PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(memory, mappedSize);
+            return false;
+        }
+        _memory = memory;
+        _mappedSize = mappedSize;
+        _codeSize = code.size();
+        _function = reinterpret_cast<_NativeFunction>(memory);
+        return true;
+#else
+        (void)program;
+        (void)initialAngleUnit;
+        return false;
+#endif
+    }
+
+    void JitFunction::_release()
+    {
+#ifdef RPN_HAS_JIT
+        if (_memory != nullptr)
+            munmap(_memory, _mappedSize);
+#endif
+        _memory = nullptr;
+        _mappedSize = _codeSize = 0;
+        _function = nullptr;
+    }
+
+
+    //
+    // JitCache
+    //
+    static uint64_t _hashProgram(const Program& program, AngleUnitType initialAngleUnit)
+    {
+        // FNV-1a
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](uint64_t v) {
+            for (int i = 0; i < 8; ++i)
+            {
+                hash ^= (v >> (8 * i)) & 0xff;
+                hash *= 1099511628211ull;
+            }
+        };
+        mix((uint64_t)initialAngleUnit);
+        for (const Instruction& instruction: program.Code)
+            mix(((uint64_t)instruction.Op << 32) | instruction.Arg);
+        for (double v: program.Constants)
+        {
+            uint64_t bits;
+            memcpy(&bits, &v, sizeof(bits));
+            mix(bits);
+        }
+        return hash;
+    }
+
+    static bool _isSameProgram(const Program& a, const Program& b)
+    {
+        if (a.Code.size() != b.Code.size() || a.Constants.size() != b.Constants.size())
+            return false;
+        for (size_t i = 0; i < a.Code.size(); ++i)
+            if (a.Code[i].Op != b.Code[i].Op || a.Code[i].Arg != b.Code[i].Arg)
+                return false;
+        return a.Constants.empty()
+            || memcmp(a.Constants.data(), b.Constants.data(), a.Constants.size() * sizeof(double)) == 0;
+    }
+
+    const JitFunction* JitCache::Find(const Program& program, AngleUnitType initialAngleUnit)
+    {
+        uint64_t hash = _hashProgram(program, initialAngleUnit);
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto range = _entries.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            const _Entry& entry = it->second;
+            if (entry.InitialAngleUnit == initialAngleUnit && _isSameProgram(entry.ProgramCopy, program))
+                return entry.Function->is_compiled() ? entry.Function.get() : nullptr;
+        }
+        if (_entries.size() >= Capacity)
+            return nullptr;
+
+        _Entry entry{program, initialAngleUnit, std::make_unique<JitFunction>()};
+        entry.Function->Compile(program, initialAngleUnit);
+        const JitFunction* function = entry.Function->is_compiled() ? entry.Function.get() : nullptr;
+        _entries.emplace(hash, std::move(entry));
+        return function;
+    }
+
+    JitCache& SharedJitCache()
+    {
+        static JitCache cache;
+        return cache;
+    }
+
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include "rpn_bytecode.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+
+namespace RpnCalculator
+{
+    // Native code tier for the programs which are run over many rows (BatchEvaluator::UseJit, rpn_cli --program --jit):
+    // a verified program is translated into x86-64 SSE2 code, written into a buffer which is mapped writable, then
+    // switched to read + execute.
+    //
+    // The native code follows the contract of BatchEvaluator::Evaluate (the stack starts empty for each row, the
+    // output is the top of the stack, rows with a division by zero give NaN), but it computes like VirtualMachine:
+    // one row at a time, with libm for the transcendental functions. Its results are bit for bit those of
+    // VirtualMachine and CalculatorState (rpn_cli --verify checks it), not those of the vectorized kernels.
+    //
+    // Since a program has no branches, the stack depth before each instruction is known when compiling: each stack
+    // level is given an xmm register, so that Swap, Drop and Roll only rename registers. The registers are saved
+    // around the libm calls. The angle unit is known as well, so that no conversion is made in Rad.
+    //
+    // Compile() fails when the program cannot be translated, and the caller falls back to the interpreter:
+    //     * on other platforms than Linux x86-64, or if the system forbids executable memory
+    //     * if the program needs values on the stack when it starts, or leaves it empty (errors which the
+    //       interpreter reports)
+    //     * if the stack grows deeper than JitMaxDepth values (the number of xmm registers available)
+    class JitFunction
+    {
+    public:
+        static constexpr size_t JitMaxDepth = 14;
+
+        static bool IsSupported();
+
+        JitFunction() = default;
+        ~JitFunction();
+        JitFunction(const JitFunction&) = delete;
+        JitFunction& operator=(const JitFunction&) = delete;
+
+        // initialAngleUnit: the angle unit when each row starts (BatchEvaluator::AngleUnit)
+        bool Compile(const Program& program, AngleUnitType initialAngleUnit);
+        bool is_compiled() const { return _function != nullptr; }
+        size_t code_size() const { return _codeSize; }
+
+        void Evaluate(const double* inputs, double* outputs, size_t count) const { _function(inputs, outputs, count); }
+
+    private:
+        using _NativeFunction = void (*)(const double* inputs, double* outputs, size_t count);
+
+        void _release();
+
+        void* _memory = nullptr;
+        size_t _mappedSize = 0, _codeSize = 0;
+        _NativeFunction _function = nullptr;
+    };
+
+
+    // Compiled functions, keyed by the hash of the program and of its initial angle unit: each program is compiled
+    // once, when it is first evaluated. Programs which cannot be compiled are cached too (as nullptr), so that the
+    // fallback costs one lookup. Thread safe.
+    class JitCache
+    {
+    public:
+        static constexpr size_t Capacity = 1024; // programs past it are not compiled
+
+        // Returns nullptr if the program cannot be compiled: the caller then runs the interpreter
+        const JitFunction* Find(const Program& program, AngleUnitType initialAngleUnit);
+
+    private:
+        struct _Entry
+        {
+            Program ProgramCopy;   // to tell programs apart when their hashes collide
+            AngleUnitType InitialAngleUnit;
+            std::unique_ptr<JitFunction> Function;
+        };
+
+        std::mutex _mutex;
+        std::unordered_multimap<uint64_t, _Entry> _entries;
+    };
+
+    // The cache shared by the BatchEvaluators (the compiled functions live until the end of the process)
+    JitCache& SharedJitCache();
+
+}
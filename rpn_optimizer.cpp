@@ -0,0 +1,265 @@
+#include "rpn_optimizer.h"
+#include <algorithm>
+#include <cstdint>
+
+
+namespace RpnCalculator
+{
+    static bool _isBinaryOperator(Instr op)
+    {
+        return op >= Instr::Add && op <= Instr::Power;
+    }
+
+    static bool _isUnaryOperator(Instr op)
+    {
+        return op >= Instr::Sin && op <= Instr::ToGrad;
+    }
+
+    static bool _dependsOnAngleUnit(Instr op)
+    {
+        return (op >= Instr::Sin && op <= Instr::ArcTan) || (op >= Instr::ToDeg && op <= Instr::ToGrad);
+    }
+
+    static bool _isAngleUnitSetter(Instr op)
+    {
+        return op >= Instr::SetDeg && op <= Instr::SetGrad;
+    }
+
+    static AngleUnitType _angleUnitSetBy(Instr op)
+    {
+        if (op == Instr::SetRad)
+            return AngleUnitType::Rad;
+        if (op == Instr::SetGrad)
+            return AngleUnitType::Grad;
+        return AngleUnitType::Deg;
+    }
+
+    // Pushes a value, without reading the stack nor changing any register
+    static bool _isPurePush(Instr op)
+    {
+        return op == Instr::PushConstant || op == Instr::PushInput || op == Instr::Recall;
+    }
+
+
+    void PeepholeOptimizer::Optimize(Program& program, std::optional<AngleUnitType> initialAngleUnit)
+    {
+        ExpandSuperinstructions(program);
+        _code.clear();
+        _constants.clear();
+        _states.clear();
+        _states.push_back({0, initialAngleUnit});
+
+        for (const Instruction& instruction: program.Code)
+        {
+            if (instruction.Op == Instr::PushConstant)
+                _emitConstant(program.Constants[instruction.Arg]);
+            else
+                _emit(instruction);
+            while (_rewriteTail())
+                ;
+        }
+
+        // Keep only the constants which are still used, in the order of the code
+        std::vector<uint32_t> newIndexes(_constants.size(), UINT32_MAX);
+        program.Constants.clear();
+        for (Instruction& instruction: _code)
+        {
+            if (instruction.Op != Instr::PushConstant)
+                continue;
+            if (newIndexes[instruction.Arg] == UINT32_MAX)
+            {
+                newIndexes[instruction.Arg] = (uint32_t)program.Constants.size();
+                program.Constants.push_back(_constants[instruction.Arg]);
+            }
+            instruction.Arg = newIndexes[instruction.Arg];
+        }
+        program.Code = _code;
+        FuseSuperinstructions(program);
+        // The rewrites keep the stack effect of the program, so it stays valid
+        std::string errorMessage;
+        VerifyProgram(program, errorMessage);
+    }
+
+    void PeepholeOptimizer::_emit(Instruction instruction)
+    {
+        State state = _states.back();
+        if (instruction.Op == Instr::Clear)
+            state.MinDepth = 0;
+        else
+        {
+            size_t nbRequired;
+            int depthChange;
+            GetStackEffect(instruction.Op, nbRequired, depthChange);
+            state.MinDepth = (size_t)((int)std::max(state.MinDepth, nbRequired) + depthChange);
+        }
+        if (_isAngleUnitSetter(instruction.Op))
+            state.AngleUnit = _angleUnitSetBy(instruction.Op);
+
+        _code.push_back(instruction);
+        _states.push_back(state);
+    }
+
+    void PeepholeOptimizer::_emitConstant(double v)
+    {
+        _emit({Instr::PushConstant, (uint32_t)_constants.size()});
+        _constants.push_back(v);
+    }
+
+    void PeepholeOptimizer::_pop(size_t count)
+    {
+        _code.resize(_code.size() - count);
+        _states.resize(_states.size() - count);
+    }
+
+    // Applies one rewrite to the last instructions of _code, if possible
+    bool PeepholeOptimizer::_rewriteTail()
+    {
+        size_t n = _code.size();
+        if (n == 0)
+            return false;
+        Instruction last = _fromEnd(0);
+        Instr previous = (n >= 2) ? _fromEnd(1).Op : Instr::Count;
+
+        // Constant folding
+        if (_isBinaryOperator(last.Op) && n >= 3 && previous == Instr::PushConstant
+            && _fromEnd(2).Op == Instr::PushConstant)
+        {
+            double operands[2] = { _constants[_fromEnd(2).Arg], _constants[_fromEnd(1).Arg] };
+            double result;
+            if (_fold(last.Op, operands, 2, result))
+            {
+                _pop(3);
+                _emitConstant(result);
+                return true;
+            }
+        }
+        if (_isUnaryOperator(last.Op) && previous == Instr::PushConstant)
+        {
+            double result;
+            if (_fold(last.Op, &_constants[_fromEnd(1).Arg], 1, result))
+            {
+                _pop(2);
+                _emitConstant(result);
+                return true;
+            }
+        }
+
+        switch (last.Op)
+        {
+            case Instr::Drop:
+                // "3 Drop", "Dup Drop"
+                if (n >= 2 && (_isPurePush(previous) || (previous == Instr::Dup && _stateBefore(1).MinDepth >= 1)))
+                {
+                    _pop(2);
+                    return true;
+                }
+                return false;
+            case Instr::Swap:
+                if (previous == Instr::Swap && _stateBefore(1).MinDepth >= 2)
+                {
+                    _pop(2);
+                    return true;
+                }
+                // "x 3 Swap" -> "3 x"
+                if (n >= 3 && _isPurePush(previous) && _isPurePush(_fromEnd(2).Op))
+                {
+                    Instruction first = _fromEnd(2), second = _fromEnd(1);
+                    _pop(3);
+                    _emit(second);
+                    _emit(first);
+                    return true;
+                }
+                return false;
+            case Instr::Negate:
+                if (previous == Instr::Negate && _stateBefore(1).MinDepth >= 1)
+                {
+                    _pop(2);
+                    return true;
+                }
+                return false;
+            case Instr::Multiply:
+                if (previous == Instr::Dup)
+                {
+                    _pop(2);
+                    _emit({Instr::Square, 0});
+                    return true;
+                }
+                return false;
+            case Instr::Dup:
+                // "3 Dup" -> "3 3" (which may then be folded)
+                if (previous == Instr::PushConstant)
+                {
+                    Instruction constant = _fromEnd(1);
+                    _pop(1);
+                    _emit(constant);
+                    return true;
+                }
+                return false;
+            case Instr::Clear:
+                if (n >= 2 && (_isPurePush(previous) || previous == Instr::Clear))
+                {
+                    _pop(2);
+                    _emit(last);
+                    return true;
+                }
+                return false;
+            case Instr::SetDeg:
+            case Instr::SetRad:
+            case Instr::SetGrad:
+                if (_isAngleUnitSetter(previous))
+                {
+                    _pop(2);
+                    _emit(last);
+                    return true;
+                }
+                if (_stateBefore(0).AngleUnit == _angleUnitSetBy(last.Op))
+                {
+                    _pop(1);
+                    return true;
+                }
+                return false;
+            case Instr::ToRad:
+                if (_stateBefore(0).AngleUnit == AngleUnitType::Rad && _stateBefore(0).MinDepth >= 1)
+                {
+                    _pop(1);
+                    return true;
+                }
+                return false;
+            default:
+                return false;
+        }
+    }
+
+    // Computes the result of an operator on constant operands, with the VirtualMachine.
+    // Returns false if it cannot be folded (unknown angle unit, or the operator fails, e.g. a division by zero).
+    bool PeepholeOptimizer::_fold(Instr op, const double* operands, size_t nbOperands, double& result)
+    {
+        std::optional<AngleUnitType> angleUnit = _stateBefore(0).AngleUnit;
+        if (_dependsOnAngleUnit(op) && !angleUnit.has_value())
+            return false;
+
+        _foldProgram.clear();
+        for (size_t i = 0; i < nbOperands; ++i)
+        {
+            _foldProgram.Code.push_back({Instr::PushConstant, (uint32_t)i});
+            _foldProgram.Constants.push_back(operands[i]);
+        }
+        _foldProgram.Code.push_back({op, 0});
+        _foldProgram.MaxGrowth = nbOperands;
+
+        _foldVm.AngleUnit = angleUnit.value_or(AngleUnitType::Deg);
+        _foldStack.assign(nullptr, nullptr);
+        if (!_foldVm.Run(_foldProgram, _foldStack) || _foldStack.size() != 1)
+            return false;
+        result = _foldStack[0];
+        return true;
+    }
+
+
+    void OptimizeProgram(Program& program, std::optional<AngleUnitType> initialAngleUnit)
+    {
+        PeepholeOptimizer optimizer;
+        optimizer.Optimize(program, initialAngleUnit);
+    }
+
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "rpn_bytecode.h"
+#include <optional>
+#include <vector>
+
+
+namespace RpnCalculator
+{
+    // Peephole optimizer for compiled programs: rewrites a Program into a shorter one, whose results, errors
+    // and registers are bit for bit identical to those of the original program, on any stack.
+    //
+    // The superinstructions are expanded before the rewrites, and fused again after them.
+    // Rewrites (applied repeatedly on the end of the optimized code, as it grows):
+    //     * no-ops: "Swap Swap", "+/- +/-", "Dup Drop", "3 Drop", "Deg Rad" (-> "Rad"), "Rad" when already in Rad,
+    //       "To Rad" in Rad (only when the values they need are known to be on the stack, so that no
+    //       "Not enough values on the stack" error is lost)
+    //     * fusions: "Dup *" -> "x^2", "3 Dup" -> "3 3", "x 3 Swap" -> "3 x", "3 Clear" -> "Clear"
+    //     * constant folding: "Pi 180 /" -> 0.0174..., "2 sqrt" -> 1.414... The folded values are computed by the
+    //       VirtualMachine itself (hence with the same libm). Trigonometric and angle conversion operators are only
+    //       folded when the angle unit is known, and a division by zero is never folded.
+    //
+    // Sequences which are only approximately no-ops are left as they are: "1/x 1/x" or "sin sin^-1" do not give
+    // back their input for every value (rounding, or the range of sin^-1).
+    //
+    // Optimizing costs about as much as running the program once: it pays off for programs which are run many
+    // times (BatchEvaluator, rpn_cli --program), not for the one-shot lines of rpn_cli --lines.
+    class PeepholeOptimizer
+    {
+    public:
+        // initialAngleUnit: the angle unit when the program starts, if the caller knows it
+        // (e.g. rpn_cli --program, whose program starts in Deg)
+        void Optimize(Program& program, std::optional<AngleUnitType> initialAngleUnit = std::nullopt);
+
+    private:
+        // What is known after each instruction of _code
+        struct State
+        {
+            size_t MinDepth = 0;   // lower bound of the stack depth (if the program did not fail before)
+            std::optional<AngleUnitType> AngleUnit;
+        };
+
+        void _emit(Instruction instruction);
+        void _emitConstant(double v);
+        void _pop(size_t count);
+        bool _rewriteTail();
+        bool _fold(Instr op, const double* operands, size_t nbOperands, double& result);
+
+        const Instruction& _fromEnd(size_t i) const { return _code[_code.size() - 1 - i]; }
+        // State before the i-th instruction from the end
+        const State& _stateBefore(size_t i) const { return _states[_states.size() - 2 - i]; }
+
+        std::vector<Instruction> _code;
+        std::vector<State> _states;        // _states[k + 1]: state after _code[k]
+        std::vector<double> _constants;
+
+        Program _foldProgram;
+        VirtualMachine _foldVm;
+        CalculatorStack _foldStack;
+    };
+
+    // Optimizes a program once (see PeepholeOptimizer)
+    void OptimizeProgram(Program& program, std::optional<AngleUnitType> initialAngleUnit = std::nullopt);
+
+}
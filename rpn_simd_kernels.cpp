@@ -0,0 +1,532 @@
+#include "rpn_simd_kernels.h"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+
+// Runtime dispatch: GCC compiles one clone of each kernel per instruction set,
+// and selects the best one for the CPU when the library is loaded (ifunc).
+// The helpers must be forced inline: GCC does not inline a default-target function into a clone otherwise.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+    #define RPN_SIMD_DISPATCH __attribute__((target_clones("default", "avx2", "avx512f")))
+    #define RPN_SIMD_HAS_DISPATCH
+#else
+    #define RPN_SIMD_DISPATCH
+#endif
+#if defined(__GNUC__)
+    #define RPN_SIMD_INLINE static inline __attribute__((always_inline))
+#else
+    #define RPN_SIMD_INLINE static inline
+#endif
+
+
+namespace RpnCalculator
+{
+namespace Kernels
+{
+    //
+    // Branch-free building blocks (the compiler inlines them into the kernels loops, and vectorizes them)
+    //
+    RPN_SIMD_INLINE uint64_t _bits(double v) { uint64_t u; memcpy(&u, &v, sizeof(u)); return u; }
+    RPN_SIMD_INLINE double _fromBits(uint64_t u) { double v; memcpy(&v, &u, sizeof(v)); return v; }
+
+    static const double kShifter = 6755399441055744.;  // 1.5 * 2^52: (x + kShifter) - kShifter rounds x to an integer
+
+    // Dekker's product: a * b == hi + lo exactly
+    RPN_SIMD_INLINE void _twoProduct(double a, double b, double& hi, double& lo)
+    {
+        const double split = 134217729.; // 2^27 + 1
+        double ca = split * a, cb = split * b;
+        double aHi = ca - (ca - a), aLo = a - aHi;
+        double bHi = cb - (cb - b), bLo = b - bHi;
+        hi = a * b;
+        lo = ((aHi * bHi - hi) + aHi * bLo + aLo * bHi) + aLo * bLo;
+    }
+
+    // 2^k, for an integral k (given as a double) in [-1022, 1023]
+    RPN_SIMD_INLINE double _pow2(double k)
+    {
+        return _fromBits((_bits(k + kShifter) - _bits(kShifter) + 1023) << 52);
+    }
+
+    // e^(x + xLo), where xLo is a small correction to x. Results: inf above ~709.78, and 0 below ~-745.13
+    RPN_SIMD_INLINE double _expDD(double x, double xLo)
+    {
+        const double log2e = 1.4426950408889634;
+        const double ln2Hi = 6.93147180369123816490e-01; // 32 significant bits: k * ln2Hi is exact
+        const double ln2Lo = 1.90821492927058770002e-10;
+
+        double xc = x < -746. ? -746. : (x > 710. ? 710. : x);
+        double k = (xc * log2e + kShifter) - kShifter;
+        double r = (xc - k * ln2Hi) - k * ln2Lo + xLo;  // |r| <= 0.35
+
+        // e^r - 1 = r + r^2 * p(r): Taylor series up to r^13
+        double p = 1. / 6227020800.;
+        p = p * r + 1. / 479001600.;
+        p = p * r + 1. / 39916800.;
+        p = p * r + 1. / 3628800.;
+        p = p * r + 1. / 362880.;
+        p = p * r + 1. / 40320.;
+        p = p * r + 1. / 5040.;
+        p = p * r + 1. / 720.;
+        p = p * r + 1. / 120.;
+        p = p * r + 1. / 24.;
+        p = p * r + 1. / 6.;
+        p = p * r + 0.5;
+        double y = 1. + (r + (r * r) * p);
+
+        // Scale by 2^k in two steps, so that subnormal results are rounded once, and large ones overflow to inf
+        double k1 = (k * 0.5 + kShifter) - kShifter;
+        double k2 = k - k1;
+        return y * _pow2(k1) * _pow2(k2);
+    }
+
+    // ln(x) == hi + lo, for a finite x > 0. isPrecise: ~2^-64 relative precision instead of ~2^-55, for y^x (whose
+    // result multiplies the error of ln(y) by x ln(y), up to ~700), at the cost of ~50% more time
+    template<bool isPrecise>
+    RPN_SIMD_INLINE double _logDD(double x, double& lo)
+    {
+        const double ln2Hi = 6.93147180369123816490e-01;
+        const double ln2Lo = 1.90821492927058770002e-10;
+
+        // Subnormal inputs are scaled by 2^54
+        bool isSubnormal = x < 2.2250738585072014e-308;
+        double xs = isSubnormal ? x * 18014398509481984. : x;
+
+        // x = 2^k * z, with z in [sqrt(1/2), sqrt(2))
+        const uint64_t offset = 0x3fe6a09e667f3bcdULL;
+        uint64_t u = _bits(xs);
+        uint64_t t = u - offset;
+        uint64_t kBits = ((t >> 52) & 0xfff) ^ 0x800; // k + 2048
+        double k = _fromBits(0x4330000000000000ULL | kBits) - (4503599627370496. + 2048.);
+        k = isSubnormal ? k - 54. : k;
+        double z = _fromBits(u - (t & (0xfffULL << 52)));
+
+        // ln(z) = 2 atanh(s), with s = f / (2 + f), computed with extra precision (s + sLo)
+        double f = z - 1.;
+        double d = 2. + f;
+        double dLo = (2. - d) + f;
+        double s = f / d;
+        double sdHi, sdLo;
+        _twoProduct(s, d, sdHi, sdLo);
+        double sLo = (((f - sdHi) - sdLo) - s * dLo) / d;
+
+        // 2 atanh(s) = 2s + s^3 * q(s^2), |s| <= 0.172
+        double hi, tail;
+        if constexpr (isPrecise)
+        {
+            // Taylor series up to s^27. s^3 * q is computed as a double-double (s^2 and s^3 with Dekker's products,
+            // q = 2/3 + s^2 * q2 with the low part of 2/3), and the correction for sLo is
+            // 2 sLo / (1 - s^2) ~= 2 sLo (1 + s^2 + s^4)
+            double s2Hi, s2Lo;
+            _twoProduct(s, s, s2Hi, s2Lo);
+            double s3Hi, s3Lo;
+            _twoProduct(s, s2Hi, s3Hi, s3Lo);
+            s3Lo += s * s2Lo;
+            double q2 = 2. / 27.;
+            q2 = q2 * s2Hi + 2. / 25.;
+            q2 = q2 * s2Hi + 2. / 23.;
+            q2 = q2 * s2Hi + 2. / 21.;
+            q2 = q2 * s2Hi + 2. / 19.;
+            q2 = q2 * s2Hi + 2. / 17.;
+            q2 = q2 * s2Hi + 2. / 15.;
+            q2 = q2 * s2Hi + 2. / 13.;
+            q2 = q2 * s2Hi + 2. / 11.;
+            q2 = q2 * s2Hi + 2. / 9.;
+            q2 = q2 * s2Hi + 2. / 7.;
+            q2 = q2 * s2Hi + 2. / 5.;
+            const double twoThirdsHi = 6.66666666666666629659e-01, twoThirdsLo = 3.70074341541718826790e-17;
+            double qHi = twoThirdsHi + s2Hi * q2;
+            double qLo = (twoThirdsHi - qHi) + s2Hi * q2 + twoThirdsLo;
+            double rHi, rLo;
+            _twoProduct(s3Hi, qHi, rHi, rLo);
+            rLo += s3Hi * qLo + s3Lo * qHi;
+
+            // 2s + r: 2s is exact, and |r| < |2s|
+            hi = 2. * s + rHi;
+            tail = (2. * s - hi) + rHi + rLo + 2. * sLo * (1. + s2Hi * (1. + s2Hi));
+        }
+        else
+        {
+            // Taylor series up to s^21
+            double s2 = s * s;
+            double q = 2. / 21.;
+            q = q * s2 + 2. / 19.;
+            q = q * s2 + 2. / 17.;
+            q = q * s2 + 2. / 15.;
+            q = q * s2 + 2. / 13.;
+            q = q * s2 + 2. / 11.;
+            q = q * s2 + 2. / 9.;
+            q = q * s2 + 2. / 7.;
+            q = q * s2 + 2. / 5.;
+            q = q * s2 + 2. / 3.;
+            hi = 2. * s;
+            tail = 2. * sLo + s * s2 * q;
+        }
+
+        // + k * ln2
+        double kHi = k * ln2Hi;
+        double sum = kHi + hi;
+        double bv = sum - kHi;
+        double error = (kHi - (sum - bv)) + (hi - bv);
+        double sumLo = error + tail + k * ln2Lo;
+        double result = sum + sumLo;
+        lo = sumLo - (result - sum);
+        return result;
+    }
+
+    // fdlibm kernels: sin(x + y) and cos(x + y) for |x| <= pi/4, y being a small correction to x
+    RPN_SIMD_INLINE double _kernelSin(double x, double y)
+    {
+        const double S1 = -1.66666666666666324348e-01, S2 = 8.33333333332248946124e-03,
+                     S3 = -1.98412698298579493134e-04, S4 = 2.75573137070700676789e-06,
+                     S5 = -2.50507602534068634195e-08, S6 = 1.58969099521155010221e-10;
+        double z = x * x;
+        double v = z * x;
+        double r = S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)));
+        return x - ((z * (0.5 * y - v * r) - y) - v * S1);
+    }
+
+    RPN_SIMD_INLINE double _kernelCos(double x, double y)
+    {
+        const double C1 = 4.16666666666666019037e-02, C2 = -1.38888888888741095749e-03,
+                     C3 = 2.48015872894767294178e-05, C4 = -2.75573143513906633035e-07,
+                     C5 = 2.08757232129817482790e-09, C6 = -1.13596475577881948265e-11;
+        double z = x * x;
+        double r = z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6)))));
+        double hz = 0.5 * z;
+        double w = 1. - hz;
+        return w + (((1. - w) - hz) + (z * r - x * y));
+    }
+
+    // Largest argument handled by the fast trigonometric reduction (k = x / (pi/2) fits in 20 bits)
+    static const double kMaxTrigArgument = 823549.;
+
+    // Below 2^-27, sin(x) and tan(x) round to x: such arguments are returned as is (the reduction would lose the
+    // sign of -0.)
+    static const double kTinyTrigArgument = 7.450580596923828125e-9;
+
+    // x = k * pi/2 + (r + rLo), with |r| <= pi/4; returns k mod 4
+    RPN_SIMD_INLINE uint64_t _reducePio2(double x, double& r, double& rLo)
+    {
+        const double invPio2 = 6.36619772367581382433e-01;
+        const double pio2_1 = 1.57079632673412561417e+00;  // first 33 bits of pi/2
+        const double pio2_2 = 6.07710050630396597660e-11;  // next 33 bits
+        const double pio2_3 = 2.02226624871116645580e-21;  // next 33 bits
+        const double pio2_3t = 8.47842766036889956997e-32; // pi/2 - (pio2_1 + pio2_2 + pio2_3)
+
+        double kShifted = x * invPio2 + kShifter;
+        double k = kShifted - kShifter;
+        double y = x - k * pio2_1;   // exact
+        double w = k * pio2_2;       // exact
+        double s = y - w;            // TwoSum
+        double bv = s - y;
+        double sLo = (y - (s - bv)) + (-w - bv);
+        sLo = sLo - k * pio2_3 - k * pio2_3t;
+        r = s + sLo;
+        rLo = sLo - (r - s);
+        return _bits(kShifted) & 3;
+    }
+
+    RPN_SIMD_INLINE double _flipSignIf(double v, uint64_t condition)
+    {
+        return _fromBits(_bits(v) ^ ((condition & 1) << 63));
+    }
+
+
+    //
+    // Kernels
+    //
+    const char* InstructionSet()
+    {
+#ifdef RPN_SIMD_HAS_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return "avx512";
+        if (__builtin_cpu_supports("avx2"))
+            return "avx2";
+        return "sse2";
+#else
+        return "portable";
+#endif
+    }
+
+    RPN_SIMD_DISPATCH void Add(const double* a, const double* b, double* out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = a[i] + b[i];
+    }
+
+    RPN_SIMD_DISPATCH void Subtract(const double* a, const double* b, double* out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = a[i] - b[i];
+    }
+
+    RPN_SIMD_DISPATCH void Multiply(const double* a, const double* b, double* out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = a[i] * b[i];
+    }
+
+    RPN_SIMD_DISPATCH void Divide(const double* a, const double* b, double* out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = a[i] / b[i];
+    }
+
+    RPN_SIMD_DISPATCH void Sqrt(const double* in, double* out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = std::sqrt(in[i]);
+    }
+
+    RPN_SIMD_DISPATCH void Floor(const double* in, double* out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = std::floor(in[i]);
+    }
+
+    RPN_SIMD_DISPATCH void Exp(const double* in, double* out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = _expDD(in[i], 0.);
+        for (size_t i = 0; i < n; ++i)
+            if (!(std::fabs(in[i]) <= 700.))
+                out[i] = std::exp(in[i]);
+    }
+
+    RPN_SIMD_DISPATCH void Ln(const double* in, double* out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            double lo;
+            out[i] = _logDD<false>(in[i], lo);
+        }
+        for (size_t i = 0; i < n; ++i)
+            if (!(in[i] > 0. && in[i] <= std::numeric_limits<double>::max()))
+                out[i] = std::log(in[i]);
+    }
+
+    RPN_SIMD_DISPATCH void Log10(const double* in, double* out, size_t n)
+    {
+        const double invLn10Hi = 4.34294481903251816668e-01, invLn10Lo = 1.09831965021676510e-17;
+        for (size_t i = 0; i < n; ++i)
+        {
+            double lo;
+            double hi = _logDD<false>(in[i], lo);
+            double pHi, pLo;
+            _twoProduct(hi, invLn10Hi, pHi, pLo);
+            out[i] = pHi + (pLo + lo * invLn10Hi + hi * invLn10Lo);
+        }
+        for (size_t i = 0; i < n; ++i)
+            if (!(in[i] > 0. && in[i] <= std::numeric_limits<double>::max()))
+                out[i] = std::log10(in[i]);
+    }
+
+    RPN_SIMD_DISPATCH void Pow10(const double* in, double* out, size_t n)
+    {
+        const double ln10Hi = 2.30258509299404590109e+00, ln10Lo = -2.17075622338224935e-16;
+        for (size_t i = 0; i < n; ++i)
+        {
+            double xc = std::fabs(in[i]) <= 300. ? in[i] : 0.; // avoid overflows in _twoProduct
+            double pHi, pLo;
+            _twoProduct(xc, ln10Hi, pHi, pLo);
+            out[i] = _expDD(pHi, pLo + xc * ln10Lo);
+        }
+        for (size_t i = 0; i < n; ++i)
+            if (!(std::fabs(in[i]) <= 300.))
+                out[i] = std::pow(10., in[i]);
+    }
+
+    RPN_SIMD_DISPATCH void Power(const double* a, const double* b, double* out, size_t n)
+    {
+        // a^b = e^(b ln(a)), with ln(a) and the product computed with extra precision. The results of the fast path
+        // are positive: the other values are marked with -1, then computed with libm (a NaN b ln(a) marks the
+        // arguments outside of the fast path, so that a single condition selects the result and the loop vectorizes)
+        for (size_t i = 0; i < n; ++i)
+        {
+            bool isFast = a[i] > 0. && a[i] <= std::numeric_limits<double>::max() && std::fabs(b[i]) <= 1e300;
+            double ac = isFast ? a[i] : 1.;
+            double bc = isFast ? b[i] : std::numeric_limits<double>::quiet_NaN();
+            double logLo;
+            double logHi = _logDD<true>(ac, logLo);
+            double pHi, pLo;
+            _twoProduct(bc, logHi, pHi, pLo);
+            pLo += bc * logLo;
+            bool isInRange = std::fabs(pHi) <= 700.;
+            double pc = isInRange ? pHi : 0.;
+            double v = _expDD(pc, pLo);
+            out[i] = isInRange ? v : -1.;
+        }
+        for (size_t i = 0; i < n; ++i)
+            if (out[i] < 0.)
+                out[i] = std::pow(a[i], b[i]);
+    }
+
+    RPN_SIMD_DISPATCH void Sin(const double* in, double* out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            double x = std::fabs(in[i]) <= kMaxTrigArgument ? in[i] : 0.;
+            double r, rLo;
+            uint64_t quadrant = _reducePio2(x, r, rLo);
+            double s = _kernelSin(r, rLo), c = _kernelCos(r, rLo);
+            double v = (quadrant & 1) ? c : s;
+            v = _flipSignIf(v, quadrant >> 1);
+            out[i] = std::fabs(in[i]) < kTinyTrigArgument ? in[i] : v;
+        }
+        for (size_t i = 0; i < n; ++i)
+            if (!(std::fabs(in[i]) <= kMaxTrigArgument))
+                out[i] = std::sin(in[i]);
+    }
+
+    RPN_SIMD_DISPATCH void Cos(const double* in, double* out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            double x = std::fabs(in[i]) <= kMaxTrigArgument ? in[i] : 0.;
+            double r, rLo;
+            uint64_t quadrant = _reducePio2(x, r, rLo);
+            double s = _kernelSin(r, rLo), c = _kernelCos(r, rLo);
+            double v = (quadrant & 1) ? s : c;
+            out[i] = _flipSignIf(v, ((quadrant + 1) >> 1));
+        }
+        for (size_t i = 0; i < n; ++i)
+            if (!(std::fabs(in[i]) <= kMaxTrigArgument))
+                out[i] = std::cos(in[i]);
+    }
+
+    RPN_SIMD_DISPATCH void Tan(const double* in, double* out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            double x = std::fabs(in[i]) <= kMaxTrigArgument ? in[i] : 0.;
+            double r, rLo;
+            uint64_t quadrant = _reducePio2(x, r, rLo);
+            double s = _kernelSin(r, rLo), c = _kernelCos(r, rLo);
+            double v = (quadrant & 1) ? -c / s : s / c;
+            out[i] = std::fabs(in[i]) < kTinyTrigArgument ? in[i] : v;
+        }
+        for (size_t i = 0; i < n; ++i)
+            if (!(std::fabs(in[i]) <= kMaxTrigArgument))
+                out[i] = std::tan(in[i]);
+    }
+
+
+    //
+    // Reductions
+    //
+    static const size_t kNbLanes = 8;
+    static const size_t kPairwiseBlockSize = 256;
+
+    // Sum of term(x) over a block, with one accumulator per lane (the lanes are combined pairwise)
+    template<typename Term>
+    RPN_SIMD_INLINE double _blockSum(const double* in, size_t n, Term term)
+    {
+        double lanes[kNbLanes] = {};
+        size_t i = 0;
+        for (; i + kNbLanes <= n; i += kNbLanes)
+            for (size_t j = 0; j < kNbLanes; ++j)
+                lanes[j] += term(in[i + j]);
+        double sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+        for (; i < n; ++i)
+            sum += term(in[i]);
+        return sum;
+    }
+
+    // Pairwise sum of the block sums, without recursion: the partial sums form a binary counter, where the sum of
+    // the block k is added to the partial sums of the levels given by the trailing zeros of k + 1
+    template<typename Term>
+    RPN_SIMD_INLINE double _pairwiseSum(const double* in, size_t n, Term term)
+    {
+        double partials[64];
+        size_t nbPartials = 0, nbBlocks = 0;
+        for (size_t start = 0; start < n; start += kPairwiseBlockSize)
+        {
+            size_t count = (n - start < kPairwiseBlockSize) ? n - start : kPairwiseBlockSize;
+            double sum = _blockSum(in + start, count, term);
+            for (size_t k = ++nbBlocks; (k & 1) == 0; k >>= 1)
+                sum = partials[--nbPartials] + sum;
+            partials[nbPartials++] = sum;
+        }
+        double sum = 0.;
+        while (nbPartials > 0)
+            sum = partials[--nbPartials] + sum;
+        return sum;
+    }
+
+    RPN_SIMD_DISPATCH double Sum(const double* in, size_t n)
+    {
+        return _pairwiseSum(in, n, [](double x) { return x; });
+    }
+
+    RPN_SIMD_DISPATCH double SumOfSquaredDeviations(const double* in, size_t n, double mean)
+    {
+        return _pairwiseSum(in, n, [mean](double x) { double d = x - mean; return d * d; });
+    }
+
+    // Each multiplication adds a relative error of half an ulp, whatever the order of the factors: unlike the sums,
+    // products need no pairwise scheme
+    RPN_SIMD_DISPATCH double Product(const double* in, size_t n)
+    {
+        double lanes[kNbLanes] = {1., 1., 1., 1., 1., 1., 1., 1.};
+        size_t i = 0;
+        for (; i + kNbLanes <= n; i += kNbLanes)
+            for (size_t j = 0; j < kNbLanes; ++j)
+                lanes[j] *= in[i + j];
+        double product = ((lanes[0] * lanes[1]) * (lanes[2] * lanes[3])) * ((lanes[4] * lanes[5]) * (lanes[6] * lanes[7]));
+        for (; i < n; ++i)
+            product *= in[i];
+        return product;
+    }
+
+    // Minimum (isMax == false) or maximum of the values. The comparisons skip the NaN (as minpd / maxpd do, so that
+    // the selects vectorize): the NaN are kept apart, in nans. GCC vectorizes the selects over 32 lanes, not over 8
+    static const size_t kNbExtremumLanes = 32;
+
+    template<bool isMax>
+    RPN_SIMD_INLINE double _extremum(const double* in, size_t n)
+    {
+        if (n == 0)
+            return std::numeric_limits<double>::quiet_NaN();
+        double lanes[kNbExtremumLanes], nans[kNbExtremumLanes] = {};
+        for (size_t j = 0; j < kNbExtremumLanes; ++j)
+            lanes[j] = in[0];
+        size_t i = 0;
+        for (; i + kNbExtremumLanes <= n; i += kNbExtremumLanes)
+        {
+            for (size_t j = 0; j < kNbExtremumLanes; ++j)
+            {
+                double x = in[i + j];
+                lanes[j] = (isMax ? x > lanes[j] : x < lanes[j]) ? x : lanes[j];
+                nans[j] = (x != x) ? x : nans[j];
+            }
+        }
+        double result = in[0], nan = 0.;
+        for (size_t j = 0; j < kNbExtremumLanes; ++j)
+        {
+            result = (isMax ? lanes[j] > result : lanes[j] < result) ? lanes[j] : result;
+            nan = (nans[j] != nans[j]) ? nans[j] : nan;
+        }
+        for (; i < n; ++i)
+        {
+            result = (isMax ? in[i] > result : in[i] < result) ? in[i] : result;
+            nan = (in[i] != in[i]) ? in[i] : nan;
+        }
+        return (nan != nan || result != result) ? std::numeric_limits<double>::quiet_NaN() : result;
+    }
+
+    RPN_SIMD_DISPATCH double Min(const double* in, size_t n)
+    {
+        return _extremum<false>(in, n);
+    }
+
+    RPN_SIMD_DISPATCH double Max(const double* in, size_t n)
+    {
+        return _extremum<true>(in, n);
+    }
+
+}
+}
@@ -0,0 +1,284 @@
+#pragma once
+#include "rpn_bytecode.h"
+#include <array>
+#include <cmath>
+#include <limits>
+#include <string_view>
+#include <utility>
+
+
+namespace RpnCalculator
+{
+    //
+    // Programs compiled at compile time
+    //
+    // Formulas which are fixed at build time can be written as RPN programs, without any parsing at run time:
+    //     C++17:   static constexpr char kFahrenheit[] = "x 1.8 * 32 +";
+    //              double f = StaticProgram<kFahrenheit>::Evaluate(celsius);
+    //     C++20:   double f = StaticRpn<"x 1.8 * 32 +">(celsius);
+    //
+    // The program is tokenized, parsed and verified in a constexpr context, with the same tokenizer, number parser
+    // (NumberInputParser) and OpCode translation (CompileOpCode) as CompileProgram(). Errors are compile errors
+    // (static_assert). Evaluate() is then straight-line code: the stack depth before each instruction is a compile
+    // time constant, so that the stack is a fixed-size array indexed by constants (which the compiler keeps in
+    // registers), and Swap, Clear, Deg / Rad / Grad cost nothing at run time.
+    //
+    // Evaluation follows the contract of BatchEvaluator::Evaluate: the stack starts empty, in Deg, with Sto at 0;
+    // the result is the top of the stack at the end, or NaN if a division by zero occurs. The operators compute like
+    // VirtualMachine (same expressions, same libm functions), so that the results are bit for bit identical.
+    //
+    // Numbers must be exactly convertible at compile time (NumberInputParser::fast_value: up to 15 significant
+    // digits, and a power of ten within 1E-22 .. 1E22), otherwise the program does not compile.
+
+    enum class StaticProgramError { None, InvalidNumber, InexactNumber, UnsupportedToken, NotEnoughValues, EmptyStack };
+
+    struct StaticInstruction
+    {
+        Instr  Op = Instr::PushConstant;
+        double Constant = 0.;   // PushConstant
+    };
+
+    // The compiled code, with what is known before each instruction
+    template<size_t MaxInstructions>
+    struct StaticCode
+    {
+        std::array<StaticInstruction, MaxInstructions> Instructions = {};
+        std::array<size_t, MaxInstructions> Depths = {};
+        std::array<AngleUnitType, MaxInstructions> AngleUnits = {};
+        size_t NbInstructions = 0;
+        size_t MaxDepth = 0, FinalDepth = 0;
+        StaticProgramError Error = StaticProgramError::None;
+    };
+
+
+    constexpr size_t _countStaticTokens(std::string_view source)
+    {
+        RpnTokenizer tokenizer(source);
+        std::string_view token;
+        size_t nbTokens = 0;
+        while (tokenizer.Next(token))
+            ++nbTokens;
+        return nbTokens;
+    }
+
+    // Same lookup as OpCodeFromLabel ('_' may be written for ' '), by a linear scan
+    constexpr OpCode _staticOpCodeFromLabel(std::string_view label)
+    {
+        for (size_t op = 1; op < (size_t)OpCode::Count; ++op)
+        {
+            std::string_view reference = gOpCodeLabels[op];
+            bool isSame = (label.size() == reference.size());
+            for (size_t i = 0; isSame && i < label.size(); ++i)
+                isSame = ((label[i] == '_') ? ' ' : label[i]) == reference[i];
+            if (isSame)
+                return (OpCode)op;
+        }
+        return OpCode::None;
+    }
+
+    // Each token gives at most one instruction: MaxInstructions is the number of tokens
+    template<size_t MaxInstructions>
+    constexpr StaticCode<MaxInstructions> _compileStatic(std::string_view source)
+    {
+        StaticCode<MaxInstructions> code;
+        RpnTokenizer tokenizer(source);
+        std::string_view token;
+        size_t depth = 0;
+        AngleUnitType angleUnit = AngleUnitType::Deg;
+        while (tokenizer.Next(token))
+        {
+            StaticInstruction instruction;
+            if (IsNumberToken(token))
+            {
+                NumberInputParser parser;
+                for (char c: token)
+                    parser.push(c);
+                if (parser.status() != NumberInputParser::Status::Valid)
+                {
+                    code.Error = StaticProgramError::InvalidNumber;
+                    return code;
+                }
+                if (!parser.fast_value().has_value())
+                {
+                    code.Error = StaticProgramError::InexactNumber;
+                    return code;
+                }
+                instruction = {Instr::PushConstant, parser.fast_value().value()};
+            }
+            else if (token == "x")
+                instruction.Op = Instr::PushInput;
+            else
+            {
+                CompiledOpCode compiled;
+                if (!CompileOpCode(_staticOpCodeFromLabel(token), compiled))
+                {
+                    code.Error = StaticProgramError::UnsupportedToken;
+                    return code;
+                }
+                if (compiled.Kind == CompiledOpCode::KindType::Nothing)
+                    continue;
+                instruction = {compiled.Op, compiled.Constant};
+            }
+
+            code.Instructions[code.NbInstructions] = instruction;
+            code.Depths[code.NbInstructions] = depth;
+            code.AngleUnits[code.NbInstructions] = angleUnit;
+            ++code.NbInstructions;
+
+            size_t nbRequired = 0;
+            int depthChange = 0;
+            GetStackEffect(instruction.Op, nbRequired, depthChange);
+            if (instruction.Op == Instr::Clear)
+                depth = 0;
+            else if (depth < nbRequired)
+            {
+                code.Error = StaticProgramError::NotEnoughValues;
+                return code;
+            }
+            else
+                depth = (size_t)((int)depth + depthChange);
+            code.MaxDepth = (depth > code.MaxDepth) ? depth : code.MaxDepth;
+
+            if (instruction.Op == Instr::SetDeg)
+                angleUnit = AngleUnitType::Deg;
+            else if (instruction.Op == Instr::SetRad)
+                angleUnit = AngleUnitType::Rad;
+            else if (instruction.Op == Instr::SetGrad)
+                angleUnit = AngleUnitType::Grad;
+        }
+        code.FinalDepth = depth;
+        if (depth == 0)
+            code.Error = StaticProgramError::EmptyStack;
+        return code;
+    }
+
+
+    // A program compiled at compile time. SourceT::Text() returns its source (see StaticProgram and StaticRpn).
+    template<typename SourceT>
+    struct BasicStaticProgram
+    {
+    private:
+        static constexpr size_t _nbTokens = _countStaticTokens(SourceT::Text());
+        static constexpr StaticCode<_nbTokens> _code = _compileStatic<_nbTokens>(SourceT::Text());
+
+        static_assert(_code.Error != StaticProgramError::InvalidNumber, "RPN program: invalid number");
+        static_assert(_code.Error != StaticProgramError::InexactNumber,
+                      "RPN program: a number cannot be converted exactly at compile time (use at most 15 significant "
+                      "digits, and a power of ten within 1E-22 .. 1E22)");
+        static_assert(_code.Error != StaticProgramError::UnsupportedToken, "RPN program: unsupported token");
+        static_assert(_code.Error != StaticProgramError::NotEnoughValues, "RPN program: not enough values on the stack");
+        static_assert(_code.Error != StaticProgramError::EmptyStack, "RPN program: the program leaves the stack empty");
+
+    public:
+        static constexpr size_t NbInstructions = _code.NbInstructions;
+        static constexpr size_t MaxDepth = _code.MaxDepth;
+
+        static double Evaluate(double x)
+        {
+            _State state;
+            _run(state, x, std::make_index_sequence<NbInstructions>());
+            return state.HasFailed ? std::numeric_limits<double>::quiet_NaN() : state.Stack[_code.FinalDepth - 1];
+        }
+        double operator()(double x) const { return Evaluate(x); }
+
+    private:
+        struct _State
+        {
+            double Stack[MaxDepth > 0 ? MaxDepth : 1] = {};
+            double StoredValue = 0.;
+            bool   HasFailed = false;
+        };
+
+        template<size_t... I>
+        static void _run(_State& state, double x, std::index_sequence<I...>)
+        {
+            (_step<I>(state, x), ...);
+        }
+
+        // One instruction, at a known depth and angle unit
+        template<size_t I>
+        static void _step(_State& state, double x)
+        {
+            constexpr Instr op = _code.Instructions[I].Op;
+            constexpr size_t d = _code.Depths[I];
+            constexpr AngleUnitType angleUnit = _code.AngleUnits[I];
+            double* s = state.Stack;
+
+            if constexpr (op == Instr::PushConstant) s[d] = _code.Instructions[I].Constant;
+            else if constexpr (op == Instr::PushInput) s[d] = x;
+
+            else if constexpr (op == Instr::Add) s[d - 2] = s[d - 2] + s[d - 1];
+            else if constexpr (op == Instr::Subtract) s[d - 2] = s[d - 2] - s[d - 1];
+            else if constexpr (op == Instr::Multiply) s[d - 2] = s[d - 2] * s[d - 1];
+            else if constexpr (op == Instr::Divide)
+            {
+                state.HasFailed |= (s[d - 1] == 0.);
+                s[d - 2] = s[d - 2] / s[d - 1];
+            }
+            else if constexpr (op == Instr::Power) s[d - 2] = pow(s[d - 2], s[d - 1]);
+
+            else if constexpr (op == Instr::Sin) s[d - 1] = sin(ToRadian<angleUnit>(s[d - 1]));
+            else if constexpr (op == Instr::Cos) s[d - 1] = cos(ToRadian<angleUnit>(s[d - 1]));
+            else if constexpr (op == Instr::Tan) s[d - 1] = tan(ToRadian<angleUnit>(s[d - 1]));
+            else if constexpr (op == Instr::ArcSin) s[d - 1] = FromRadian<angleUnit>(asin(s[d - 1]));
+            else if constexpr (op == Instr::ArcCos) s[d - 1] = FromRadian<angleUnit>(acos(s[d - 1]));
+            else if constexpr (op == Instr::ArcTan) s[d - 1] = FromRadian<angleUnit>(atan(s[d - 1]));
+            else if constexpr (op == Instr::Reciprocal) s[d - 1] = 1. / s[d - 1];
+            else if constexpr (op == Instr::Log10) s[d - 1] = log10(s[d - 1]);
+            else if constexpr (op == Instr::Ln) s[d - 1] = log(s[d - 1]);
+            else if constexpr (op == Instr::Pow10) s[d - 1] = pow(10., s[d - 1]);
+            else if constexpr (op == Instr::Exp) s[d - 1] = exp(s[d - 1]);
+            else if constexpr (op == Instr::Sqrt) s[d - 1] = sqrt(s[d - 1]);
+            else if constexpr (op == Instr::Square) s[d - 1] = s[d - 1] * s[d - 1];
+            else if constexpr (op == Instr::Floor) s[d - 1] = floor(s[d - 1]);
+            else if constexpr (op == Instr::Negate) s[d - 1] = -s[d - 1];
+            else if constexpr (op == Instr::ToDeg) s[d - 1] = FromRadian<AngleUnitType::Deg>(ToRadian<angleUnit>(s[d - 1]));
+            else if constexpr (op == Instr::ToRad) s[d - 1] = ToRadian<angleUnit>(s[d - 1]);
+            else if constexpr (op == Instr::ToGrad) s[d - 1] = FromRadian<AngleUnitType::Grad>(ToRadian<angleUnit>(s[d - 1]));
+
+            else if constexpr (op == Instr::Swap) std::swap(s[d - 1], s[d - 2]);
+            else if constexpr (op == Instr::Dup) s[d] = s[d - 1];
+            else if constexpr (op == Instr::Sto) state.StoredValue = s[d - 1];
+            else if constexpr (op == Instr::Recall) s[d] = state.StoredValue;
+            else if constexpr (op == Instr::Roll)
+            {
+                // the top value goes to the bottom
+                double top = s[d - 1];
+                for (size_t k = d - 1; k > 0; --k)
+                    s[k] = s[k - 1];
+                s[0] = top;
+            }
+            // Drop, Clear, Deg, Rad, Grad only change the depth or the angle unit, which are known
+        }
+    };
+
+
+    // C++17: the source is a constexpr char array with static storage (string literals cannot be template arguments)
+    template<const char* Source>
+    struct _StaticSourceArray
+    {
+        static constexpr std::string_view Text() { return Source; }
+    };
+    template<const char* Source>
+    using StaticProgram = BasicStaticProgram<_StaticSourceArray<Source>>;
+
+
+#if __cplusplus >= 202002L
+    // C++20: the source is a string literal, e.g. StaticRpn<"x 1.8 * 32 +">(celsius)
+    template<size_t N>
+    struct StaticSource
+    {
+        char Chars[N] = {};
+        constexpr StaticSource(const char (&chars)[N]) { for (size_t i = 0; i < N; ++i) Chars[i] = chars[i]; }
+    };
+
+    template<StaticSource Source>
+    struct _StaticSourceLiteral
+    {
+        static constexpr std::string_view Text() { return {Source.Chars, sizeof(Source.Chars) - 1}; }
+    };
+    template<StaticSource Source>
+    inline constexpr BasicStaticProgram<_StaticSourceLiteral<Source>> StaticRpn{};
+#endif
+
+}
@@ -0,0 +1,182 @@
+#include "rpn_stream.h"
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define RPN_HAS_MMAP
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+
+namespace RpnCalculator
+{
+    void AppendRoundTripValue(double v, std::string& output)
+    {
+        char text[32];
+#if defined(__cpp_lib_to_chars)
+        auto [end, error] = std::to_chars(text, text + sizeof(text), v);
+        if (error == std::errc())
+        {
+            output.append(text, (size_t)(end - text));
+            return;
+        }
+#endif
+        int length = snprintf(text, sizeof(text), "%.17g", v);
+        output.append(text, (size_t)length);
+    }
+
+    const char* LineEvaluator::EvaluateLines(const char* begin, const char* end, std::string& output)
+    {
+        const char* lineStart = begin;
+        while (lineStart < end)
+        {
+            const char* lineEnd = (const char*)memchr(lineStart, '\n', (size_t)(end - lineStart));
+            if (lineEnd == nullptr)
+                break;
+            EvaluateLine(std::string_view(lineStart, (size_t)(lineEnd - lineStart)), output);
+            lineStart = lineEnd + 1;
+        }
+        return lineStart;
+    }
+
+    void LineEvaluator::EvaluateLine(std::string_view line, std::string& output)
+    {
+        bool success = CompileProgram(line, _program, _errorMessage);
+        if (success)
+        {
+            _vm.AngleUnit = AngleUnitType::Deg;
+            _vm.StoredValue = 0.;
+            _vm.Input = 0.;
+            _stack.assign(nullptr, nullptr);
+            success = _vm.Run(_program, _stack);
+            if (!success)
+                _errorMessage = _vm.ErrorMessage;
+        }
+
+        if (!success)
+        {
+            ++NbErrors;
+            output += "Error: ";
+            output += _errorMessage;
+        }
+        else
+        {
+            for (size_t i = 0; i < _stack.size(); ++i)
+            {
+                if (i > 0)
+                    output += ' ';
+                AppendRoundTripValue(_stack[(int)i], output);
+            }
+        }
+        output += '\n';
+    }
+
+
+    bool ParallelLineEvaluator::EvaluateLines(const char* begin, const char* end, ThreadPool& threadPool,
+                                              const std::function<bool(const std::string&)>& write)
+    {
+        _workerEvaluators.resize(threadPool.size());
+        for (auto& evaluator: _workerEvaluators)
+            evaluator.NbErrors = 0;
+        size_t nbChunksPerWindow = threadPool.size() * NbChunksPerWorker;
+        _chunkOutputs.resize(nbChunksPerWindow);
+
+        bool success = true;
+        const char* windowStart = begin;
+        while (windowStart < end && success)
+        {
+            // Chunk bounds: each chunk ends after an end of line (or at the end of the range)
+            _chunkBounds.clear();
+            _chunkBounds.push_back(windowStart);
+            while (_chunkBounds.size() <= nbChunksPerWindow && _chunkBounds.back() < end)
+            {
+                const char* chunkStart = _chunkBounds.back();
+                const char* chunkEnd = ((size_t)(end - chunkStart) <= ChunkSize) ? end : chunkStart + ChunkSize;
+                if (chunkEnd < end)
+                {
+                    const char* endOfLine = (const char*)memchr(chunkEnd - 1, '\n', (size_t)(end - chunkEnd + 1));
+                    chunkEnd = endOfLine ? endOfLine + 1 : end;
+                }
+                _chunkBounds.push_back(chunkEnd);
+            }
+            size_t nbChunks = _chunkBounds.size() - 1;
+
+            threadPool.ParallelFor(nbChunks, 1, [this](size_t firstChunk, size_t lastChunk, size_t workerIndex) {
+                LineEvaluator& evaluator = _workerEvaluators[workerIndex];
+                for (size_t c = firstChunk; c < lastChunk; ++c)
+                {
+                    std::string& output = _chunkOutputs[c];
+                    output.clear();
+                    const char* chunkEnd = _chunkBounds[c + 1];
+                    const char* tail = evaluator.EvaluateLines(_chunkBounds[c], chunkEnd, output);
+                    if (tail < chunkEnd) // last line of the range, without end of line
+                        evaluator.EvaluateLine(std::string_view(tail, (size_t)(chunkEnd - tail)), output);
+                }
+            });
+
+            for (size_t c = 0; c < nbChunks && success; ++c)
+                success = write(_chunkOutputs[c]);
+            windowStart = _chunkBounds.back();
+        }
+
+        NbErrors = 0;
+        for (const auto& evaluator: _workerEvaluators)
+            NbErrors += evaluator.NbErrors;
+        return success;
+    }
+
+
+    MappedFile::MappedFile(const char* path)
+    {
+#ifdef RPN_HAS_MMAP
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            ErrorMessage = std::string("cannot open ") + path + ": " + strerror(errno);
+            return;
+        }
+        struct stat fileStatus;
+        if (fstat(fd, &fileStatus) != 0 || !S_ISREG(fileStatus.st_mode))
+        {
+            ErrorMessage = std::string(path) + " is not a regular file";
+            close(fd);
+            return;
+        }
+        _size = (size_t)fileStatus.st_size;
+        if (_size == 0) // mmap does not accept an empty mapping
+        {
+            _isMapped = true;
+            close(fd);
+            return;
+        }
+        void* mapping = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            ErrorMessage = std::string("cannot map ") + path + ": " + strerror(errno);
+            _size = 0;
+            return;
+        }
+        madvise(mapping, _size, MADV_SEQUENTIAL);
+        _data = (const char*)mapping;
+        _isMapped = true;
+#else
+        (void)path;
+        ErrorMessage = "memory mapped files are not supported on this platform";
+#endif
+    }
+
+    MappedFile::~MappedFile()
+    {
+#ifdef RPN_HAS_MMAP
+        if (_data != nullptr)
+            munmap((void*)_data, _size);
+#endif
+    }
+
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include "rpn_bytecode.h"
+#include "rpn_thread_pool.h"
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+namespace RpnCalculator
+{
+    // Evaluates a stream of RPN expressions, one per line (e.g. a log of "3 4 +" lines), for rpn_cli --lines.
+    //
+    // Each line is an independent program: it starts with an empty stack and fresh registers ("x" is 0).
+    // For each input line, one output line is appended: the final stack (bottom first, separated by spaces,
+    // in the shortest form that reads back to the same double), or "Error: <message>".
+    struct LineEvaluator
+    {
+        size_t NbErrors = 0;
+
+        // Evaluates the complete lines of [begin, end), and returns a pointer past the last complete line
+        // (the incomplete tail is left to the caller, who will complete it with the next read).
+        const char* EvaluateLines(const char* begin, const char* end, std::string& output);
+        // Evaluates one line (without its end of line)
+        void EvaluateLine(std::string_view line, std::string& output);
+
+    private:
+        Program _program;
+        VirtualMachine _vm;
+        CalculatorStack _stack;
+        std::string _errorMessage;
+    };
+
+    // Evaluates the lines of a big in-memory range (e.g. a MappedFile) with the workers of a pool.
+    // The range is split at line boundaries into chunks of about ChunkSize bytes, which are evaluated in place
+    // (no copy of the input), by windows of a few chunks per worker: the outputs of the chunks are then passed
+    // to `write` in input order, so that the memory used for the outputs stays bounded.
+    struct ParallelLineEvaluator
+    {
+        static constexpr size_t ChunkSize = 1 << 20;
+        static constexpr size_t NbChunksPerWorker = 4; // per window
+
+        size_t NbErrors = 0;
+
+        // Returns false if `write` fails
+        bool EvaluateLines(const char* begin, const char* end, ThreadPool& threadPool,
+                           const std::function<bool(const std::string&)>& write);
+
+    private:
+        std::vector<LineEvaluator> _workerEvaluators;
+        std::vector<std::string> _chunkOutputs;
+        std::vector<const char*> _chunkBounds;
+    };
+
+
+    // A read-only memory mapping of a whole file.
+    // is_mapped() is false if the file cannot be mapped (e.g. a pipe, or a platform without mmap):
+    // ErrorMessage then tells why, and the caller may fall back to reading the file.
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const char* path);
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool is_mapped() const { return _isMapped; }
+        const char* data() const { return _data; }
+        size_t size() const { return _size; }
+
+        std::string ErrorMessage;
+
+    private:
+        bool _isMapped = false;
+        const char* _data = nullptr;
+        size_t _size = 0;
+    };
+
+
+    // Appends the shortest representation of v that reads back to the same double
+    void AppendRoundTripValue(double v, std::string& output);
+
+}
@@ -0,0 +1,139 @@
+#include "rpn_thread_pool.h"
+
+
+namespace RpnCalculator
+{
+    ThreadPool::ThreadPool(size_t nbWorkers)
+    {
+        if (nbWorkers == 0)
+            nbWorkers = std::thread::hardware_concurrency();
+        if (nbWorkers == 0)
+            nbWorkers = 1;
+        for (size_t i = 0; i < nbWorkers; ++i)
+            _queues.push_back(std::make_unique<WorkQueue>());
+        for (size_t i = 1; i < nbWorkers; ++i)
+            _threads.emplace_back([this, i]() { _workerLoop(i); });
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_wakeMutex);
+            _stop = true;
+        }
+        _wakeCondition.notify_all();
+        for (auto& thread: _threads)
+            thread.join();
+    }
+
+    void ThreadPool::ParallelFor(size_t count, size_t chunkSize, const std::function<void(size_t, size_t, size_t)>& fn)
+    {
+        if (count == 0)
+            return;
+        if (chunkSize == 0)
+            chunkSize = 1;
+        size_t nbChunks = (count + chunkSize - 1) / chunkSize;
+
+        // Also taken when the chunks run on this thread: fn uses the scratch data of worker 0
+        std::lock_guard<std::mutex> parallelForLock(_parallelForMutex);
+        if (nbChunks == 1 || size() == 1)
+        {
+            for (size_t begin = 0; begin < count; begin += chunkSize)
+                fn(begin, (count - begin < chunkSize) ? count : begin + chunkSize, 0);
+            return;
+        }
+
+        _job = &fn;
+        _nbPendingChunks = nbChunks;
+
+        // Worker w gets the chunks [w * nbChunks / size(), (w + 1) * nbChunks / size())
+        for (size_t w = 0; w < size(); ++w)
+        {
+            size_t firstChunk = w * nbChunks / size(), lastChunk = (w + 1) * nbChunks / size();
+            std::lock_guard<std::mutex> lock(_queues[w]->Mutex);
+            for (size_t c = firstChunk; c < lastChunk; ++c)
+            {
+                size_t begin = c * chunkSize;
+                size_t end = (count - begin < chunkSize) ? count : begin + chunkSize;
+                // pushed in reverse order, so that the owner pops them in increasing order
+                _queues[w]->Chunks.push_front({begin, end});
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(_wakeMutex);
+            ++_jobGeneration;
+        }
+        _wakeCondition.notify_all();
+
+        _runChunks(0);
+
+        std::unique_lock<std::mutex> lock(_wakeMutex);
+        _doneCondition.wait(lock, [this]() { return _nbPendingChunks == 0; });
+        _job = nullptr;
+    }
+
+    void ThreadPool::_workerLoop(size_t workerIndex)
+    {
+        size_t seenGeneration = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(_wakeMutex);
+                _wakeCondition.wait(lock, [&]() { return _stop || _jobGeneration != seenGeneration; });
+                if (_stop)
+                    return;
+                seenGeneration = _jobGeneration;
+            }
+            _runChunks(workerIndex);
+        }
+    }
+
+    void ThreadPool::_runChunks(size_t workerIndex)
+    {
+        Chunk chunk;
+        while (_popLocal(workerIndex, chunk) || _steal(workerIndex, chunk))
+        {
+            // _job was set before the chunk was queued (and the queue mutex orders both)
+            (*_job)(chunk.Begin, chunk.End, workerIndex);
+            if (--_nbPendingChunks == 0)
+            {
+                std::lock_guard<std::mutex> lock(_wakeMutex);
+                _doneCondition.notify_all();
+            }
+        }
+    }
+
+    bool ThreadPool::_popLocal(size_t workerIndex, Chunk& chunk)
+    {
+        WorkQueue& queue = *_queues[workerIndex];
+        std::lock_guard<std::mutex> lock(queue.Mutex);
+        if (queue.Chunks.empty())
+            return false;
+        chunk = queue.Chunks.back();
+        queue.Chunks.pop_back();
+        return true;
+    }
+
+    bool ThreadPool::_steal(size_t workerIndex, Chunk& chunk)
+    {
+        // Visit the other queues starting with the next one, so that thieves spread over the victims
+        for (size_t i = 1; i < size(); ++i)
+        {
+            WorkQueue& queue = *_queues[(workerIndex + i) % size()];
+            std::lock_guard<std::mutex> lock(queue.Mutex);
+            if (queue.Chunks.empty())
+                continue;
+            chunk = queue.Chunks.front();
+            queue.Chunks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    ThreadPool& SharedThreadPool()
+    {
+        static ThreadPool threadPool;
+        return threadPool;
+    }
+
+}
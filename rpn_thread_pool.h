@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace RpnCalculator
+{
+    // A work-stealing thread pool, for data-parallel loops (e.g. a column of rows split into chunks).
+    //
+    // ParallelFor() deals the chunks out to per-worker queues, in contiguous runs (worker w gets the w-th part of
+    // the range, which keeps the memory accesses of each worker local). Each worker pops chunks from the back of
+    // its own queue, and when it is empty, steals chunks from the front of the other queues: fast workers take
+    // over the work of slow ones, and all workers finish at about the same time.
+    //
+    // The thread calling ParallelFor() works as worker 0 while it waits: a pool of size 1 has no thread,
+    // and runs everything on the caller.
+    class ThreadPool
+    {
+    public:
+        // nbWorkers == 0: one worker per hardware thread
+        explicit ThreadPool(size_t nbWorkers = 0);
+        ~ThreadPool();
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        size_t size() const { return _queues.size(); }
+
+        // Calls fn(begin, end, workerIndex) for chunks of [0, count) (of chunkSize elements, except the last one),
+        // and returns when all of them are done. workerIndex is in [0, size()): fn may use it to index per-worker
+        // scratch data. Calls from several threads are serialized (fn may not call ParallelFor on the same pool).
+        void ParallelFor(size_t count, size_t chunkSize, const std::function<void(size_t, size_t, size_t)>& fn);
+
+    private:
+        struct Chunk
+        {
+            size_t Begin, End;
+        };
+        struct WorkQueue
+        {
+            std::mutex Mutex;
+            std::deque<Chunk> Chunks;
+        };
+
+        void _workerLoop(size_t workerIndex);
+        void _runChunks(size_t workerIndex);
+        bool _popLocal(size_t workerIndex, Chunk& chunk);
+        bool _steal(size_t workerIndex, Chunk& chunk);
+
+        std::vector<std::unique_ptr<WorkQueue>> _queues;   // one per worker
+        std::vector<std::thread> _threads;                 // workers 1..size()-1
+
+        std::mutex _parallelForMutex;                      // one ParallelFor at a time
+        const std::function<void(size_t, size_t, size_t)>* _job = nullptr;
+        std::atomic<size_t> _nbPendingChunks{0};
+
+        std::mutex _wakeMutex;
+        std::condition_variable _wakeCondition;            // workers: a new job is available (or stop)
+        std::condition_variable _doneCondition;            // caller: all the chunks are done
+        size_t _jobGeneration = 0;
+        bool _stop = false;
+    };
+
+    // A pool with one worker per hardware thread, for the code which has no pool at hand (e.g. the reductions of
+    // CalculatorState). Its threads are started when it is first used, and live until the end of the process
+    ThreadPool& SharedThreadPool();
+
+}
@@ -0,0 +1,198 @@
+#include "rpn_vector.h"
+#include "rpn_simd_kernels.h"
+#include "rpn_thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+
+namespace RpnCalculator
+{
+    // Numbers are broadcast through a block filled with them, and the trigonometric operators convert their arguments
+    // by blocks: the blocks stay in the L1 cache
+    static constexpr size_t kVectorBlockSize = 1024;
+
+
+    bool ApplyVectorBinaryOperator(OpCode op, const StackValue& a, const StackValue& b, StackVector& result,
+                                   std::string& errorMessage)
+    {
+        if (a.is_vector() && b.is_vector() && a.Vector->size() != b.Vector->size())
+        {
+            errorMessage = "Vectors of different sizes";
+            return false;
+        }
+        const size_t n = a.is_vector() ? a.Vector->size() : b.Vector->size();
+        auto values = std::make_shared<std::vector<double>>(n);
+
+        double aBlock[kVectorBlockSize], bBlock[kVectorBlockSize];
+        if (!a.is_vector())
+            std::fill(aBlock, aBlock + kVectorBlockSize, a.Scalar);
+        if (!b.is_vector())
+            std::fill(bBlock, bBlock + kVectorBlockSize, b.Scalar);
+
+        for (size_t start = 0; start < n; start += kVectorBlockSize)
+        {
+            size_t count = (n - start < kVectorBlockSize) ? n - start : kVectorBlockSize;
+            const double* as = a.is_vector() ? a.Vector->data() + start : aBlock;
+            const double* bs = b.is_vector() ? b.Vector->data() + start : bBlock;
+            double* out = values->data() + start;
+            switch (op)
+            {
+                case OpCode::Add: Kernels::Add(as, bs, out, count); break;
+                case OpCode::Subtract: Kernels::Subtract(as, bs, out, count); break;
+                case OpCode::Multiply: Kernels::Multiply(as, bs, out, count); break;
+                case OpCode::Divide:
+                    Kernels::Divide(as, bs, out, count);
+                    for (size_t i = 0; i < count; ++i)
+                        out[i] = (bs[i] == 0.) ? std::numeric_limits<double>::quiet_NaN() : out[i];
+                    break;
+                case OpCode::Power: Kernels::Power(as, bs, out, count); break;
+                default: break;
+            }
+        }
+        result = std::move(values);
+        return true;
+    }
+
+    // Converts the arguments to radians by blocks, then applies the kernel (which takes radians)
+    template<AngleUnitType Unit>
+    static void _applyTrigonometricKernel(void (*kernel)(const double*, double*, size_t), const double* in, double* out,
+                                          size_t n)
+    {
+        if constexpr (Unit == AngleUnitType::Rad)
+            kernel(in, out, n);
+        else
+        {
+            double radians[kVectorBlockSize];
+            for (size_t start = 0; start < n; start += kVectorBlockSize)
+            {
+                size_t count = (n - start < kVectorBlockSize) ? n - start : kVectorBlockSize;
+                for (size_t i = 0; i < count; ++i)
+                    radians[i] = ToRadian<Unit>(in[start + i]);
+                kernel(radians, out + start, count);
+            }
+        }
+    }
+
+    StackVector ApplyVectorUnaryOperator(OpCode op, const std::vector<double>& operand, AngleUnitType angleUnit)
+    {
+        const size_t n = operand.size();
+        auto values = std::make_shared<std::vector<double>>(n);
+        const double* in = operand.data();
+        double* out = values->data();
+
+        #define RPN_VECTOR_LANES(expr) { \
+            for (size_t i = 0; i < n; ++i) { double a = in[i]; out[i] = (expr); } \
+            break; }
+        // The loop is specialized on the angle unit (Unit)
+        #define RPN_VECTOR_LANES_ANGLE(expr) { \
+            WithAngleUnit(angleUnit, [&](auto unit) { \
+                constexpr AngleUnitType Unit = decltype(unit)::value; \
+                for (size_t i = 0; i < n; ++i) { double a = in[i]; out[i] = (expr); } \
+            }); \
+            break; }
+        #define RPN_VECTOR_KERNEL_TRIGONOMETRIC(kernel) { \
+            WithAngleUnit(angleUnit, [&](auto unit) { \
+                _applyTrigonometricKernel<decltype(unit)::value>(Kernels::kernel, in, out, n); \
+            }); \
+            break; }
+
+        switch (op)
+        {
+            case OpCode::Sin: RPN_VECTOR_KERNEL_TRIGONOMETRIC(Sin)
+            case OpCode::Cos: RPN_VECTOR_KERNEL_TRIGONOMETRIC(Cos)
+            case OpCode::Tan: RPN_VECTOR_KERNEL_TRIGONOMETRIC(Tan)
+            case OpCode::ArcSin: RPN_VECTOR_LANES_ANGLE(FromRadian<Unit>(asin(a)))
+            case OpCode::ArcCos: RPN_VECTOR_LANES_ANGLE(FromRadian<Unit>(acos(a)))
+            case OpCode::ArcTan: RPN_VECTOR_LANES_ANGLE(FromRadian<Unit>(atan(a)))
+            case OpCode::Reciprocal: RPN_VECTOR_LANES(1. / a)
+            case OpCode::Log10: Kernels::Log10(in, out, n); break;
+            case OpCode::Ln: Kernels::Ln(in, out, n); break;
+            case OpCode::Pow10: Kernels::Pow10(in, out, n); break;
+            case OpCode::Exp: Kernels::Exp(in, out, n); break;
+            case OpCode::Sqrt: Kernels::Sqrt(in, out, n); break;
+            case OpCode::Square: RPN_VECTOR_LANES(a * a)
+            case OpCode::Floor: Kernels::Floor(in, out, n); break;
+            case OpCode::PlusMinus: RPN_VECTOR_LANES(-a)
+            case OpCode::ToDeg: RPN_VECTOR_LANES_ANGLE(FromRadian<AngleUnitType::Deg>(ToRadian<Unit>(a)))
+            case OpCode::ToRad: RPN_VECTOR_LANES_ANGLE(ToRadian<Unit>(a))
+            case OpCode::ToGrad: RPN_VECTOR_LANES_ANGLE(FromRadian<AngleUnitType::Grad>(ToRadian<Unit>(a)))
+            default: break;
+        }
+
+        #undef RPN_VECTOR_LANES
+        #undef RPN_VECTOR_LANES_ANGLE
+        #undef RPN_VECTOR_KERNEL_TRIGONOMETRIC
+
+        return values;
+    }
+
+    // 256 pairwise blocks (see Kernels::Sum): 512KB per chunk. The shared thread pool is used from 4 chunks on,
+    // below which starting the workers costs more than it saves
+    static constexpr size_t kReductionChunkSize = 65536;
+    static constexpr size_t kMinParallelChunks = 4;
+
+    // Returns the results of reduceChunk(chunkValues, chunkCount) for each chunk of the values, in order
+    template<typename ReduceChunk>
+    static std::vector<double> _reduceChunks(const double* values, size_t count, ReduceChunk reduceChunk)
+    {
+        const size_t nbChunks = (count + kReductionChunkSize - 1) / kReductionChunkSize;
+        std::vector<double> partials(nbChunks);
+        auto reduceRange = [&](size_t begin, size_t end, size_t) {
+            for (size_t chunk = begin; chunk < end; ++chunk)
+            {
+                size_t start = chunk * kReductionChunkSize;
+                size_t chunkCount = (count - start < kReductionChunkSize) ? count - start : kReductionChunkSize;
+                partials[chunk] = reduceChunk(values + start, chunkCount);
+            }
+        };
+        if (nbChunks >= kMinParallelChunks)
+            SharedThreadPool().ParallelFor(nbChunks, 1, reduceRange);
+        else
+            reduceRange(0, nbChunks, 0);
+        return partials;
+    }
+
+    // Reduces the chunks with kernel, then their results with combine
+    static double _reduce(const double* values, size_t count, double (*kernel)(const double*, size_t),
+                          double (*combine)(const double*, size_t))
+    {
+        std::vector<double> partials = _reduceChunks(values, count, kernel);
+        return combine(partials.data(), partials.size());
+    }
+
+    bool ReduceValues(OpCode op, const double* values, size_t count, double& result)
+    {
+        size_t minCount = 1;
+        if (op == OpCode::Sum || op == OpCode::Product)
+            minCount = 0;
+        else if (op == OpCode::Variance || op == OpCode::StdDev)
+            minCount = 2;
+        if (count < minCount)
+            return false;
+
+        switch (op)
+        {
+            case OpCode::Sum: result = _reduce(values, count, Kernels::Sum, Kernels::Sum); break;
+            case OpCode::Product: result = _reduce(values, count, Kernels::Product, Kernels::Product); break;
+            case OpCode::Mean: result = _reduce(values, count, Kernels::Sum, Kernels::Sum) / (double)count; break;
+            case OpCode::Variance:
+            case OpCode::StdDev:
+            {
+                double mean = _reduce(values, count, Kernels::Sum, Kernels::Sum) / (double)count;
+                std::vector<double> partials = _reduceChunks(values, count, [mean](const double* in, size_t n) {
+                    return Kernels::SumOfSquaredDeviations(in, n, mean);
+                });
+                result = Kernels::Sum(partials.data(), partials.size()) / (double)(count - 1);
+                if (op == OpCode::StdDev)
+                    result = sqrt(result);
+                break;
+            }
+            case OpCode::Min: result = _reduce(values, count, Kernels::Min, Kernels::Min); break;
+            case OpCode::Max: result = _reduce(values, count, Kernels::Max, Kernels::Max); break;
+            default: return false;
+        }
+        return true;
+    }
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "rpn_calculator.h"
+#include <string>
+
+
+namespace RpnCalculator
+{
+    // Element-wise operators on vectors (see StackVector): CalculatorState applies its binary and unary operators to
+    // all the values of a vector with one key, using the vectorized kernels of rpn_simd_kernels.h.
+    //
+    // Binary operators take two vectors of the same size, or a vector and a number (which is broadcast to all the
+    // values). As for the rows of BatchEvaluator:
+    //     * a value divided by zero gives NaN (the other values are computed, and no error is reported)
+    //     * the transcendental operators may differ from the scalar path by the ulp bounds documented in
+    //       rpn_simd_kernels.h. Operators without a kernel (sin^-1, cos^-1, tan^-1) use libm, value by value.
+    // The angle unit is tested once per operator (see WithAngleUnit), not once per value.
+
+    // op: +, -, *, /, y^x. a or b (or both) is a vector.
+    // Returns false and fills errorMessage if the vectors have different sizes.
+    bool ApplyVectorBinaryOperator(OpCode op, const StackValue& a, const StackValue& b, StackVector& result,
+                                   std::string& errorMessage);
+
+    // op: sin ... floor (see CalculatorState::_onUnaryOperator), +/-, To Deg, To Rad, To Grad
+    StackVector ApplyVectorUnaryOperator(OpCode op, const std::vector<double>& operand, AngleUnitType angleUnit);
+
+
+    // Reductions of a vector, or of the whole stack, to a single number: Sum, Prod, Mean, Var, Std, Min, Max.
+    //     * the sums are pairwise (see Kernels::Sum): their error grows with log(count), not with count
+    //     * Var and Std are those of a sample (divided by count - 1), computed in two passes (the mean, then the
+    //       squared deviations from it), which avoids the cancellation of sum(x^2) - sum(x)^2 / count
+    //     * Min and Max give NaN if a value is NaN
+    // The values are reduced by chunks of a fixed size, then the results of the chunks are reduced: large inputs are
+    // reduced on SharedThreadPool(), and the result does not depend on the number of threads.
+    // Returns false if there are not enough values (one for Mean, Min and Max, two for Var and Std).
+    bool ReduceValues(OpCode op, const double* values, size_t count, double& result);
+
+}